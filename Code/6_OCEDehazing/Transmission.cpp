@@ -13,11 +13,190 @@
 	The transmission estimation is block based approach, and thus its performance
 	depends on the size of block.
 
+	The sums of the block search (BlockSum) are specialized for the common block
+	widths (8, 16, 32, 40, 64) and selected by the dispatch table m_astBlockSum,
+	with a generic loop for the other widths and the clipped blocks.
+	The color estimation sums the planar R, G, B images with SSE2 (BlockSumSSE2).
+
+	The dark channel prior (TransmissionEstimationDark) is an alternative to the
+	block search, with the van Herk/Gil-Werman minimum filter (MinFilterColumns).
+
 	Last updated: 2013-02-07
 	Author: Jin-Hwan, Kim.
  */
 #include "dehazing.h"
 
+/*
+	Function: BlockSum
+	Description: sums of the restored block for a transmission candidate,
+		the inner loop of NFTrsEstimation*. The width of the block is a template
+		parameter, hence the loop over a row is unrolled and vectorized.
+		The loss is computed without branches,
+		(nOut - 255)^2 if nOut > 255, nOut^2 if nOut < 0, 0 otherwise.
+	Parameters:
+		pnImageY - top left pixel of the block
+		nStride - width of the image
+		nCols - width of the block (BlockSumGeneric only)
+		nRows - height of the block
+		nAirlight - Y of the atmospheric light
+		nTrans - 128 / transmission
+	Return:
+		pnSums - sum of loss, sum of squared outputs, sum of outputs
+ */
+template <int nBlockW>
+static void BlockSum(const int* pnImageY, int nStride, int /*nCols*/, int nRows, int nAirlight, int nTrans, int* pnSums)
+{
+	int nSumofSLoss = 0, nSumofSquaredOuts = 0, nSumofOuts = 0;
+
+	for (int nY = 0; nY < nRows; nY++, pnImageY += nStride)
+	{
+		for (int nX = 0; nX < nBlockW; nX++)
+		{
+			int nOut = ((pnImageY[nX] - nAirlight) * nTrans + 128 * nAirlight) >> 7;
+			int nHigh = nOut > 255 ? nOut - 255 : 0;
+			int nLow = nOut < 0 ? nOut : 0;
+			nSumofSLoss += nHigh * nHigh + nLow * nLow;
+			nSumofSquaredOuts += nOut * nOut;
+			nSumofOuts += nOut;
+		}
+	}
+
+	pnSums[0] = nSumofSLoss;
+	pnSums[1] = nSumofSquaredOuts;
+	pnSums[2] = nSumofOuts;
+}
+
+static void BlockSumGeneric(const int* pnImageY, int nStride, int nCols, int nRows, int nAirlight, int nTrans, int* pnSums)
+{
+	int nSumofSLoss = 0, nSumofSquaredOuts = 0, nSumofOuts = 0;
+
+	for (int nY = 0; nY < nRows; nY++, pnImageY += nStride)
+	{
+		for (int nX = 0; nX < nCols; nX++)
+		{
+			int nOut = ((pnImageY[nX] - nAirlight) * nTrans + 128 * nAirlight) >> 7;
+			int nHigh = nOut > 255 ? nOut - 255 : 0;
+			int nLow = nOut < 0 ? nOut : 0;
+			nSumofSLoss += nHigh * nHigh + nLow * nLow;
+			nSumofSquaredOuts += nOut * nOut;
+			nSumofOuts += nOut;
+		}
+	}
+
+	pnSums[0] = nSumofSLoss;
+	pnSums[1] = nSumofSquaredOuts;
+	pnSums[2] = nSumofOuts;
+}
+
+// dispatch table of the specialized block widths
+static const struct
+{
+	int		nBlockW;
+	BlockSumFunc pfnBlockSum;
+} m_astBlockSum[] =
+{
+	{ 8, BlockSum<8> },
+	{ 16, BlockSum<16> },
+	{ 32, BlockSum<32> },
+	{ 40, BlockSum<40> },
+	{ 64, BlockSum<64> },
+};
+
+/*
+	Function: SelectBlockSum
+	Return: BlockSum of the block width, BlockSumGeneric if it is not specialized
+ */
+static BlockSumFunc SelectBlockSum(int nCols)
+{
+	for (int nI = 0; nI < (int)(sizeof(m_astBlockSum) / sizeof(m_astBlockSum[0])); nI++)
+	{
+		if (m_astBlockSum[nI].nBlockW == nCols)
+			return m_astBlockSum[nI].pfnBlockSum;
+	}
+	return BlockSumGeneric;
+}
+
+/*
+	Function: BlockSumSSE2
+	Description: the sums of BlockSum with SSE2, 8 pixels at a time, for the
+		planar R, G, B images of the color estimation. The restored value is in
+		-596 ~ 850, hence it is computed in 16 bits:
+		_mm_madd_epi16 of the pairs (I - A, A) and (1/t, 128) gives (I - A) / t + A
+		(Q7), and the squares are summed by _mm_madd_epi16 as well.
+		The sums are the same as BlockSum.
+ */
+static void BlockSumSSE2(const int* pnImage, int nStride, int nCols, int nRows, int nAirlight, int nTrans, int* pnSums)
+{
+	const __m128i sseA = _mm_set1_epi16((short)nAirlight);
+	const __m128i sseK = _mm_setr_epi16((short)nTrans, 128, (short)nTrans, 128, (short)nTrans, 128, (short)nTrans, 128);
+	const __m128i sse255 = _mm_set1_epi16(255);
+	const __m128i sseOne = _mm_set1_epi16(1);
+	const __m128i sseZero = _mm_setzero_si128();
+	__m128i sseLoss = _mm_setzero_si128(), sseSquared = _mm_setzero_si128(), sseSum = _mm_setzero_si128();
+	int nSumofSLoss = 0, nSumofSquaredOuts = 0, nSumofOuts = 0;
+	const int nCols8 = nCols & ~7;
+	int nX, nY;
+
+	for (nY = 0; nY < nRows; nY++, pnImage += nStride)
+	{
+		for (nX = 0; nX < nCols8; nX += 8)
+		{
+			__m128i sseI = _mm_packs_epi32(_mm_loadu_si128((const __m128i*)(pnImage + nX)), _mm_loadu_si128((const __m128i*)(pnImage + nX + 4)));
+			__m128i sseD = _mm_sub_epi16(sseI, sseA);
+			__m128i sseOutL = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(sseD, sseA), sseK), 7);
+			__m128i sseOutH = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(sseD, sseA), sseK), 7);
+			__m128i sseOut = _mm_packs_epi32(sseOutL, sseOutH);
+			__m128i sseHigh = _mm_max_epi16(_mm_sub_epi16(sseOut, sse255), sseZero);
+			__m128i sseLow = _mm_min_epi16(sseOut, sseZero);
+
+			sseLoss = _mm_add_epi32(sseLoss, _mm_add_epi32(_mm_madd_epi16(sseHigh, sseHigh), _mm_madd_epi16(sseLow, sseLow)));
+			sseSquared = _mm_add_epi32(sseSquared, _mm_madd_epi16(sseOut, sseOut));
+			sseSum = _mm_add_epi32(sseSum, _mm_madd_epi16(sseOut, sseOne));
+		}
+		for (; nX < nCols; nX++)
+		{
+			int nOut = ((pnImage[nX] - nAirlight) * nTrans + 128 * nAirlight) >> 7;
+			int nHigh = nOut > 255 ? nOut - 255 : 0;
+			int nLow = nOut < 0 ? nOut : 0;
+			nSumofSLoss += nHigh * nHigh + nLow * nLow;
+			nSumofSquaredOuts += nOut * nOut;
+			nSumofOuts += nOut;
+		}
+	}
+
+	int anLane[4];
+	_mm_storeu_si128((__m128i*)anLane, sseLoss);
+	pnSums[0] = nSumofSLoss + anLane[0] + anLane[1] + anLane[2] + anLane[3];
+	_mm_storeu_si128((__m128i*)anLane, sseSquared);
+	pnSums[1] = nSumofSquaredOuts + anLane[0] + anLane[1] + anLane[2] + anLane[3];
+	_mm_storeu_si128((__m128i*)anLane, sseSum);
+	pnSums[2] = nSumofOuts + anLane[0] + anLane[1] + anLane[2] + anLane[3];
+}
+
+/*
+	Function: BlockSumKernel
+	Description: a kernel of the dispatch table, e.g. to compare the specialized
+		block sums with the generic loop (benchmark_transmission_kernels in main.cpp).
+	Parameters:
+		nIndex - index in the dispatch table (-1: the generic loop)
+	Return:
+		kernel (NULL after the last one)
+		pnBlockW - width of the block of the kernel (0: any width)
+ */
+BlockSumFunc dehazing::BlockSumKernel(int nIndex, int* pnBlockW)
+{
+	if (nIndex < 0)
+	{
+		*pnBlockW = 0;
+		return BlockSumGeneric;
+	}
+	if (nIndex >= (int)(sizeof(m_astBlockSum) / sizeof(m_astBlockSum[0])))
+		return NULL;
+
+	*pnBlockW = m_astBlockSum[nIndex].nBlockW;
+	return m_astBlockSum[nIndex].pfnBlockSum;
+}
+
  /*
 	 Function: TransmissionEstimation
 	 Description: Estiamte the transmission in the frame(Color)
@@ -34,6 +213,12 @@ void dehazing::TransmissionEstimationColor(int* pnImageR, int* pnImageG, int* pn
 	int nX, nY, nXstep, nYstep;
 	float fTrans;
 
+	if (m_bTransDark == true)
+	{
+		TransmissionEstimationDark(pnImageR, pnImageG, pnImageB, pfTransmission, nWid, nHei);
+		return;
+	}
+
 	if (m_bPreviousFlag == true && nFrame > 0)
 	{
 		for (nY = 0; nY < nHei; nY += m_nTBlockSize)
@@ -75,53 +260,733 @@ void dehazing::TransmissionEstimationColor(int* pnImageR, int* pnImageG, int* pn
 	Function: TransmissionEstimation
 	Description: Estiamte the transmission in the frame
 				 Specified size.
+				 When the block skip is set, the static blocks (StaticBlock)
+				 reuse the transmission of the previous frame.
 	Parameters:
 		nFrame - frame no.
 		nWid - frame width
 		nHei - frame height.
 	Return:
 		m_pfTransmission
+		(with a region of interest, the blocks out of m_pucROIBlock are not estimated)
+		m_nSkippedBlocks, m_nEstimatedBlocks - statistics of the block skip
+	In the color mode (TransColorMode), the blocks are estimated from the
+	down-sampled R, G, B images (m_pnSmallRImg ~, 320*240 only).
+	(TransmissionEstimationDark is used with the dark channel prior,
+	TransmissionEstimationDense in the dense mode, and
+	TransmissionEstimationPyramid when the pyramid level is greater than 1)
  */
 void dehazing::TransmissionEstimation(int* pnImageY, float* pfTransmission, int* pnImageYP, float* pfTransmissionP, int nFrame, int nWid, int nHei)
 {
-	int nX, nY, nXstep, nYstep;
+	int nX, nY, nXstep, nYstep, nBlock;
 	float fTrans;
+	const int nBlockW = (nWid + m_nTBlockSize - 1) / m_nTBlockSize;
 
-	if (m_bPreviousFlag == true && nFrame > 0)
+	if (m_bTransDark == true)
 	{
-		for (nY = 0; nY < nHei; nY += m_nTBlockSize)
+		TransmissionEstimationDark(m_pnSmallRImg, m_pnSmallGImg, m_pnSmallBImg, pfTransmission, nWid, nHei);
+		return;
+	}
+
+	if (m_bTransDense == true)
+	{
+		TransmissionEstimationDense(pnImageY, pfTransmission, pnImageYP, pfTransmissionP, nFrame, nWid, nHei);
+		return;
+	}
+
+	if (m_nPyramidLevel > 1)
+	{
+		TransmissionEstimationPyramid(pnImageY, pfTransmission, pnImageYP, pfTransmissionP, nFrame, nWid, nHei);
+		return;
+	}
+
+	m_nSkippedBlocks = 0;
+	m_nEstimatedBlocks = 0;
+
+	for (nY = 0; nY < nHei; nY += m_nTBlockSize)
+	{
+		for (nX = 0; nX < nWid; nX += m_nTBlockSize)
 		{
-			for (nX = 0; nX < nWid; nX += m_nTBlockSize)
+			nBlock = (nY / m_nTBlockSize) * nBlockW + nX / m_nTBlockSize;
+			if (m_bROIFlag == true && m_pucROIBlock[nBlock] == 0)
+				continue;
+
+			if (m_bBlockSkip == true && nFrame > 0 && m_pucBlockAge[nBlock] < m_nRefreshPeriod
+				&& StaticBlock(pnImageY, pnImageYP, nX, nY, nWid, nHei) == true)
 			{
-				fTrans = NFTrsEstimationP(pnImageY, pnImageYP, pfTransmissionP, __max(nX, 0), __max(nY, 0), nWid, nHei);
-				for (nYstep = nY; nYstep < nY + m_nTBlockSize; nYstep++)
+				// (1) reuse the transmission of the static block
+				fTrans = pfTransmissionP[nY * nWid + nX];
+				m_pucBlockAge[nBlock]++;
+				m_nSkippedBlocks++;
+			}
+			else
+			{
+				// (2) estimate the transmission (from the R, G, B images in the color mode)
+				if (m_bTransColor == true && m_bPreviousFlag == true && nFrame > 0)
+					fTrans = NFTrsEstimationPColor(m_pnSmallRImg, m_pnSmallGImg, m_pnSmallBImg, m_pnSmallRImgP, m_pnSmallGImgP, m_pnSmallBImgP, pfTransmissionP, __max(nX, 0), __max(nY, 0), nWid, nHei);
+				else if (m_bTransColor == true)
+					fTrans = NFTrsEstimationColor(m_pnSmallRImg, m_pnSmallGImg, m_pnSmallBImg, __max(nX, 0), __max(nY, 0), nWid, nHei);
+				else if (m_bPreviousFlag == true && nFrame > 0)
+					fTrans = NFTrsEstimationP(pnImageY, pnImageYP, pfTransmissionP, __max(nX, 0), __max(nY, 0), nWid, nHei);
+				else
+					fTrans = NFTrsEstimation(pnImageY, __max(nX, 0), __max(nY, 0), nWid, nHei);
+
+				// the first refresh of the blocks is distributed over the period
+				if (m_bBlockSkip == true)
+					m_pucBlockAge[nBlock] = nFrame == 0 ? nBlock % m_nRefreshPeriod : 0;
+				m_nEstimatedBlocks++;
+			}
+
+			for (nYstep = nY; nYstep < nY + m_nTBlockSize; nYstep++)
+			{
+				for (nXstep = nX; nXstep < nX + m_nTBlockSize; nXstep++)
 				{
-					for (nXstep = nX; nXstep < nX + m_nTBlockSize; nXstep++)
-					{
-						pfTransmission[nYstep * nWid + nXstep] = fTrans;
-					}
+					pfTransmission[nYstep * nWid + nXstep] = fTrans;
 				}
 			}
 		}
 	}
-	else
+}
+
+/*
+	Function: TransmissionEstimationPyramid
+	Description: Estimate the transmission from coarse to fine.
+		The Y image is halved (2x2 mean) to build the pyramid, and the block of
+		each level (m_nTBlockSize >> level in its own pixels) covers the same
+		area as the single scale block.
+		(1) The coarsest level searches all candidates 0.3 ~ 0.9 (step 0.1).
+			The region of interest and the block skip are decided at this level.
+		(2) Each finer level searches 3 candidates around the parent transmission
+			with a half step (0.05, 0.025).
+		(3) The finest level is written to the transmission map.
+		With 3 levels, the search evaluates 7/16 + 3/4 + 3 = 4.2 candidates per
+		pixel instead of 7, and the transmission is quantized by 0.025 instead
+		of 0.1, which reduces the steps between the blocks.
+		The number of levels (TransPyramidLevel) is reduced so that the block of
+		the coarsest level is not less than 4 and the block size is divisible by
+		the scale of the coarsest level.
+	Parameters:
+		nFrame - frame no.
+		nWid - frame width
+		nHei - frame height.
+	Return:
+		m_pfTransmission
+ */
+void dehazing::TransmissionEstimationPyramid(int* pnImageY, float* pfTransmission, int* pnImageYP, float* pfTransmissionP, int nFrame, int nWid, int nHei)
+{
+	int nX, nY, nLevel, nBX, nBY;
+	int nLevels = m_nPyramidLevel;
+
+	// the block of the coarsest level is not less than 4, and covers m_nTBlockSize
+	while (nLevels > 1 && ((m_nTBlockSize >> (nLevels - 1)) < 4 || m_nTBlockSize % (1 << (nLevels - 1)) != 0))
+		nLevels--;
+
+	const int nB = m_nTBlockSize >> (nLevels - 1);
+	const bool bTemporal = m_bPreviousFlag == true && nFrame > 0;
+
+	int* apnY[3] = { pnImageY, m_pnPyramidY, m_pnPyramidY + 160 * 120 };
+	int* apnYP[3] = { pnImageYP, m_pnPyramidYP, m_pnPyramidYP + 160 * 120 };
+
+	// (0) build the pyramid of the current (and previous) Y image
+	for (nLevel = 1; nLevel < nLevels; nLevel++)
 	{
-		for (nY = 0; nY < nHei; nY += m_nTBlockSize)
+		int nW = nWid >> nLevel, nH = nHei >> nLevel, nWs = nWid >> (nLevel - 1);
+		for (nY = 0; nY < nH; nY++)
 		{
-			for (nX = 0; nX < nWid; nX += m_nTBlockSize)
+			int* pnSrc = apnY[nLevel - 1] + 2 * nY * nWs;
+			int* pnSrcP = apnYP[nLevel - 1] + 2 * nY * nWs;
+			for (nX = 0; nX < nW; nX++)
 			{
-				fTrans = NFTrsEstimation(pnImageY, __max(nX, 0), __max(nY, 0), nWid, nHei);
+				apnY[nLevel][nY * nW + nX] = (pnSrc[2 * nX] + pnSrc[2 * nX + 1] + pnSrc[nWs + 2 * nX] + pnSrc[nWs + 2 * nX + 1] + 2) >> 2;
+				if (bTemporal == true)
+					apnYP[nLevel][nY * nW + nX] = (pnSrcP[2 * nX] + pnSrcP[2 * nX + 1] + pnSrcP[nWs + 2 * nX] + pnSrcP[nWs + 2 * nX + 1] + 2) >> 2;
+			}
+		}
+	}
 
-				for (nYstep = nY; nYstep < nY + m_nTBlockSize; nYstep++)
+	m_nSkippedBlocks = 0;
+	m_nEstimatedBlocks = 0;
+
+	// (1) coarsest level
+	// the blocks of every level are indexed by the single scale block grid
+	const int nTop = nLevels - 1;
+	const int nGridW = (nWid + m_nTBlockSize - 1) / m_nTBlockSize;
+	const int nGridH = (nHei + m_nTBlockSize - 1) / m_nTBlockSize;
+	int nBlock;
+
+	for (nBY = 0; nBY < nGridH; nBY++)
+	{
+		for (nBX = 0; nBX < nGridW; nBX++)
+		{
+			int nX0 = nBX * m_nTBlockSize, nY0 = nBY * m_nTBlockSize;	// top left point in the frame
+			nBlock = nBY * nGridW + nBX;
+
+			m_pucPyramidState[nBlock] = 0;
+			if (m_bROIFlag == true && m_pucROIBlock[nBlock] == 0)
+			{
+				m_pucPyramidState[nBlock] = 2;
+				continue;
+			}
+
+			if (m_bBlockSkip == true && nFrame > 0 && m_pucBlockAge[nBlock] < m_nRefreshPeriod
+				&& StaticBlock(pnImageY, pnImageYP, nX0, nY0, nWid, nHei) == true)
+			{
+				// reuse the transmission of the static block
+				for (nY = nY0; nY < __min(nY0 + m_nTBlockSize, nHei); nY++)
+					memcpy(pfTransmission + nY * nWid + nX0, pfTransmissionP + nY * nWid + nX0, (__min(nX0 + m_nTBlockSize, nWid) - nX0) * sizeof(float));
+				m_pucPyramidState[nBlock] = 1;
+				m_pucBlockAge[nBlock]++;
+				m_nSkippedBlocks++;
+				continue;
+			}
+
+			m_pfPyramidTrans[nBlock] = NFTrsEstimationRange(apnY[nTop], bTemporal ? apnYP[nTop] : NULL, pfTransmissionP[nY0 * nWid + nX0],
+				nBX * nB, nBY * nB, nB, nWid >> nTop, nHei >> nTop, 0.3f, 0.1f, 7);
+
+			if (m_bBlockSkip == true)
+				m_pucBlockAge[nBlock] = nFrame == 0 ? nBlock % m_nRefreshPeriod : 0;
+			m_nEstimatedBlocks++;
+		}
+	}
+
+	// (2) finer levels
+	float fStep = 0.1f;
+	for (nLevel = nTop - 1; nLevel >= 0; nLevel--)
+	{
+		int nBL = m_nTBlockSize >> nLevel;
+		fStep *= 0.5f;
+
+		for (nBY = 0; nBY < nGridH; nBY++)
+		{
+			for (nBX = 0; nBX < nGridW; nBX++)
+			{
+				nBlock = nBY * nGridW + nBX;
+				if (m_pucPyramidState[nBlock] != 0)
+					continue;
+
+				float fMin = __max(m_pfPyramidTrans[nBlock] - fStep, 0.3f);
+				float fMax = __min(m_pfPyramidTrans[nBlock] + fStep, 0.9f);
+				int nCandidates = (int)((fMax - fMin) / fStep + 1.5f);
+				int nX0 = nBX * m_nTBlockSize, nY0 = nBY * m_nTBlockSize;
+
+				m_pfPyramidTrans[nBlock] = NFTrsEstimationRange(apnY[nLevel], bTemporal ? apnYP[nLevel] : NULL, pfTransmissionP[nY0 * nWid + nX0],
+					nBX * nBL, nBY * nBL, nBL, nWid >> nLevel, nHei >> nLevel, fMin, fStep, nCandidates);
+			}
+		}
+	}
+
+	// (3) the finest level to the transmission map
+	for (nY = 0; nY < nHei; nY++)
+	{
+		float* pfTrans = pfTransmission + nY * nWid;
+		uchar* pucState = m_pucPyramidState + (nY / m_nTBlockSize) * nGridW;
+		float* pfBlock = m_pfPyramidTrans + (nY / m_nTBlockSize) * nGridW;
+		for (nX = 0; nX < nWid; nX++)
+		{
+			if (pucState[nX / m_nTBlockSize] == 0)
+				pfTrans[nX] = pfBlock[nX / m_nTBlockSize];
+		}
+	}
+}
+
+/*
+	Function: TransmissionEstimationDense
+	Description: Estimate the transmission of each pixel with the cost of
+		NFTrsEstimation (NFTrsEstimationP) in the window of radius m_nTBlockSize / 2
+		centered at the pixel. The sums of the window are box filtered, so the
+		cost per pixel does not depend on the window size.
+		(1) The contrast cost of a candidate is the variance of the window scaled
+			by the candidate, (128 / t)^2 * var(I) / 128^2, hence only the sums of
+			I and I^2 are filtered.
+		(2) The temporal cost uses the weighted kappa of the window and the
+			previous transmission of the pixel.
+		(3) The loss of a pixel depends only on its Y, and is read from a table of
+			each candidate. The loss of the 7 candidates is filtered.
+		(4) The minimum among the candidates is refined by fitting a parabola to the
+			costs of its neighbours, thus the transmission is not quantized.
+		The static blocks are not skipped in the dense mode.
+	Parameters:
+		nFrame - frame no.
+		nWid - frame width
+		nHei - frame height.
+	Return:
+		m_pfTransmission
+		(with a region of interest, the pixels of the blocks out of m_pucROIBlock are not written)
+ */
+void dehazing::TransmissionEstimationDense(int* pnImageY, float* pfTransmission, int* pnImageYP, float* pfTransmissionP, int nFrame, int nWid, int nHei)
+{
+	const int nR = __max(m_nTBlockSize / 2, 1);
+	const int nSize = nWid * nHei;
+	const int nBlockW = (nWid + m_nTBlockSize - 1) / m_nTBlockSize;
+	const bool bTemporal = m_bPreviousFlag == true && nFrame > 0;
+	int nX, nY, nIdx, nCounter;
+
+	long long* pnInit = new long long[nSize];
+	long long* pnSum = new long long[nSize];
+	float* pfInvN = new float[nSize];			// 1 / number of pixels in the window
+	float* pfVar = new float[nSize];			// variance of the window
+	float* pfCost = new float[nSize * 7];		// cost of each candidate
+	float* pfPreTrs = NULL;						// updated previous transmission
+	float* pfTempW = NULL;						// weight of the temporal cost
+
+	// candidates of NFTrsEstimation
+	float afTrans[7];
+	int anTrans[7];
+	float fTrans = 0.3f;
+	for (nCounter = 0; nCounter < 7; nCounter++)
+	{
+		afTrans[nCounter] = fTrans;
+		anTrans[nCounter] = nCounter == 0 ? 427 : (int)(1.0f / fTrans * 128.0f);
+		fTrans += 0.1f;
+	}
+
+	// (0) number of pixels of the window (clipped at the border)
+	for (nY = 0; nY < nHei; nY++)
+	{
+		int nRows = __min(nY + nR, nHei - 1) - __max(nY - nR, 0) + 1;
+		for (nX = 0; nX < nWid; nX++)
+			pfInvN[nY * nWid + nX] = 1.0f / (float)(nRows * (__min(nX + nR, nWid - 1) - __max(nX - nR, 0) + 1));
+	}
+
+	// (1) variance of the window
+	for (nIdx = 0; nIdx < nSize; nIdx++)
+		pnInit[nIdx] = pnImageY[nIdx];
+	BoxFilter(pnInit, nR, nWid, nHei, pnSum);
+	for (nIdx = 0; nIdx < nSize; nIdx++)
+		pfVar[nIdx] = (float)pnSum[nIdx] * pfInvN[nIdx];
+
+	for (nIdx = 0; nIdx < nSize; nIdx++)
+		pnInit[nIdx] = pnImageY[nIdx] * pnImageY[nIdx];
+	BoxFilter(pnInit, nR, nWid, nHei, pnSum);
+	for (nIdx = 0; nIdx < nSize; nIdx++)
+		pfVar[nIdx] = __max((float)pnSum[nIdx] * pfInvN[nIdx] - pfVar[nIdx] * pfVar[nIdx], 0.0f);
+
+	// (2) kappa and weight of the temporal cost
+	if (bTemporal == true)
+	{
+		float* pfW = new float[nSize];
+		float* pfWK = new float[nSize];
+		pfPreTrs = new float[nSize];
+		pfTempW = new float[nSize];
+
+		for (nIdx = 0; nIdx < nSize; nIdx++)
+		{
+			float fPreJ = (float)(pnImageYP[nIdx] - m_nAirlight);
+			pfW[nIdx] = fPreJ != 0 ? m_pfExpLUT[abs(pnImageY[nIdx] - pnImageYP[nIdx])] : 0.0f;
+			pfWK[nIdx] = fPreJ != 0 ? pfW[nIdx] * (float)(pnImageY[nIdx] - m_nAirlight) / fPreJ : 0.0f;
+		}
+		BoxFilter(pfW, nR, nWid, nHei, pfPreTrs);
+		BoxFilter(pfWK, nR, nWid, nHei, pfTempW);
+
+		for (nIdx = 0; nIdx < nSize; nIdx++)
+		{
+			float fWsum = pfPreTrs[nIdx];
+			float fPre = fWsum > 0 ? pfTransmissionP[nIdx] * pfTempW[nIdx] / fWsum : 0.0f;
+			pfPreTrs[nIdx] = fPre;
+			pfTempW[nIdx] = fPre != 0 ? m_fLambda2 / fPre / fPre * fWsum * pfInvN[nIdx] * 255.0f * 255.0f : 0.0f;
+		}
+		delete[] pfW;
+		delete[] pfWK;
+	}
+
+	// (3) cost of each candidate
+	int nMinY = 255, nMaxY = 0;
+	for (nIdx = 0; nIdx < nSize; nIdx++)
+	{
+		nMinY = __min(nMinY, pnImageY[nIdx]);
+		nMaxY = __max(nMaxY, pnImageY[nIdx]);
+	}
+
+	for (nCounter = 0; nCounter < 7; nCounter++)
+	{
+		int anLoss[256];
+		bool bLoss = false;
+		for (nIdx = 0; nIdx < 256; nIdx++)
+		{
+			int nOut = ((nIdx - m_nAirlight) * anTrans[nCounter] + 128 * m_nAirlight) >> 7;
+			anLoss[nIdx] = nOut > 255 ? (nOut - 255) * (nOut - 255) : (nOut < 0 ? nOut * nOut : 0);
+			if (nIdx >= nMinY && nIdx <= nMaxY && anLoss[nIdx] != 0)
+				bLoss = true;
+		}
+
+		// the filter is skipped when no pixel is clipped by the candidate
+		if (bLoss == true)
+		{
+			for (nIdx = 0; nIdx < nSize; nIdx++)
+				pnInit[nIdx] = anLoss[pnImageY[nIdx]];
+			BoxFilter(pnInit, nR, nWid, nHei, pnSum);
+		}
+		else
+			memset(pnSum, 0, nSize * sizeof(long long));
+
+		const float fContrast = (float)(anTrans[nCounter] * anTrans[nCounter]) / (128.0f * 128.0f);
+		float* pfCostC = pfCost + nCounter * nSize;
+#pragma omp parallel for
+		for (nIdx = 0; nIdx < nSize; nIdx++)
+		{
+			pfCostC[nIdx] = m_fLambda1 * (float)pnSum[nIdx] * pfInvN[nIdx] - fContrast * pfVar[nIdx];
+			if (bTemporal == true)
+				pfCostC[nIdx] += pfTempW[nIdx] * (pfPreTrs[nIdx] - afTrans[nCounter]) * (pfPreTrs[nIdx] - afTrans[nCounter]);
+		}
+	}
+
+	// (4) minimum cost
+	m_nSkippedBlocks = 0;
+	m_nEstimatedBlocks = 0;
+#pragma omp parallel for private(nX)
+	for (nY = 0; nY < nHei; nY++)
+	{
+		for (nX = 0; nX < nWid; nX++)
+		{
+			int nI = nY * nWid + nX;
+			if (m_bROIFlag == true && m_pucROIBlock[(nY / m_nTBlockSize) * nBlockW + nX / m_nTBlockSize] == 0)
+				continue;
+
+			int nOpt = 0;
+			for (int nC = 1; nC < 7; nC++)
+			{
+				if (pfCost[nC * nSize + nI] < pfCost[nOpt * nSize + nI])
+					nOpt = nC;
+			}
+
+			float fOptTrs = afTrans[nOpt];
+			if (nOpt > 0 && nOpt < 6)
+			{
+				float fC0 = pfCost[(nOpt - 1) * nSize + nI];
+				float fC1 = pfCost[nOpt * nSize + nI];
+				float fC2 = pfCost[(nOpt + 1) * nSize + nI];
+				float fDenom = fC0 - 2.0f * fC1 + fC2;
+				if (fDenom > 0)
+					fOptTrs += 0.05f * (fC0 - fC2) / fDenom;
+			}
+			pfTransmission[nI] = fOptTrs;
+		}
+	}
+
+	for (nIdx = 0; nIdx < nBlockW * ((nHei + m_nTBlockSize - 1) / m_nTBlockSize); nIdx++)
+	{
+		if (m_bROIFlag == false || m_pucROIBlock[nIdx] != 0)
+			m_nEstimatedBlocks++;
+	}
+
+	delete[] pnInit;
+	delete[] pnSum;
+	delete[] pfInvN;
+	delete[] pfVar;
+	delete[] pfCost;
+	if (pfPreTrs != NULL)
+	{
+		delete[] pfPreTrs;
+		delete[] pfTempW;
+	}
+}
+
+/*
+	Function: MinFilterColumns
+	Description: van Herk/Gil-Werman erosion of the columns with the window
+		of nR pixels above and below (2 * nR + 1 pixels). The column is split into
+		segments of the window size, and g (the minimum from the start of the
+		segment) and h (the minimum to the end of the segment) are computed.
+		A window covers the end of a segment and the start of the next one,
+		hence its minimum is min(h[top], g[bottom]): 3 comparisons per pixel for
+		any window size. The rows out of the image are 255.
+		The columns are processed with SSE2, 16 at once, and the strips of the
+		columns in parallel.
+	Parameters:
+		pucSrc - image (nW * nH)
+		nW, nH - size of the image
+		nR - radius of the window
+	Return:
+		pucDst - eroded image (nW * nH)
+ */
+static void MinFilterColumns(const uchar* pucSrc, uchar* pucDst, int nW, int nH, int nR)
+{
+	const int nK = 2 * nR + 1;
+	const int nLen = (nH + 2 * nR + nK - 1) / nK * nK;	// padded column, whole segments
+	const int nStrip = 64;
+	uchar* pucG = new uchar[nLen * nW];
+	uchar* pucH = new uchar[nLen * nW];
+
+	#pragma omp parallel for schedule(static)
+	for (int nS = 0; nS < nW; nS += nStrip)
+	{
+		const int nE = __min(nS + nStrip, nW);
+		int nX, nP;
+
+		for (nP = 0; nP < nLen; nP++)
+		{
+			// row of the padded column, and the first / last row of its segment
+			const int nY = nP - nR;
+			const bool bFirst = nP % nK == 0;
+			const int nQ = nLen - 1 - nP;
+			const int nYQ = nQ - nR;
+			const bool bLast = nQ % nK == nK - 1;
+			const uchar* pucRow = (nY >= 0 && nY < nH) ? pucSrc + nY * nW : NULL;
+			const uchar* pucRowQ = (nYQ >= 0 && nYQ < nH) ? pucSrc + nYQ * nW : NULL;
+			uchar* pucGRow = pucG + nP * nW;
+			uchar* pucHRow = pucH + nQ * nW;
+			const __m128i xmmPad = _mm_set1_epi8((char)255);
+
+			// (1) g forward and h backward
+			for (nX = nS; nX + 16 <= nE; nX += 16)
+			{
+				__m128i xmmV = pucRow != NULL ? _mm_loadu_si128((const __m128i*)(pucRow + nX)) : xmmPad;
+				if (bFirst == false)
+					xmmV = _mm_min_epu8(xmmV, _mm_loadu_si128((const __m128i*)(pucGRow - nW + nX)));
+				_mm_storeu_si128((__m128i*)(pucGRow + nX), xmmV);
+
+				__m128i xmmVQ = pucRowQ != NULL ? _mm_loadu_si128((const __m128i*)(pucRowQ + nX)) : xmmPad;
+				if (bLast == false)
+					xmmVQ = _mm_min_epu8(xmmVQ, _mm_loadu_si128((const __m128i*)(pucHRow + nW + nX)));
+				_mm_storeu_si128((__m128i*)(pucHRow + nX), xmmVQ);
+			}
+			for (; nX < nE; nX++)
+			{
+				uchar ucV = pucRow != NULL ? pucRow[nX] : 255;
+				pucGRow[nX] = bFirst == true ? ucV : __min(ucV, pucGRow[nX - nW]);
+
+				uchar ucVQ = pucRowQ != NULL ? pucRowQ[nX] : 255;
+				pucHRow[nX] = bLast == true ? ucVQ : __min(ucVQ, pucHRow[nX + nW]);
+			}
+		}
+	}
+
+	// (2) the window of the row nY is the padded rows nY ~ nY + 2 * nR
+	#pragma omp parallel for schedule(static)
+	for (int nY = 0; nY < nH; nY++)
+	{
+		const uchar* pucHRow = pucH + nY * nW;
+		const uchar* pucGRow = pucG + (nY + 2 * nR) * nW;
+		uchar* pucOut = pucDst + nY * nW;
+		int nX;
+
+		for (nX = 0; nX + 16 <= nW; nX += 16)
+			_mm_storeu_si128((__m128i*)(pucOut + nX), _mm_min_epu8(_mm_loadu_si128((const __m128i*)(pucHRow + nX)), _mm_loadu_si128((const __m128i*)(pucGRow + nX))));
+		for (; nX < nW; nX++)
+			pucOut[nX] = __min(pucHRow[nX], pucGRow[nX]);
+	}
+
+	delete[] pucG;
+	delete[] pucH;
+}
+
+/*
+	Function: TransposeImage
+	Description: transpose the image in blocks of 32 * 32 (MinFilterColumns is
+		applied to the rows through the transposed image).
+	Parameters:
+		pucSrc - image (nW * nH)
+		nW, nH - size of the image
+	Return:
+		pucDst - transposed image (nH * nW)
+ */
+static void TransposeImage(const uchar* pucSrc, uchar* pucDst, int nW, int nH)
+{
+	#pragma omp parallel for schedule(static)
+	for (int nBY = 0; nBY < nH; nBY += 32)
+	{
+		for (int nBX = 0; nBX < nW; nBX += 32)
+		{
+			for (int nY = nBY; nY < __min(nBY + 32, nH); nY++)
+			{
+				for (int nX = nBX; nX < __min(nBX + 32, nW); nX++)
+					pucDst[nX * nH + nY] = pucSrc[nY * nW + nX];
+			}
+		}
+	}
+}
+
+/*
+	Function: TransmissionEstimationDark
+	Description: Estimate the transmission with the dark channel prior
+		(K. He, J. Sun, X. Tang, "Single image haze removal using dark channel
+		prior," in Proc. IEEE CVPR, 2009), t = 1 - omega * dark channel.
+		(1) The minimum of I / A among the R, G, B channels of each pixel, in 255.
+		(2) The minimum in the window of m_nTBlockSize + 1 pixels (radius
+			m_nTBlockSize / 2), by the erosion of the columns (MinFilterColumns),
+			of the rows through the transposed image, and the transpose back.
+		The cost does not depend on the window size. There is no temporal cost,
+		the video is kept stable by the refinement.
+	Parameters:
+		pnImageR, pnImageG, pnImageB - R, G, B images
+		nWid - frame width
+		nHei - frame height
+	Return:
+		pfTransmission
+ */
+void dehazing::TransmissionEstimationDark(int* pnImageR, int* pnImageG, int* pnImageB, float* pfTransmission, int nWid, int nHei)
+{
+	int nI;
+	const int nR = m_nTBlockSize / 2;
+	uchar aucLUT[3][256];
+	float afTrans[256];
+	uchar* pucDark = new uchar[nWid * nHei];
+	uchar* pucTemp = new uchar[nWid * nHei];
+
+	// I / A of each channel (m_anAirlight is B, G, R), and the transmission of a dark value
+	for (nI = 0; nI < 256; nI++)
+	{
+		aucLUT[0][nI] = (uchar)__min(nI * 255 / __max(m_anAirlight[0], 1), 255);
+		aucLUT[1][nI] = (uchar)__min(nI * 255 / __max(m_anAirlight[1], 1), 255);
+		aucLUT[2][nI] = (uchar)__min(nI * 255 / __max(m_anAirlight[2], 1), 255);
+		afTrans[nI] = CLIP_TRS(1.0f - m_fDarkOmega * (float)nI / 255.0f);
+	}
+
+	// (1) dark channel of the pixels
+	#pragma omp parallel for schedule(static)
+	for (int nK = 0; nK < nWid * nHei; nK++)
+		pucDark[nK] = __min(__min(aucLUT[0][pnImageB[nK]], aucLUT[1][pnImageG[nK]]), aucLUT[2][pnImageR[nK]]);
+
+	// (2) erosion of the columns, then of the rows
+	MinFilterColumns(pucDark, pucTemp, nWid, nHei, nR);
+	TransposeImage(pucTemp, pucDark, nWid, nHei);
+	MinFilterColumns(pucDark, pucTemp, nHei, nWid, nR);
+	TransposeImage(pucTemp, pucDark, nHei, nWid);
+
+	#pragma omp parallel for schedule(static)
+	for (int nK = 0; nK < nWid * nHei; nK++)
+		pfTransmission[nK] = afTrans[pucDark[nK]];
+
+	m_nSkippedBlocks = 0;
+	m_nEstimatedBlocks = 0;
+
+	delete[] pucDark;
+	delete[] pucTemp;
+}
+
+/*
+	Function: NFTrsEstimationRange
+	Description: Estiamte the transmission in the block among the candidates
+		fTransMin + n * fTransStep (n = 0 ~ nCandidates - 1).
+		The cost is the same with NFTrsEstimation, and the temporal cost of
+		NFTrsEstimationP is added when the previous Y image is given.
+	Parameters:
+		pnImageY - Y image
+		pnImageYP - Y image of the previous frame (NULL: no temporal cost)
+		fPreTrs - transmission of the block in the previous frame
+		nStartx - top left point of a block
+		nStarty - top left point of a block
+		nBlockSize - block size
+		nWid - frame width
+		nHei - frame height.
+		fTransMin, fTransStep, nCandidates - transmission candidates
+	Return:
+		fOptTrs
+ */
+float dehazing::NFTrsEstimationRange(int* pnImageY, int* pnImageYP, float fPreTrs, int nStartX, int nStartY, int nBlockSize, int nWid, int nHei, float fTransMin, float fTransStep, int nCandidates)
+{
+	int nCounter;
+	int nX, nY;
+	int nTrans;
+	int nSumofSLoss, nSumofSquaredOuts, nSumofOuts;
+	float fTrans, fOptTrs, fCost, fMinCost, fMean;
+	float fWsum = 0, fNewKSum = 0;
+
+	int nEndX = __min(nStartX + nBlockSize, nWid);
+	int nEndY = __min(nStartY + nBlockSize, nHei);
+	int nNumberofPixels = (nEndY - nStartY) * (nEndX - nStartX);
+
+	// update the previous transmission using new kappa (NFTrsEstimationP)
+	if (pnImageYP != NULL)
+	{
+		for (nY = nStartY; nY < nEndY; nY++)
+		{
+			for (nX = nStartX; nX < nEndX; nX++)
+			{
+				float fPreJ = (float)(pnImageYP[nY * nWid + nX] - m_nAirlight);
+				if (fPreJ != 0)
 				{
-					for (nXstep = nX; nXstep < nX + m_nTBlockSize; nXstep++)
-					{
-						pfTransmission[nYstep * nWid + nXstep] = fTrans;
-					}
+					float fWi = m_pfExpLUT[abs(pnImageY[nY * nWid + nX] - pnImageYP[nY * nWid + nX])];
+					fWsum += fWi;
+					fNewKSum += fWi * (float)(pnImageY[nY * nWid + nX] - m_nAirlight) / fPreJ;
 				}
 			}
 		}
+		if (fWsum > 0)
+			fPreTrs = fPreTrs * fNewKSum / fWsum;
+	}
+
+	BlockSumFunc pfnBlockSum = SelectBlockSum(nEndX - nStartX);
+	int anSums[3];
+
+	fOptTrs = fTransMin;
+	fMinCost = 0;
+	for (nCounter = 0; nCounter < nCandidates; nCounter++)
+	{
+		fTrans = fTransMin + fTransStep * nCounter;
+		nTrans = (int)(1.0f / fTrans * 128.0f);
+
+		// (I-A)/t + A --> ((I-A)*k*128 + A*128)/128
+		pfnBlockSum(pnImageY + nStartY * nWid + nStartX, nWid, nEndX - nStartX, nEndY - nStartY, m_nAirlight, nTrans, anSums);
+		nSumofSLoss = anSums[0];
+		nSumofSquaredOuts = anSums[1];
+		nSumofOuts = anSums[2];
+
+		fMean = (float)(nSumofOuts) / (float)(nNumberofPixels);
+		fCost = m_fLambda1 * (float)nSumofSLoss / (float)(nNumberofPixels)
+			- ((float)nSumofSquaredOuts / (float)nNumberofPixels - fMean * fMean);
+		if (fWsum > 0 && fPreTrs != 0)
+			fCost += m_fLambda2 / fPreTrs / fPreTrs * fWsum / (float)nNumberofPixels * ((fPreTrs - fTrans) * (fPreTrs - fTrans) * 255.0f * 255.0f);
+
+		if (nCounter == 0 || fMinCost > fCost)
+		{
+			fMinCost = fCost;
+			fOptTrs = fTrans;
+		}
 	}
+	return fOptTrs;
+}
+
+/*
+	Function: StaticBlock
+	Description: Check whether the block is not changed from the previous frame.
+		The sum of absolute difference (SAD) is computed with SSE, and the
+		computation stops as soon as the SAD exceeds the threshold.
+	Parameters:
+		pnImageY - Y image of the current frame
+		pnImageYP - Y image of the previous frame
+		nStartx - top left point of a block
+		nStarty - top left point of a block
+		nWid - frame width
+		nHei - frame height.
+	Return:
+		boolean value
+ */
+bool dehazing::StaticBlock(int* pnImageY, int* pnImageYP, int nStartX, int nStartY, int nWid, int nHei)
+{
+	int nX, nY, nI;
+	int nEndX = __min(nStartX + m_nTBlockSize, nWid);
+	int nEndY = __min(nStartY + m_nTBlockSize, nHei);
+	int nSAD = 0;
+	const int nThreshold = m_nSkipSAD * (nEndX - nStartX) * (nEndY - nStartY);
+
+	__m128i sseDiff, sseSign, sseSAD;
+	int anSAD[4];
+
+	for (nY = nStartY; nY < nEndY; nY++)
+	{
+		int* pnY = pnImageY + nY * nWid;
+		int* pnYP = pnImageYP + nY * nWid;
+
+		sseSAD = _mm_setzero_si128();
+		for (nX = nStartX; nX + 4 <= nEndX; nX += 4)
+		{
+			// |a - b| = ((a - b) ^ s) - s, s = sign of (a - b)
+			sseDiff = _mm_sub_epi32(_mm_loadu_si128((__m128i*)(pnY + nX)), _mm_loadu_si128((__m128i*)(pnYP + nX)));
+			sseSign = _mm_srai_epi32(sseDiff, 31);
+			sseSAD = _mm_add_epi32(sseSAD, _mm_sub_epi32(_mm_xor_si128(sseDiff, sseSign), sseSign));
+		}
+		_mm_storeu_si128((__m128i*)anSAD, sseSAD);
+		for (nI = 0; nI < 4; nI++)
+			nSAD += anSAD[nI];
+		for (; nX < nEndX; nX++)
+			nSAD += abs(pnY[nX] - pnYP[nX]);
+
+		if (nSAD > nThreshold)
+			return false;
+	}
+
+	return true;
 }
 
 /*
@@ -141,55 +1006,36 @@ void dehazing::TransmissionEstimation(int* pnImageY, float* pfTransmission, int*
 float dehazing::NFTrsEstimation(int* pnImageY, int nStartX, int nStartY, int nWid, int nHei)
 {
 	int nCounter;
-	int nX, nY;
 	int nEndX;
 	int nEndY;
 
-	int nOut;						// Restored image
-	int nSquaredOut;				// Squared value of restored image
 	int nSumofOuts;					// Sum of restored image
 	int nSumofSquaredOuts;			// Sum of squared restored image
 	float fTrans, fOptTrs;			// Transmission and optimal value
 	int nTrans;						// Integer transformation 
 	int nSumofSLoss;				// Sum of loss info
 	float fCost, fMinCost, fMean;
-	int nNumberofPixels, nLossCount;
+	int nNumberofPixels;
 
 	nEndX = __min(nStartX + m_nTBlockSize, nWid); // End point of the block
 	nEndY = __min(nStartY + m_nTBlockSize, nHei); // End point of the block
 
 	nNumberofPixels = (nEndY - nStartY) * (nEndX - nStartX);
 
+	BlockSumFunc pfnBlockSum = SelectBlockSum(nEndX - nStartX);
+	int anSums[3];
+
 	fTrans = 0.3f;	// Init trans is started from 0.3
 	nTrans = 427;	// Convert transmission to integer 
 
 	for (nCounter = 0; nCounter < 7; nCounter++)
 	{
-		nSumofSLoss = 0;
-		nLossCount = 0;
-		nSumofSquaredOuts = 0;
-		nSumofOuts = 0;
-		for (nY = nStartY; nY < nEndY; nY++)
-		{
-			for (nX = nStartX; nX < nEndX; nX++)
-			{
-				nOut = ((pnImageY[nY * nWid + nX] - m_nAirlight) * nTrans + 128 * m_nAirlight) >> 7; // (I-A)/t + A --> ((I-A)*k*128 + A*128)/128
-				nSquaredOut = nOut * nOut;
+		// (I-A)/t + A --> ((I-A)*k*128 + A*128)/128
+		pfnBlockSum(pnImageY + nStartY * nWid + nStartX, nWid, nEndX - nStartX, nEndY - nStartY, m_nAirlight, nTrans, anSums);
+		nSumofSLoss = anSums[0];
+		nSumofSquaredOuts = anSums[1];
+		nSumofOuts = anSums[2];
 
-				if (nOut > 255)
-				{
-					nSumofSLoss += (nOut - 255) * (nOut - 255);
-					nLossCount++;
-				}
-				else if (nOut < 0)
-				{
-					nSumofSLoss += nSquaredOut;
-					nLossCount++;
-				}
-				nSumofSquaredOuts += nSquaredOut;
-				nSumofOuts += nOut;
-			}
-		}
 		fMean = (float)(nSumofOuts) / (float)(nNumberofPixels);
 		fCost = m_fLambda1 * (float)nSumofSLoss / (float)(nNumberofPixels)
 			-((float)nSumofSquaredOuts / (float)nNumberofPixels - fMean * fMean);
@@ -223,19 +1069,19 @@ float dehazing::NFTrsEstimation(int* pnImageY, int nStartX, int nStartY, int nWi
 float dehazing::NFTrsEstimationColor(int* pnImageR, int* pnImageG, int* pnImageB, int nStartX, int nStartY, int nWid, int nHei)
 {
 	int nCounter;
-	int nX, nY;
 	int nEndX;
 	int nEndY;
 
-	int nOutR, nOutG, nOutB;
-	int nSquaredOut;
+	int nC;
+	int* apnImage[3] = { pnImageB, pnImageG, pnImageR };	// order of m_anAirlight
+	int anSums[3];
 	int nSumofOuts;
 	int nSumofSquaredOuts;
 	float fTrans, fOptTrs;
 	int nTrans;
 	int nSumofSLoss;
 	float fCost, fMinCost, fMean;
-	int nNumberofPixels, nLossCount;
+	int nNumberofPixels;
 
 	nEndX = __min(nStartX + m_nTBlockSize, nWid);
 	nEndY = __min(nStartY + m_nTBlockSize, nHei);
@@ -247,54 +1093,18 @@ float dehazing::NFTrsEstimationColor(int* pnImageR, int* pnImageG, int* pnImageB
 
 	for (nCounter = 0; nCounter < 7; nCounter++)
 	{
+		// the planes one after another, (I-A)/t + A --> ((I-A)*k*128 + A*128)/128
 		nSumofSLoss = 0;
-		nLossCount = 0;
 		nSumofSquaredOuts = 0;
 		nSumofOuts = 0;
-
-		for (nY = nStartY; nY < nEndY; nY++)
+		for (nC = 0; nC < 3; nC++)
 		{
-			for (nX = nStartX; nX < nEndX; nX++)
-			{
-
-				nOutB = ((pnImageB[nY * nWid + nX] - m_anAirlight[0]) * nTrans + 128 * m_anAirlight[0]) >> 7; // (I-A)/t + A --> ((I-A)*k*128 + A*128)/128
-				nOutG = ((pnImageG[nY * nWid + nX] - m_anAirlight[1]) * nTrans + 128 * m_anAirlight[1]) >> 7;
-				nOutR = ((pnImageR[nY * nWid + nX] - m_anAirlight[2]) * nTrans + 128 * m_anAirlight[2]) >> 7;
-
-				if (nOutR > 255)
-				{
-					nSumofSLoss += (nOutR - 255) * (nOutR - 255);
-					nLossCount++;
-				}
-				else if (nOutR < 0)
-				{
-					nSumofSLoss += nOutR * nOutR;
-					nLossCount++;
-				}
-				if (nOutG > 255)
-				{
-					nSumofSLoss += (nOutG - 255) * (nOutG - 255);
-					nLossCount++;
-				}
-				else if (nOutG < 0)
-				{
-					nSumofSLoss += nOutG * nOutG;
-					nLossCount++;
-				}
-				if (nOutB > 255)
-				{
-					nSumofSLoss += (nOutB - 255) * (nOutB - 255);
-					nLossCount++;
-				}
-				else if (nOutB < 0)
-				{
-					nSumofSLoss += nOutB * nOutB;
-					nLossCount++;
-				}
-				nSumofSquaredOuts += nOutB * nOutB + nOutR * nOutR + nOutG * nOutG;;
-				nSumofOuts += nOutR + nOutG + nOutB;
-			}
+			BlockSumSSE2(apnImage[nC] + nStartY * nWid + nStartX, nWid, nEndX - nStartX, nEndY - nStartY, m_anAirlight[nC], nTrans, anSums);
+			nSumofSLoss += anSums[0];
+			nSumofSquaredOuts += anSums[1];
+			nSumofOuts += anSums[2];
 		}
+
 		fMean = (float)(nSumofOuts) / (float)(nNumberofPixels);
 		fCost = m_fLambda1 * (float)nSumofSLoss / (float)(nNumberofPixels)
 			-((float)nSumofSquaredOuts / (float)nNumberofPixels - fMean * fMean);
@@ -335,9 +1145,7 @@ float dehazing::NFTrsEstimationP(int* pnImageY, int* pnImageYP, float* pfTransmi
 
 	float fMean;
 
-	int nOut;
 	float fPreTrs;
-	int nSquaredOut;
 	int nSumofOuts;
 	int nSumofSquaredOuts;
 	int nTrans;
@@ -360,7 +1168,6 @@ float dehazing::NFTrsEstimationP(int* pnImageY, int* pnImageYP, float* pfTransmi
 	float fPreJ;							// evade 0 division
 	float fWsum = 0;						// Sum of weight
 	int nIdx = 0;
-	int nLossCount;
 
 	for (nY = nStartY; nY < nEndY; nY++)
 	{
@@ -377,34 +1184,17 @@ float dehazing::NFTrsEstimationP(int* pnImageY, int* pnImageYP, float* pfTransmi
 	fNewK = fNewKSum / fWsum;			// Compute new kappa
 	fPreTrs = pfTransmissionP[nStartY * nWid + nStartX] * fNewK;	// Update the previous transmission using new kappa
 
+	BlockSumFunc pfnBlockSum = SelectBlockSum(nEndX - nStartX);
+	int anSums[3];
+
 	for (nCounter = 0; nCounter < 7; nCounter++)
 	{
-		nSumofSLoss = 0;
-		nLossCount = 0;
-		nSumofSquaredOuts = 0;
-		nSumofOuts = 0;
-
-		for (nY = nStartY; nY < nEndY; nY++)
-		{
-			for (nX = nStartX; nX < nEndX; nX++)
-			{
-				nOut = ((pnImageY[nY * nWid + nX] - m_nAirlight) * nTrans + 128 * m_nAirlight) >> 7; // (I-A)/t + A --> ((I-A)*k*128 + A*128)/128
-				nSquaredOut = nOut * nOut;
+		// (I-A)/t + A --> ((I-A)*k*128 + A*128)/128
+		pfnBlockSum(pnImageY + nStartY * nWid + nStartX, nWid, nEndX - nStartX, nEndY - nStartY, m_nAirlight, nTrans, anSums);
+		nSumofSLoss = anSums[0];
+		nSumofSquaredOuts = anSums[1];
+		nSumofOuts = anSums[2];
 
-				if (nOut > 255)
-				{
-					nSumofSLoss += (nOut - 255) * (nOut - 255);
-					nLossCount++;
-				}
-				else if (nOut < 0)
-				{
-					nSumofSLoss += nSquaredOut;
-					nLossCount++;
-				}
-				nSumofSquaredOuts += nSquaredOut;
-				nSumofOuts += nOut;
-			}
-		}
 		fMean = (float)(nSumofOuts) / (float)(nNumberofPixels);
 		fCost = m_fLambda1 * (float)nSumofSLoss / (float)(nNumberofPixels) // information loss cost
 			-((float)nSumofSquaredOuts / (float)nNumberofPixels - fMean * fMean)	// contrast cost
@@ -445,9 +1235,10 @@ float dehazing::NFTrsEstimationPColor(int* pnImageR, int* pnImageG, int* pnImage
 
 	float fMean;
 
-	int nOutR, nOutG, nOutB;
+	int nC;
+	int* apnImage[3] = { pnImageB, pnImageG, pnImageR };	// order of m_anAirlight
+	int anSums[3];
 	float fPreTrs;
-	int nSquaredOut;
 	int nSumofOuts;
 	int nSumofSquaredOuts;
 	int nTrans;
@@ -470,7 +1261,6 @@ float dehazing::NFTrsEstimationPColor(int* pnImageR, int* pnImageG, int* pnImage
 	float fPreJR, fPreJG, fPreJB;
 	float fWsum = 0;
 	int nIdx = 0;
-	int nLossCount;
 
 	for (nY = nStartY; nY < nEndY; nY++)
 	{
@@ -502,55 +1292,18 @@ float dehazing::NFTrsEstimationPColor(int* pnImageR, int* pnImageG, int* pnImage
 
 	for (nCounter = 0; nCounter < 7; nCounter++)
 	{
-
+		// the planes one after another, (I-A)/t + A --> ((I-A)*k*128 + A*128)/128
 		nSumofSLoss = 0;
-		nLossCount = 0;
 		nSumofSquaredOuts = 0;
 		nSumofOuts = 0;
-
-		for (nY = nStartY; nY < nEndY; nY++)
+		for (nC = 0; nC < 3; nC++)
 		{
-			for (nX = nStartX; nX < nEndX; nX++)
-			{
-
-				nOutB = ((pnImageB[nY * nWid + nX] - m_anAirlight[0]) * nTrans + 128 * m_anAirlight[0]) >> 7;
-				nOutG = ((pnImageG[nY * nWid + nX] - m_anAirlight[1]) * nTrans + 128 * m_anAirlight[1]) >> 7;
-				nOutR = ((pnImageR[nY * nWid + nX] - m_anAirlight[2]) * nTrans + 128 * m_anAirlight[2]) >> 7;		// (I-A)/t + A --> ((I-A)*k*128 + A*128)/128
-
-				if (nOutR > 255)
-				{
-					nSumofSLoss += (nOutR - 255) * (nOutR - 255);
-					nLossCount++;
-				}
-				else if (nOutR < 0)
-				{
-					nSumofSLoss += nOutR * nOutR;
-					nLossCount++;
-				}
-				if (nOutG > 255)
-				{
-					nSumofSLoss += (nOutG - 255) * (nOutG - 255);
-					nLossCount++;
-				}
-				else if (nOutG < 0)
-				{
-					nSumofSLoss += nOutG * nOutG;
-					nLossCount++;
-				}
-				if (nOutB > 255)
-				{
-					nSumofSLoss += (nOutB - 255) * (nOutB - 255);
-					nLossCount++;
-				}
-				else if (nOutB < 0)
-				{
-					nSumofSLoss += nOutB * nOutB;
-					nLossCount++;
-				}
-				nSumofSquaredOuts += nOutB * nOutB + nOutR * nOutR + nOutG * nOutG;
-				nSumofOuts += nOutR + nOutG + nOutB;
-			}
+			BlockSumSSE2(apnImage[nC] + nStartY * nWid + nStartX, nWid, nEndX - nStartX, nEndY - nStartY, m_anAirlight[nC], nTrans, anSums);
+			nSumofSLoss += anSums[0];
+			nSumofSquaredOuts += anSums[1];
+			nSumofOuts += anSums[2];
 		}
+
 		fMean = (float)(nSumofOuts) / (float)(nNumberofPixels);
 		fCost = m_fLambda1 * (float)nSumofSLoss / (float)(nNumberofPixels)
 			-((float)nSumofSquaredOuts / (float)nNumberofPixels - fMean * fMean)
@@ -0,0 +1,221 @@
+/*
+	This source file contains the asynchronous front end of the video dehazing.
+
+	The frames are submitted with SubmitFrame and restored by a worker thread
+	in the order of the submission. The output is notified by the callback
+	(SetFrameCallback) and by the returned future, which holds the timestamp.
+
+	The video dehazing is split into two stages (dehazing.cpp):
+		EstimationStage		Y image, down sampling, transmission estimation.
+							It depends only on the estimation of the previous frame.
+		RestorationStage	refinement of the transmission and restoration.
+	When the next frame is already submitted, the estimation of frame N+1 runs
+	on a second set of buffers (m_pnYImgN, m_pnSmallYImgN, m_pfSmallTransN) while
+	frame N is refined and restored, and the buffers are swapped afterwards.
+	The first frame, a changed region of interest and the integer only path
+	(FixedPointMode) are processed without the overlap, since they change the
+	state which is used by the restoration. The output is the same as HazeRemoval.
+	The dehazing strength of the haze detection is kept with the frame.
+
+	The settings must not be changed while frames are in flight (call Flush first).
+	The images of a submitted frame are shared, not copied, hence the caller
+	keeps them until the frame is done.
+ */
+
+#include "dehazing.h"
+
+/*
+	Function: SubmitFrame
+	Description: submit a frame of the video to the worker thread. The frame number
+		is counted from the first submitted frame.
+	Parameters:
+		imInput - input image (kept by the caller until the frame is done)
+		imOutput - output image (may be imInput, an empty output is allocated)
+		dTimestamp - timestamp of the frame, returned with the output
+	Return:
+		future which holds dTimestamp when imOutput is restored
+		(not valid if the images are rejected)
+ */
+std::future<double> dehazing::SubmitFrame(cv::Mat& imInput, cv::Mat& imOutput, double dTimestamp)
+{
+	if (CheckFrame(imInput, imOutput) == false)
+		return std::future<double>();
+
+	AsyncFrame* pstFrame = new AsyncFrame;
+	pstFrame->imInput = imInput;
+	pstFrame->imOutput = imOutput;
+	pstFrame->dTimestamp = dTimestamp;
+	std::future<double> futureDone = pstFrame->promiseDone.get_future();
+
+	std::unique_lock<std::mutex> lock(m_mutexAsync);
+	if (m_threadAsync.joinable() == false)
+	{
+		// the buffers are kept when the worker is started again
+		if (m_pnYImgN == NULL)
+		{
+			m_pnYImgN = new int[m_nCapPixels];
+			m_pnSmallYImgN = new int[320 * 240];
+			m_pfSmallTransN = new float[320 * 240];
+		}
+		m_bAsyncStop = false;
+		m_threadAsync = std::thread(&dehazing::AsyncWorker, this);
+	}
+	pstFrame->nFrame = m_nAsyncFrame++;
+	m_dqAsyncFrame.push_back(pstFrame);
+	m_nAsyncPending++;
+	m_condSubmit.notify_one();
+
+	return futureDone;
+}
+
+/*
+	Function: SetFrameCallback
+	Description: set the function which is called by the worker thread for each
+		restored frame, before the future of the frame is ready.
+	Parameters:
+		pfnCallback - callback (NULL: no callback)
+		pUserData - passed to the callback
+ */
+void dehazing::SetFrameCallback(FrameCallback pfnCallback, void* pUserData)
+{
+	std::unique_lock<std::mutex> lock(m_mutexAsync);
+	m_pfnFrameCallback = pfnCallback;
+	m_pFrameCallbackData = pUserData;
+}
+
+/*
+	Function: Flush
+	Description: wait until all the submitted frames are done.
+ */
+void dehazing::Flush()
+{
+	std::unique_lock<std::mutex> lock(m_mutexAsync);
+	while (m_nAsyncPending > 0)
+		m_condDone.wait(lock);
+}
+
+/*
+	Function: AsyncStop
+	Description: finish the submitted frames and stop the worker thread.
+ */
+void dehazing::AsyncStop()
+{
+	if (m_threadAsync.joinable() == false)
+		return;
+
+	{
+		std::unique_lock<std::mutex> lock(m_mutexAsync);
+		m_bAsyncStop = true;
+		m_condSubmit.notify_one();
+	}
+	m_threadAsync.join();
+}
+
+/*
+	Function: AsyncDone
+	Description: notify the restored frame (callback, future).
+	Parameters:
+		pstFrame - restored frame
+ */
+void dehazing::AsyncDone(AsyncFrame* pstFrame)
+{
+	FrameCallback pfnCallback;
+	void* pUserData;
+	{
+		std::unique_lock<std::mutex> lock(m_mutexAsync);
+		pfnCallback = m_pfnFrameCallback;
+		pUserData = m_pFrameCallbackData;
+	}
+
+	if (pfnCallback != NULL)
+		pfnCallback(pstFrame->imOutput, pstFrame->dTimestamp, pUserData);
+	pstFrame->promiseDone.set_value(pstFrame->dTimestamp);
+	delete pstFrame;
+
+	std::unique_lock<std::mutex> lock(m_mutexAsync);
+	m_nAsyncPending--;
+	m_condDone.notify_all();
+}
+
+/*
+	Function: AsyncWorker
+	Description: the worker thread. pstCur is the frame which is estimated and
+		waits for the restoration; pstNext is the next submitted frame.
+ */
+void dehazing::AsyncWorker()
+{
+	AsyncFrame* pstCur = NULL;
+	double dFrameMs = 0.0;		// time of the worker since the last restored frame
+
+	for (;;)
+	{
+		AsyncFrame* pstNext = NULL;
+		double dStart;
+		{
+			std::unique_lock<std::mutex> lock(m_mutexAsync);
+			// with an estimated frame, the worker does not wait for the next one
+			while (pstCur == NULL && m_dqAsyncFrame.empty() && m_bAsyncStop == false)
+				m_condSubmit.wait(lock);
+			if (m_dqAsyncFrame.empty() == false)
+			{
+				pstNext = m_dqAsyncFrame.front();
+				m_dqAsyncFrame.pop_front();
+			}
+			else if (pstCur == NULL)
+				return;
+		}
+		dStart = omp_get_wtime();
+
+		// (1) estimation of frame N+1 with the restoration of frame N
+		if (pstCur != NULL && pstNext != NULL && pstNext->nFrame != 0 && m_bROIUpdate == false && m_bTemporalReset == false && m_bFixedPoint == false)
+		{
+			std::thread threadEstimation([this, pstNext]() {
+				pstNext->fStrength = EstimationStage(pstNext->imInput, pstNext->nFrame, m_pnYImgN, m_pnSmallYImgN, m_pfSmallTransN);
+			});
+			RestorationStage(pstCur->imInput, pstCur->imOutput, pstCur->fStrength);
+			threadEstimation.join();
+			bool bMeasure = pstCur->fStrength > 0;
+			AsyncDone(pstCur);
+
+			std::swap(m_pnYImg, m_pnYImgN);
+			std::swap(m_pnSmallYImg, m_pnSmallYImgN);
+			std::swap(m_pfSmallTrans, m_pfSmallTransN);
+			pstCur = pstNext;
+
+			// the settings of the next frames (nothing is in progress)
+			if (m_bGovernor == true && bMeasure == true)
+				GovernorUpdate((float)(dFrameMs + (omp_get_wtime() - dStart) * 1000.0));
+			dFrameMs = 0.0;
+			continue;
+		}
+
+		// (2) one stage after another
+		if (pstCur != NULL)
+		{
+			RestorationStage(pstCur->imInput, pstCur->imOutput, pstCur->fStrength);
+			bool bMeasure = pstCur->fStrength > 0;
+			AsyncDone(pstCur);
+			pstCur = NULL;
+
+			if (m_bGovernor == true && bMeasure == true)
+				GovernorUpdate((float)(dFrameMs + (omp_get_wtime() - dStart) * 1000.0));
+			dFrameMs = 0.0;
+			dStart = omp_get_wtime();
+		}
+		if (pstNext != NULL)
+		{
+			if (m_bFixedPoint == true)
+			{
+				HazeRemoval(pstNext->imInput, pstNext->imOutput, pstNext->nFrame);
+				AsyncDone(pstNext);
+			}
+			else
+			{
+				int nEstFrame = PrepareFrame(pstNext->imInput, pstNext->nFrame);
+				pstNext->fStrength = EstimationStage(pstNext->imInput, nEstFrame, m_pnYImg, m_pnSmallYImg, m_pfSmallTrans);
+				pstCur = pstNext;
+			}
+		}
+		dFrameMs += (omp_get_wtime() - dStart) * 1000.0;
+	}
+}
@@ -0,0 +1,93 @@
+/*
+	This source file contains the batched video dehazing of several streams.
+
+	A frame of a small stream (e.g. 640*480) is too small to keep all the cores
+	busy, since each step of HazeRemoval is a short parallel loop. HazeRemovalBatch
+	takes one frame of each of K streams, each with its own engine (temporal
+	state, settings), and runs each stage over the whole batch in one parallel
+	loop, one stream per thread:
+		(1) PrepareFrame		atmospheric light, ROI map
+		(2) EstimationStage		conversion, down sampling, transmission search
+		(3) RestorationStage	refinement and restoration
+	The refinement and the restoration of a frame stay in one stage, so the
+	full size buffers of the frame are restored while they are in the cache of
+	the thread. The parallel loops of the stages are nested in the loop of the
+	batch, hence they run in the thread of the stream (OMP_MAX_ACTIVE_LEVELS 1,
+	the default).
+	The output of each stream is the same as its HazeRemoval. The engines with
+	FixedPointMode run HazeRemoval in the stage (2).
+
+	An engine must not have submitted frames in flight (SubmitFrame, Flush), and
+	appears once in a batch.
+ */
+
+#include "dehazing.h"
+
+/*
+	Function: HazeRemovalBatch
+	Description: haze removal of one frame of each stream.
+	Parameters:
+		ppEngine - engines of the streams
+		pimInput - input images (the frame size of each engine)
+		pnFrame - frame numbers
+		nBatch - number of the streams
+	Return:
+		pimOutput - output images (may be the input images, an empty output is allocated)
+ */
+void dehazing::HazeRemovalBatch(dehazing** ppEngine, cv::Mat* pimInput, cv::Mat* pimOutput, const int* pnFrame, int nBatch)
+{
+	if (nBatch <= 0)
+		return;
+
+	int* pnEstFrame = new int[nBatch];		// -1: rejected or processed
+	float* pfStrength = new float[nBatch];
+	double* pdFrameMs = new double[nBatch];	// time of the stream (QualityGovernor)
+
+	// (1) atmospheric light, ROI map
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int nK = 0; nK < nBatch; nK++)
+	{
+		dehazing* pEngine = ppEngine[nK];
+		double dStart = omp_get_wtime();
+
+		pnEstFrame[nK] = -1;
+		if (pEngine->CheckFrame(pimInput[nK], pimOutput[nK]) == true && pEngine->m_bFixedPoint == false)
+			pnEstFrame[nK] = pEngine->PrepareFrame(pimInput[nK], pnFrame[nK]);
+		pdFrameMs[nK] = (omp_get_wtime() - dStart) * 1000.0;
+	}
+
+	// (2) conversion, down sampling, transmission search
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int nK = 0; nK < nBatch; nK++)
+	{
+		dehazing* pEngine = ppEngine[nK];
+		double dStart = omp_get_wtime();
+
+		if (pEngine->m_bFixedPoint == true)
+			pEngine->HazeRemoval(pimInput[nK], pimOutput[nK], pnFrame[nK]);
+		else if (pnEstFrame[nK] >= 0)
+			pfStrength[nK] = pEngine->EstimationStage(pimInput[nK], pnEstFrame[nK], pEngine->m_pnYImg, pEngine->m_pnSmallYImg, pEngine->m_pfSmallTrans);
+		pdFrameMs[nK] += (omp_get_wtime() - dStart) * 1000.0;
+	}
+
+	// (3) refinement and restoration
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int nK = 0; nK < nBatch; nK++)
+	{
+		dehazing* pEngine = ppEngine[nK];
+		double dStart = omp_get_wtime();
+
+		if (pnEstFrame[nK] < 0)
+			continue;
+		pEngine->RestorationStage(pimInput[nK], pimOutput[nK], pfStrength[nK]);
+		pdFrameMs[nK] += (omp_get_wtime() - dStart) * 1000.0;
+
+		// the settings of the next frame, as HazeRemoval
+		if (pEngine->m_bGovernor == true && pfStrength[nK] > 0)
+			pEngine->GovernorUpdate((float)pdFrameMs[nK]);
+	}
+
+	delete[] pnEstFrame;
+	delete[] pfStrength;
+	delete[] pdFrameMs;
+}
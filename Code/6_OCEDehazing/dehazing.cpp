@@ -12,7 +12,27 @@
  */
 #include "dehazing.h"
 
-dehazing::dehazing() {}
+// reallocate an allocated buffer with nSize elements (the values are not kept)
+template <typename T>
+static void GrowBuffer(T*& ptBuffer, int nSize)
+{
+	if (ptBuffer == NULL)
+		return;
+	delete[] ptBuffer;
+	ptBuffer = new T[nSize];
+}
+
+// quality levels of the governor from the best to the cheapest, applied on top
+// of the settings at QualityGovernor(true, ...)
+const dehazing::GovernorLevel dehazing::m_astGovernor[GOV_LEVEL_NUM] =
+{
+	//	name				step div	refinement		pyramid	skip	block mul
+	{ "full",				1,	REFINE_DEFAULT,	1,	false,	1 },
+	{ "sparse filter",		2,	REFINE_DEFAULT,	1,	false,	1 },
+	{ "low-res refine",		2,	REFINE_COEF,	1,	false,	1 },
+	{ "coarse-to-fine",		2,	REFINE_COEF,	2,	true,	1 },
+	{ "coarse blocks",		2,	REFINE_COEF,	2,	true,	2 },
+};
 
 /*
 	Constructor: dehazing constructor
@@ -25,53 +45,7 @@ dehazing::dehazing() {}
 */
 dehazing::dehazing(int nW, int nH, bool bPrevFlag, bool bPosFlag)
 {
-	m_nWid = nW;
-	m_nHei = nH;
-
-	// Flags for temporal coherence & post processing
-	m_bPreviousFlag = bPrevFlag;
-	m_bPostFlag = bPosFlag;
-
-	m_fLambda1 = 5.0f;
-	m_fLambda2 = 1.0f;
-
-	// Transmission estimation block size
-	m_nTBlockSize = 40;
-
-	// Guided filter block size, step size(sampling step), & LookUpTable parameter
-	m_nGBlockSize = 40;
-	m_nStepSize = 2;
-	m_fGSigma = 10.0f;
-
-	// to specify the region of atmospheric light estimation
-	m_nTopLeftX = 0;
-	m_nTopLeftY = 0;
-	m_nBottomRightX = m_nWid;
-	m_nBottomRightY = m_nHei;
-
-	m_pfSmallTransP = new float[320 * 240]; // previous trans. (video only)
-	m_pfSmallTrans = new float[320 * 240]; // init trans.
-	m_pfSmallTransR = new float[320 * 240]; // refined trans.
-	m_pnSmallYImg = new int[320 * 240];
-	m_pnSmallYImgP = new int[320 * 240];
-	m_pfSmallInteg = new float[320 * 240];
-	m_pfSmallDenom = new float[320 * 240];
-	m_pfSmallY = new float[320 * 240];
-
-	m_pfTransmission = new float[m_nWid * m_nHei];
-	m_pfTransmissionR = new float[m_nWid * m_nHei];
-	m_pfTransmissionP = new float[m_nWid * m_nHei];
-	m_pnYImg = new int[m_nWid * m_nHei];
-	m_pnYImgP = new int[m_nWid * m_nHei];
-	m_pfInteg = new float[m_nWid * m_nHei];
-	m_pfDenom = new float[m_nWid * m_nHei];
-	m_pfY = new float[m_nWid * m_nHei];
-
-	m_pfSmallPk_p = new float[m_nGBlockSize * m_nGBlockSize];
-	m_pfSmallNormPk = new float[m_nGBlockSize * m_nGBlockSize];
-	m_pfPk_p = new float[m_nGBlockSize * m_nGBlockSize];
-	m_pfNormPk = new float[m_nGBlockSize * m_nGBlockSize];
-	m_pfGuidedLUT = new float[m_nGBlockSize * m_nGBlockSize];
+	InitEngine(nW, nH, bPrevFlag, bPosFlag);
 }
 
 
@@ -90,12 +64,7 @@ dehazing::dehazing(int nW, int nH, bool bPrevFlag, bool bPosFlag)
 */
 dehazing::dehazing(int nW, int nH, int nTBlockSize, bool bPrevFlag, bool bPosFlag, float fL1, float fL2, int nGBlock)
 {
-	m_nWid = nW;
-	m_nHei = nH;
-
-	// Flags for temporal coherence & post processing
-	m_bPreviousFlag = bPrevFlag;
-	m_bPostFlag = bPosFlag;
+	InitEngine(nW, nH, bPrevFlag, bPosFlag);
 
 	// parameters for each cost (loss cost, temporal coherence cost)
 	m_fLambda1 = fL1;
@@ -104,8 +73,151 @@ dehazing::dehazing(int nW, int nH, int nTBlockSize, bool bPrevFlag, bool bPosFla
 	// block size for transmission estimation
 	m_nTBlockSize = nTBlockSize;
 
-	// Guided filter block size, step size(sampling step), & LookUpTable parameter
+	// Guided filter block size
 	m_nGBlockSize = nGBlock;
+
+	// the buffers of the color image are allocated at once
+	AllocSmallColorImage();
+	AllocColorImage();
+	m_pnRImgP = new int[m_nCapPixels];
+	m_pnGImgP = new int[m_nCapPixels];
+	m_pnBImgP = new int[m_nCapPixels];
+}
+
+/*
+	Function: InitEngine
+	Description: initialize the members for both constructors, with the
+		default settings of the constructor without the block sizes.
+		A new member is initialized here only.
+	Parameters:
+		nW - width of input image
+		nH - height of input image
+		bPrevFlag - boolean for temporal cohenrence of video dehazing
+		bPosFlag - boolean for postprocessing
+ */
+void dehazing::InitEngine(int nW, int nH, bool bPrevFlag, bool bPosFlag)
+{
+	m_nWid = nW;
+	m_nHei = nH;
+	m_nCapPixels = nW * nH;
+	m_nCapLine = __max(nW, nH);
+
+	// Flags for temporal coherence & post processing
+	m_bPreviousFlag = bPrevFlag;
+	m_bPostFlag = bPosFlag;
+
+	// buffers for fixed-point processing are allocated by FixedPointMode()
+	m_bFixedPoint = false;
+	m_pnSmallTransQ = NULL;
+	m_pnSmallTransQP = NULL;
+	m_pnTransmissionQ = NULL;
+	m_pnTransmissionRQ = NULL;
+	m_pnRecipLUT = NULL;
+	m_pnGuideSumQ = NULL;
+	m_pnGuideSumIpQ = NULL;
+
+	// the region of interest is the whole frame until SetROI()
+	m_bROIFlag = false;
+	m_bROIUpdate = false;
+	m_pucROIMask = NULL;
+	m_pucROIRun = NULL;
+	m_pucROICell = NULL;
+	m_pucROIBlock = NULL;
+	m_pnROISpan = NULL;
+	m_pnUpX = NULL;
+	m_pnUpY = NULL;
+
+	// single scale transmission estimation until TransPyramidLevel()
+	m_nPyramidLevel = 1;
+	m_pnPyramidY = NULL;
+	m_pnPyramidYP = NULL;
+	m_pfPyramidTrans = NULL;
+	m_pucPyramidState = NULL;
+
+	// block transmission until TransDenseMode()
+	m_bTransDense = false;
+
+	// luma transmission until TransColorMode()
+	m_bTransColor = false;
+
+	// block search until TransDarkChannelMode()
+	m_bTransDark = false;
+	m_fDarkOmega = 0.95f;
+
+	// the temporal information is kept until the estimation mode is changed
+	m_bTemporalReset = false;
+
+	// every frame is dehazed until HazeDetection()
+	m_bHazeDetect = false;
+	m_fHazeClear = 0.3f;
+	m_fHazeHazy = 0.5f;
+	m_nHazeRamp = 15;
+	m_fHazeDensity = 0.0f;
+	m_fHazeStrength = -1.0f;
+	m_bHazeResume = false;
+	m_fRestoreStrength = 1.0f;
+	m_nYUVFormat = YUV_I420;
+	m_nBitShift = 0;
+	m_pusToneLUT = NULL;
+	m_nToneBits = 0;
+
+	// the refinement method of each path is kept until RefineMethod()
+	m_nRefineMethod = REFINE_DEFAULT;
+	m_nRefineUsed = REFINE_DEFAULT;
+	m_fRefineBudget = 33.0f;
+	for (int nI = 0; nI < REFINE_NUM; nI++)
+		m_afRefineScale[nI] = 1.0f;
+	for (int nI = 0; nI < STAGE_NUM; nI++)
+		m_afStageMs[nI] = 0.0f;
+	m_pfSmallA = NULL;
+	m_pfSmallB = NULL;
+	m_pnCoefX = NULL;
+	m_pfCoefWX = NULL;
+	m_bTransDeferred = false;
+	m_bTransValid = false;
+
+	// the settings are static until QualityGovernor()
+	m_bGovernor = false;
+	m_fTargetMs = 33.0f;
+	m_nGovLevel = 0;
+	m_fFrameMs = 0.0f;
+
+	// every block is estimated until BlockSkipSetting()
+	m_bBlockSkip = false;
+	m_nSkipSAD = 1;
+	m_nRefreshPeriod = 30;
+	m_pucBlockAge = NULL;
+	m_nSkippedBlocks = 0;
+	m_nEstimatedBlocks = 0;
+
+	// no state file until PersistState()
+	m_pucState = NULL;
+	m_hStateFile = NULL;
+	m_bStateWarm = false;
+	m_nStateSequence = 0;
+	m_nStateSlot = 0;
+	m_nStatePeriod = 300;
+	m_nStateFrames = 0;
+	m_bStateFixed = false;
+
+	// the worker thread is started by the first SubmitFrame()
+	m_bAsyncStop = false;
+	m_nAsyncFrame = 0;
+	m_nAsyncPending = 0;
+	m_pfnFrameCallback = NULL;
+	m_pFrameCallbackData = NULL;
+	m_pnYImgN = NULL;
+	m_pnSmallYImgN = NULL;
+	m_pfSmallTransN = NULL;
+
+	m_fLambda1 = 5.0f;
+	m_fLambda2 = 1.0f;
+
+	// Transmission estimation block size
+	m_nTBlockSize = 40;
+
+	// Guided filter block size, step size(sampling step), & gaussian sigma
+	m_nGBlockSize = 40;
 	m_nStepSize = 2;
 	m_fGSigma = 10.0f;
 
@@ -115,50 +227,51 @@ dehazing::dehazing(int nW, int nH, int nTBlockSize, bool bPrevFlag, bool bPosFla
 	m_nBottomRightX = m_nWid;
 	m_nBottomRightY = m_nHei;
 
-	m_pfSmallTransP = new float[320 * 240];
-	m_pfSmallTrans = new float[320 * 240];
-	m_pfSmallTransR = new float[320 * 240];
+	// buffers of the color image are allocated by AllocColorImage()
+	m_pnSmallRImg = NULL;
+	m_pnSmallRImgP = NULL;
+	m_pnSmallGImg = NULL;
+	m_pnSmallGImgP = NULL;
+	m_pnSmallBImg = NULL;
+	m_pnSmallBImgP = NULL;
+	m_pnRImg = NULL;
+	m_pnGImg = NULL;
+	m_pnBImg = NULL;
+	m_pnRImgP = NULL;
+	m_pnGImgP = NULL;
+	m_pnBImgP = NULL;
+
+	m_pfSmallTransP = new float[320 * 240]; // previous trans. (video only)
+	m_pfSmallTrans = new float[320 * 240]; // init trans.
+	m_pfSmallTransR = new float[320 * 240]; // refined trans.
 	m_pnSmallYImg = new int[320 * 240];
 	m_pnSmallYImgP = new int[320 * 240];
-
-	m_pnSmallRImg = new int[320 * 240];
-	m_pnSmallRImgP = new int[320 * 240];
-	m_pnSmallGImg = new int[320 * 240];
-	m_pnSmallGImgP = new int[320 * 240];
-	m_pnSmallBImg = new int[320 * 240];
-	m_pnSmallBImgP = new int[320 * 240];
-
 	m_pfSmallInteg = new float[320 * 240];
 	m_pfSmallDenom = new float[320 * 240];
 	m_pfSmallY = new float[320 * 240];
 
-	m_pfTransmission = new float[m_nWid * m_nHei];
-	m_pfTransmissionR = new float[m_nWid * m_nHei];
-	m_pfTransmissionP = new float[m_nWid * m_nHei];
-	m_pnYImg = new int[m_nWid * m_nHei];
-	m_pnYImgP = new int[m_nWid * m_nHei];
-
-	m_pnRImg = new int[m_nWid * m_nHei];
-	m_pnGImg = new int[m_nWid * m_nHei];
-	m_pnBImg = new int[m_nWid * m_nHei];
-
-	m_pnRImgP = new int[m_nWid * m_nHei];
-	m_pnGImgP = new int[m_nWid * m_nHei];
-	m_pnBImgP = new int[m_nWid * m_nHei];
-
-	m_pfInteg = new float[m_nWid * m_nHei];
-	m_pfDenom = new float[m_nWid * m_nHei];
-	m_pfY = new float[m_nWid * m_nHei];
-
-	m_pfSmallPk_p = new float[m_nGBlockSize * m_nGBlockSize];
-	m_pfSmallNormPk = new float[m_nGBlockSize * m_nGBlockSize];
-	m_pfPk_p = new float[m_nGBlockSize * m_nGBlockSize];
-	m_pfNormPk = new float[m_nGBlockSize * m_nGBlockSize];
-	m_pfGuidedLUT = new float[m_nGBlockSize * m_nGBlockSize];
+	m_pfTransmission = new float[m_nCapPixels];
+	m_pfTransmissionR = new float[m_nCapPixels];
+	m_pfTransmissionP = new float[m_nCapPixels];
+	m_pnYImg = new int[m_nCapPixels];
+	m_pnYImgP = new int[m_nCapPixels];
+	m_pfInteg = new float[m_nCapPixels];
+	m_pfDenom = new float[m_nCapPixels];
+	m_pfY = new float[m_nCapPixels];
+	m_nTransRowThreads = omp_get_max_threads();
+	m_pfTransRows = new float[m_nTransRowThreads * m_nCapLine * 2];
+
+	// look up tables, rebuilt only by the settings they depend on
+	MakeExpLUT();
+	GammaLUTMaker(TONE_GAMMA_DEFAULT);
 }
 
 dehazing::~dehazing(void)
 {
+	// the submitted frames are finished before the buffers are released
+	AsyncStop();
+	CloseState();
+
 	if (m_pfSmallTransP != NULL)
 		delete[] m_pfSmallTransP;
 	if (m_pfSmallTrans != NULL)
@@ -189,10 +302,6 @@ dehazing::~dehazing(void)
 		delete[] m_pfSmallInteg;
 	if (m_pfSmallDenom != NULL)
 		delete[] m_pfSmallDenom;
-	if (m_pfSmallNormPk != NULL)
-		delete[] m_pfSmallNormPk;
-	if (m_pfSmallPk_p != NULL)
-		delete[] m_pfSmallPk_p;
 
 	if (m_pnYImg != NULL)
 		delete[] m_pnYImg;
@@ -224,53 +333,160 @@ dehazing::~dehazing(void)
 		delete[] m_pfDenom;
 	if (m_pfY != NULL)
 		delete[] m_pfY;
-	if (m_pfPk_p != NULL)
-		delete[] m_pfPk_p;
-	if (m_pfNormPk != NULL)
-		delete[] m_pfNormPk;
-	if (m_pfGuidedLUT != NULL)
-		delete[] m_pfGuidedLUT;
-
-	m_pfSmallTransP = NULL;
-	m_pfSmallTrans = NULL;
-	m_pfSmallTransR = NULL;
-	m_pnSmallYImg = NULL;
-	m_pnSmallYImgP = NULL;
-
-	m_pnSmallRImg = NULL;
-	m_pnSmallRImgP = NULL;
-	m_pnSmallGImg = NULL;
-	m_pnSmallGImgP = NULL;
-	m_pnSmallBImg = NULL;
-	m_pnSmallBImgP = NULL;
 
-	m_pfSmallInteg = NULL;
-	m_pfSmallDenom = NULL;
-	m_pfSmallY = NULL;
+	if (m_pnSmallTransQ != NULL)
+		delete[] m_pnSmallTransQ;
+	if (m_pnSmallTransQP != NULL)
+		delete[] m_pnSmallTransQP;
+	if (m_pnTransmissionQ != NULL)
+		delete[] m_pnTransmissionQ;
+	if (m_pnTransmissionRQ != NULL)
+		delete[] m_pnTransmissionRQ;
+	if (m_pnRecipLUT != NULL)
+		delete[] m_pnRecipLUT;
+	if (m_pnGuideSumQ != NULL)
+		delete[] m_pnGuideSumQ;
+	if (m_pnGuideSumIpQ != NULL)
+		delete[] m_pnGuideSumIpQ;
+	if (m_pusToneLUT != NULL)
+		delete[] m_pusToneLUT;
+
+	if (m_pucROIMask != NULL)
+		delete[] m_pucROIMask;
+	if (m_pucROIRun != NULL)
+		delete[] m_pucROIRun;
+	if (m_pucROICell != NULL)
+		delete[] m_pucROICell;
+	if (m_pucROIBlock != NULL)
+		delete[] m_pucROIBlock;
+	if (m_pnROISpan != NULL)
+		delete[] m_pnROISpan;
+	if (m_pnUpX != NULL)
+		delete[] m_pnUpX;
+	if (m_pnUpY != NULL)
+		delete[] m_pnUpY;
+	if (m_pucBlockAge != NULL)
+		delete[] m_pucBlockAge;
+	if (m_pnPyramidY != NULL)
+		delete[] m_pnPyramidY;
+	if (m_pnPyramidYP != NULL)
+		delete[] m_pnPyramidYP;
+	if (m_pfPyramidTrans != NULL)
+		delete[] m_pfPyramidTrans;
+	if (m_pucPyramidState != NULL)
+		delete[] m_pucPyramidState;
+	if (m_pfSmallA != NULL)
+		delete[] m_pfSmallA;
+	if (m_pfSmallB != NULL)
+		delete[] m_pfSmallB;
+	if (m_pnCoefX != NULL)
+		delete[] m_pnCoefX;
+	if (m_pfCoefWX != NULL)
+		delete[] m_pfCoefWX;
+	if (m_pfTransRows != NULL)
+		delete[] m_pfTransRows;
+	if (m_pnYImgN != NULL)
+		delete[] m_pnYImgN;
+	if (m_pnSmallYImgN != NULL)
+		delete[] m_pnSmallYImgN;
+	if (m_pfSmallTransN != NULL)
+		delete[] m_pfSmallTransN;
+}
 
-	m_pfTransmission = NULL;
-	m_pfTransmissionR = NULL;
-	m_pfTransmissionP = NULL;
-	m_pnYImg = NULL;
-	m_pnYImgP = NULL;
+/*
+	Function: Reconfigure
+	Description: change the frame size and the block sizes of the engine for a
+		new stream, with the other settings kept.
+		The buffers of the frame size are reallocated only when their
+		capacity is exceeded, and the capacity grows
+		by 1.5 times at least, hence an engine is reused across the streams
+		without the allocation of the constructor. The submitted frames are
+		finished first, and the state file of the previous stream is written and
+		closed: call PersistState again with the camera ID of the new stream.
+		The next frame is the frame 0 of the new stream: the atmospheric light
+		is estimated again in the whole frame, and the region of interest is
+		reset (ResetROI). An empty frame size is rejected.
+	Parameters:
+		nW - width of input image
+		nH - height of input image
+		nTBlockSize - block size for transmission estimation
+		nGBlock - guided filter block size
+ */
+void dehazing::Reconfigure(int nW, int nH, int nTBlockSize, int nGBlock)
+{
+	if (nW <= 0 || nH <= 0)
+	{
+		printf("The frame size must be at least 1x1 (%dx%d).\n", nW, nH);
+		return;
+	}
 
-	m_pnRImg = NULL;
-	m_pnGImg = NULL;
-	m_pnBImg = NULL;
+	Flush();
+	// the state file belongs to the camera of the previous stream (PersistState)
+	CloseState();
 
-	m_pnRImgP = NULL;
-	m_pnGImgP = NULL;
-	m_pnBImgP = NULL;
+	// (1) buffers of the frame size
+	if (nW * nH > m_nCapPixels)
+	{
+		m_nCapPixels = __max(nW * nH, m_nCapPixels + m_nCapPixels / 2);
+
+		GrowBuffer(m_pfTransmission, m_nCapPixels);
+		GrowBuffer(m_pfTransmissionR, m_nCapPixels);
+		GrowBuffer(m_pfTransmissionP, m_nCapPixels);
+		GrowBuffer(m_pnYImg, m_nCapPixels);
+		GrowBuffer(m_pnYImgP, m_nCapPixels);
+		GrowBuffer(m_pnRImg, m_nCapPixels);
+		GrowBuffer(m_pnGImg, m_nCapPixels);
+		GrowBuffer(m_pnBImg, m_nCapPixels);
+		GrowBuffer(m_pnRImgP, m_nCapPixels);
+		GrowBuffer(m_pnGImgP, m_nCapPixels);
+		GrowBuffer(m_pnBImgP, m_nCapPixels);
+		GrowBuffer(m_pfInteg, m_nCapPixels);
+		GrowBuffer(m_pfDenom, m_nCapPixels);
+		GrowBuffer(m_pfY, m_nCapPixels);
+		GrowBuffer(m_pnTransmissionQ, m_nCapPixels);
+		GrowBuffer(m_pnTransmissionRQ, m_nCapPixels);
+		GrowBuffer(m_pnGuideSumQ, m_nCapPixels * 4);
+		GrowBuffer(m_pnGuideSumIpQ, m_nCapPixels * 3);
+		GrowBuffer(m_pnYImgN, m_nCapPixels);
+		GrowBuffer(m_pucROIRun, m_nCapPixels);
+	}
+	if (__max(nW, nH) > m_nCapLine)
+	{
+		m_nCapLine = __max(__max(nW, nH), m_nCapLine + m_nCapLine / 2);
+
+		GrowBuffer(m_pnROISpan, m_nCapLine * 2);
+		GrowBuffer(m_pnUpX, m_nCapLine);
+		GrowBuffer(m_pnUpY, m_nCapLine);
+		GrowBuffer(m_pnCoefX, m_nCapLine);
+		GrowBuffer(m_pfCoefWX, m_nCapLine);
+		GrowBuffer(m_pfTransRows, m_nTransRowThreads * m_nCapLine * 2);
+	}
 
-	m_pfInteg = NULL;
-	m_pfDenom = NULL;
-	m_pfY = NULL;
+	m_nWid = nW;
+	m_nHei = nH;
 
-	m_pfSmallPk_p = NULL;
-	m_pfSmallNormPk = NULL;
-	m_pfPk_p = NULL;
-	m_pfNormPk = NULL;
-	m_pfGuidedLUT = NULL;
+	// (2) the search range of the atmospheric light and the ROI of the frame size
+	m_nTopLeftX = 0;
+	m_nTopLeftY = 0;
+	m_nBottomRightX = m_nWid;
+	m_nBottomRightY = m_nHei;
+	ResetROI();
+
+	// (3) block sizes (the governor starts again from these settings)
+	bool bGovernor = m_bGovernor;
+	QualityGovernor(false, m_fTargetMs);
+	TransBlockSize(nTBlockSize);
+	FilterBlockSize(nGBlock);
+	QualityGovernor(bGovernor, m_fTargetMs);
+
+	// (4) the temporal information of the previous stream is not valid
+	m_fHazeStrength = -1.0f;
+	m_bHazeResume = false;
+	m_bTransValid = false;
+	m_bStateWarm = false;
+	m_nAsyncFrame = 0;
+	if (m_pucBlockAge != NULL)
+		memset(m_pucBlockAge, 255, 320 * 240);
 }
 
 /*
@@ -427,9 +643,58 @@ void dehazing::AirlightEstimation(cv::Mat& imInput)
 
 
 
+/*
+	Function: HazeDensity
+	Description: haze density of the frame, the mean dark channel of the
+		down-sampled Y image relative to the atmospheric light.
+		The dark channel is the minimum of each 16*16 block (32*32 pixels of
+		a 640*480 frame). A clear scene has dark pixels in most blocks, while
+		the haze lifts the minimum towards the atmospheric light.
+	Parameter:
+		pnSmallYImg - down-sampled Y image (320*240)
+	Return:
+		density (0: clear ~ 1: the blocks are as bright as the atmospheric light)
+ */
+float dehazing::HazeDensity(int* pnSmallYImg)
+{
+	int nX, nY, nBX, nBY;
+	int nSum = 0;
+
+	for (nBY = 0; nBY < 240; nBY += 16)
+	{
+		for (nBX = 0; nBX < 320; nBX += 16)
+		{
+			int nMin = 255;
+			for (nY = nBY; nY < nBY + 16; nY++)
+			{
+				int* pnY = pnSmallYImg + nY * 320 + nBX;
+				for (nX = 0; nX < 16; nX++)
+					nMin = __min(nMin, pnY[nX]);
+			}
+			nSum += nMin;
+		}
+	}
+
+	// 20 * 15 blocks
+	return CLIP_Z((float)nSum / (300.0f * (float)__max(m_nAirlight, 1)));
+}
+
 /*
 	Function: RestoreImage
 	Description: Dehazed the image using estimated transmission and atmospheric light.
+		The rows are independent, hence the restoration is row-parallel. When the
+		post processing flag is set, the deblocking runs as a separate pass over
+		the restored image.
+		With a region of interest, only the ROI is restored and the other pixels
+		are copied from the input.
+		When the refinement is deferred (REFINE_FAST, REFINE_COEF), the refined
+		transmission of each row is computed just before the row is restored, so
+		the full resolution transmission is not stored. m_pfTransmissionR is
+		written only for the post processing, which reads it, and otherwise
+		GetTransmission computes it on demand.
+		With a strength s < 1 (HazeDetection), the output is blended with the
+		input, I + s * (J - I), which is the restoration with the transmission
+		t / (t + s * (1 - t)), and the tone curve is blended with the identity.
 	Parameter:
 		imInput - Input hazy image.
 	Return:
@@ -439,105 +704,178 @@ void dehazing::RestoreImage(cv::Mat& imInput, cv::Mat& imOutput)
 {
 	int nX, nY;
 	float fA_R, fA_G, fA_B;
+	bool bDeferred = m_bTransDeferred == true && m_bTransValid == false;
+	const float fStrength = m_fRestoreStrength;
+	const bool bBlend = fStrength < 1.0f;
+	uchar aucTone[256];
+	const uchar* pucTone = m_pucGammaLUT;
+
+	if (bBlend == true)
+	{
+		for (nX = 0; nX < 256; nX++)
+			aucTone[nX] = (uchar)((float)nX + fStrength * (float)(m_pucGammaLUT[nX] - nX) + 0.5f);
+		pucTone = aucTone;
+	}
 
 	fA_B = (float)m_anAirlight[0];
 	fA_G = (float)m_anAirlight[1];
 	fA_R = (float)m_anAirlight[2];
 
-	// post processing flag
-	if (m_bPostFlag == true)
+	// (2) I' = (I - Airlight)/Transmission + Airlight
+#pragma omp parallel private(nX) num_threads(__min(omp_get_max_threads(), m_nTransRowThreads))
 	{
-		PostProcessing(imInput, imOutput);
-	}
-	else
-	{
-		//const int nStep = imInput.cols * 3;
-//#pragma omp parallel for num_threads(8)
-		// (2) I' = (I - Airlight)/Transmission + Airlight
-		int n_pixel = 0;
+		// refined transmission of a row
+		float* pfTransRow = (bDeferred == true && m_bPostFlag == false) ? m_pfTransRows + omp_get_thread_num() * m_nCapLine * 2 : NULL;
+
+#pragma omp for
 		for (nY = 0; nY < m_nHei; nY++)
 		{
 			uchar* inptr = imInput.ptr<uchar>(nY);
 			uchar* outptr = imOutput.ptr<uchar>(nY);
-			for (nX = 0; nX < m_nWid; nX++)
+			float* pfTransR = m_pfTransmissionR + nY * m_nWid;
+			uchar* pucMask = NULL;
+			int nStartX = 0;
+			int nEndX = m_nWid;
+
+			if (m_bROIFlag == true)
+			{
+				nStartX = m_pnROISpan[nY * 2];
+				nEndX = __max(m_pnROISpan[nY * 2 + 1], nStartX);
+				if (m_pucROIMask != NULL)
+					pucMask = m_pucROIMask + nY * m_nWid;
+
+				// copy through the outside of the ROI
+				if (inptr != outptr)
+				{
+					memcpy(outptr, inptr, nStartX * 3);
+					memcpy(outptr + nEndX * 3, inptr + nEndX * 3, (m_nWid - nEndX) * 3);
+				}
+				inptr += nStartX * 3;
+				outptr += nStartX * 3;
+			}
+
+			if (bDeferred == true)
+			{
+				if (pfTransRow != NULL)
+					pfTransR = pfTransRow;
+				TransmissionRow(nY, nStartX, nEndX, pfTransR);
+			}
+
+			for (nX = nStartX; nX < nEndX; nX++)
 			{
+				if (pucMask != NULL && pucMask[nX] == 0)
+				{
+					outptr[0] = inptr[0];
+					outptr[1] = inptr[1];
+					outptr[2] = inptr[2];
+					inptr += 3;
+					outptr += 3;
+					continue;
+				}
+
+				float fTrans = CLIP_Z(pfTransR[nX]);
+				if (bBlend == true)
+					fTrans = fTrans / (fTrans + fStrength * (1.0f - fTrans));
+
 				// (3) Gamma correction using LUT
-				//imOutput.data[nY * nStep + nX * 3] = (uchar)m_pucGammaLUT[(uchar)CLIP((((float)((uchar)imInput.data[nY * nStep + nX * 3 + 0]) - fA_B) / CLIP_Z(m_pfTransmissionR[nY * m_nWid + nX]) + fA_B))];
-				//imOutput.data[nY * nStep + nX * 3 + 1] = (uchar)m_pucGammaLUT[(uchar)CLIP((((float)((uchar)imInput.data[nY * nStep + nX * 3 + 1]) - fA_G) / CLIP_Z(m_pfTransmissionR[nY * m_nWid + nX]) + fA_G))];
-				//imOutput.data[nY * nStep + nX * 3 + 2] = (uchar)m_pucGammaLUT[(uchar)CLIP((((float)((uchar)imInput.data[nY * nStep + nX * 3 + 2]) - fA_R) / CLIP_Z(m_pfTransmissionR[nY * m_nWid + nX]) + fA_R))];
-				outptr[0] = (uchar)m_pucGammaLUT[(uchar)CLIP((((float)((uchar)inptr[0]) - fA_B) / CLIP_Z(m_pfTransmissionR[n_pixel]) + fA_B))];
-				outptr[1] = (uchar)m_pucGammaLUT[(uchar)CLIP((((float)((uchar)inptr[1]) - fA_G) / CLIP_Z(m_pfTransmissionR[n_pixel]) + fA_G))];
-				outptr[2] = (uchar)m_pucGammaLUT[(uchar)CLIP((((float)((uchar)inptr[2]) - fA_R) / CLIP_Z(m_pfTransmissionR[n_pixel]) + fA_R))];
+				outptr[0] = (uchar)pucTone[(uchar)CLIP((((float)((uchar)inptr[0]) - fA_B) / fTrans + fA_B))];
+				outptr[1] = (uchar)pucTone[(uchar)CLIP((((float)((uchar)inptr[1]) - fA_G) / fTrans + fA_G))];
+				outptr[2] = (uchar)pucTone[(uchar)CLIP((((float)((uchar)inptr[2]) - fA_R) / fTrans + fA_R))];
 				inptr += 3;
 				outptr += 3;
-				n_pixel++;
 			}
 		}
 	}
+
+	// post processing flag
+	if (m_bPostFlag == true)
+	{
+		m_bTransValid = true;
+		PostProcessing(imOutput);
+	}
 }
 
 /*
 	Function: PostProcessing
 	Description: deblocking for blocking artifacts of mpeg video sequence.
+		It runs on the restored frame. Each decision looks back over pixels which
+		the earlier decisions of the same row may have smoothed, so the scan
+		inside a row stays sequential while the rows are processed in parallel.
+		The transmission test is evaluated 4 pixels at a time and the smoothing
+		ramp (nNumStep pixels x 3 channels) is applied with SSE, which gives
+		the same decisions and values as the per-pixel loop.
+		With a region of interest, only the ramps which read and write the ROI
+		span of each row (nX - 31 ~ nX - 11) are applied, and with a mask, only
+		the ramps of which every pixel (nX - 30 ~ nX - 21) is in the mask
+		(m_pucROIRun).
 	Parameter:
-		imInput - Input hazy frame.
+		imOutput - Restored frame.
 	Return:
-		imOutput - Dehazed frame.
+		imOutput - Deblocked frame.
  */
-void dehazing::PostProcessing(cv::Mat& imInput, cv::Mat& imOutput)
+void dehazing::PostProcessing(cv::Mat& imOutput)
 {
 	const int nNumStep = 10;
 	const int nDisPos = 20;
-	const int nStep = imInput.cols * 3;
 
-	float nAD0, nAD1, nAD2;
-	int nS, nX, nY;
-	float fA_R, fA_G, fA_B;
+	int nX, nY, nI;
 
-	fA_B = (float)m_anAirlight[0];
-	fA_G = (float)m_anAirlight[1];
-	fA_R = (float)m_anAirlight[2];
+	// step index (nS) and channel of each byte in the smoothing ramp
+	// the ramp covers nNumStep * 3 = 30 bytes, padded to 32
+	float afStep[32];
+	int anChannel[32];
+	for (nI = 0; nI < 32; nI++)
+	{
+		afStep[nI] = (float)(nI / 3 + 1);
+		anChannel[nI] = nI % 3;
+	}
 
-//#pragma omp parallel for private(nAD0, nAD1, nAD2, nS)
-	int n_pixel = 0;
-	const int dispos0 = 3 * nDisPos;
-	const int dispos1 = dispos0 + 3;
+	const int dispos1 = 3 * nDisPos + 3;
 	const int numstep0 = dispos1 + 3 * nNumStep;
 	const int numstep1 = dispos1 - 3 * nNumStep;
+	const __m128 sseThres = _mm_set1_ps(0.4f);
+
+#pragma omp parallel for private(nX, nI)
 	for (nY = 0; nY < m_nHei; nY++)
 	{
-		uchar* inptr = imInput.ptr<uchar>(nY);
-		uchar* outptr = imOutput.ptr<uchar>(nY);
-		for (nX = 0; nX < m_nWid; nX++)
+		uchar* outrow = imOutput.ptr<uchar>(nY);
+		float* pfTransR = m_pfTransmissionR + nY * m_nWid;
+		uchar* pucRun = NULL;
+		int nStartX = 0;
+		int nEndX = m_nWid;
+
+		if (m_bROIFlag == true)
 		{
-			// (1)  I' = (I - Airlight)/Transmission + Airlight
-			//imOutput.data[nY * nStep + nX * 3] = (uchar)m_pucGammaLUT[(uchar)CLIP((((float)((uchar)imInput.data[nY * nStep + nX * 3 + 0]) - fA_B) / CLIP_Z(m_pfTransmissionR[nY * m_nWid + nX]) + fA_B))];
-			//imOutput.data[nY * nStep + nX * 3 + 1] = (uchar)m_pucGammaLUT[(uchar)CLIP((((float)((uchar)imInput.data[nY * nStep + nX * 3 + 1]) - fA_G) / CLIP_Z(m_pfTransmissionR[nY * m_nWid + nX]) + fA_G))];
-			//imOutput.data[nY * nStep + nX * 3 + 2] = (uchar)m_pucGammaLUT[(uchar)CLIP((((float)((uchar)imInput.data[nY * nStep + nX * 3 + 2]) - fA_R) / CLIP_Z(m_pfTransmissionR[nY * m_nWid + nX]) + fA_R))];
-			outptr[0] = (uchar)m_pucGammaLUT[(uchar)CLIP((((float)((uchar)inptr[0]) - fA_B) / CLIP_Z(m_pfTransmissionR[n_pixel]) + fA_B))];
-			outptr[1] = (uchar)m_pucGammaLUT[(uchar)CLIP((((float)((uchar)inptr[1]) - fA_G) / CLIP_Z(m_pfTransmissionR[n_pixel]) + fA_G))];
-			outptr[2] = (uchar)m_pucGammaLUT[(uchar)CLIP((((float)((uchar)inptr[2]) - fA_R) / CLIP_Z(m_pfTransmissionR[n_pixel]) + fA_R))];
+			nStartX = m_pnROISpan[nY * 2];
+			nEndX = __min(m_pnROISpan[nY * 2 + 1] + nDisPos - nNumStep + 1, m_nWid);
+			if (m_pucROIMask != NULL)
+				pucRun = m_pucROIRun + nY * m_nWid;
+		}
 
-			// if transmission is less than 0.4, we apply post processing because more dehazed block yields more artifacts
-			if (nX > nDisPos + nNumStep && m_pfTransmissionR[n_pixel - nDisPos] < 0.4)
+		float afAD[3];
+		float nAD0, nAD1, nAD2;
+		__m128 sseAD, sseInc, sseOut;
+		__m128i sseZero = _mm_setzero_si128();
+
+		for (nX = nStartX + nDisPos + nNumStep + 1; nX < nEndX; nX++)
+		{
+			// skip 4 pixels at once when none of them has a transmission less than 0.4
+			if (nX + 4 <= nEndX && _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(pfTransR + nX - nDisPos), sseThres)) == 0)
 			{
-				//nAD0 = (float)((int)((uchar)imOutput.data[nY * nStep + (nX - nDisPos) * 3]) - (int)((uchar)imOutput.data[nY * nStep + (nX - nDisPos - 1) * 3]));
-				//nAD1 = (float)((int)((uchar)imOutput.data[nY * nStep + (nX - nDisPos) * 3 + 1]) - (int)((uchar)imOutput.data[nY * nStep + (nX - nDisPos - 1) * 3 + 1]));
-				//nAD2 = (float)((int)((uchar)imOutput.data[nY * nStep + (nX - nDisPos) * 3 + 2]) - (int)((uchar)imOutput.data[nY * nStep + (nX - nDisPos - 1) * 3 + 2]));
+				nX += 3;
+				continue;
+			}
 
+			// if transmission is less than 0.4, we apply post processing because more dehazed block yields more artifacts
+			if (pfTransR[nX - nDisPos] < 0.4
+				&& (pucRun == NULL || pucRun[nX - nDisPos - 1] >= nNumStep))
+			{
+				uchar* outptr = outrow + nX * 3;
 				uchar* dpout = outptr - dispos1;
 				nAD0 = (float)((int)((uchar)dpout[3]) - (int)((uchar)dpout[0]));
 				nAD1 = (float)((int)((uchar)dpout[4]) - (int)((uchar)dpout[1]));
 				nAD2 = (float)((int)((uchar)dpout[5]) - (int)((uchar)dpout[2]));
 
-				//if (__max(__max(abs(nAD0), abs(nAD1)), abs(nAD2)) < 20
-				//	&& abs((uchar)imOutput.data[nY * nStep + (nX - nDisPos - 1) * 3 + 0] - (uchar)imOutput.data[nY * nStep + (nX - nDisPos - 1 - nNumStep) * 3 + 0])
-				//	+ abs((uchar)imOutput.data[nY * nStep + (nX - nDisPos - 1) * 3 + 1] - (uchar)imOutput.data[nY * nStep + (nX - nDisPos - 1 - nNumStep) * 3 + 1])
-				//	+ abs((uchar)imOutput.data[nY * nStep + (nX - nDisPos - 1) * 3 + 2] - (uchar)imOutput.data[nY * nStep + (nX - nDisPos - 1 - nNumStep) * 3 + 2])
-				//	+ abs((uchar)imOutput.data[nY * nStep + (nX - nDisPos) * 3 + 0] - (uchar)imOutput.data[nY * nStep + (nX - nDisPos - 1 + nNumStep) * 3 + 0])
-				//	+ abs((uchar)imOutput.data[nY * nStep + (nX - nDisPos) * 3 + 1] - (uchar)imOutput.data[nY * nStep + (nX - nDisPos - 1 + nNumStep) * 3 + 1])
-				//	+ abs((uchar)imOutput.data[nY * nStep + (nX - nDisPos) * 3 + 2] - (uchar)imOutput.data[nY * nStep + (nX - nDisPos - 1 + nNumStep) * 3 + 2]) < 30)
-
 				uchar* nsout0 = outptr - numstep0;
 				uchar* nsout1 = outptr - numstep1;
 				if (__max(__max(abs(nAD0), abs(nAD1)), abs(nAD2)) < 20
@@ -548,32 +886,68 @@ void dehazing::PostProcessing(cv::Mat& imInput, cv::Mat& imOutput)
 					+ abs((uchar)dpout[4] - (uchar)nsout1[1])
 					+ abs((uchar)dpout[5] - (uchar)nsout1[2]) < 30)
 				{
-					
-					for (nS = 1; nS < nNumStep + 1; nS++)
+					// out = CLIP(out + nS * nAD / nNumStep) for nS = 1 ~ nNumStep
+					afAD[0] = nAD0;
+					afAD[1] = nAD1;
+					afAD[2] = nAD2;
+					uchar* pucRamp = nsout0 + 3;
+					for (nI = 0; nI < 32; nI += 4)
 					{
-						//imOutput.data[nY * nStep + (nX - nDisPos - 1 + nS - nNumStep) * 3 + 0] = (uchar)CLIP((float)((uchar)imOutput.data[nY * nStep + (nX - nDisPos - 1 + nS - nNumStep) * 3 + 0]) + (float)nS * nAD0 / (float)nNumStep);
-						//imOutput.data[nY * nStep + (nX - nDisPos - 1 + nS - nNumStep) * 3 + 1] = (uchar)CLIP((float)((uchar)imOutput.data[nY * nStep + (nX - nDisPos - 1 + nS - nNumStep) * 3 + 1]) + (float)nS * nAD1 / (float)nNumStep);
-						//imOutput.data[nY * nStep + (nX - nDisPos - 1 + nS - nNumStep) * 3 + 2] = (uchar)CLIP((float)((uchar)imOutput.data[nY * nStep + (nX - nDisPos - 1 + nS - nNumStep) * 3 + 2]) + (float)nS * nAD2 / (float)nNumStep);
-
-						nsout0 += 3;
-						nsout0[0] = (uchar)CLIP((float)((uchar)nsout0[0]) + (float)nS * nAD0 / (float)nNumStep);
-						nsout0[1] = (uchar)CLIP((float)((uchar)nsout0[1]) + (float)nS * nAD1 / (float)nNumStep);
-						nsout0[2] = (uchar)CLIP((float)((uchar)nsout0[2]) + (float)nS * nAD2 / (float)nNumStep);
+						int nPack = 0;
+						sseAD = _mm_setr_ps(afAD[anChannel[nI]], afAD[anChannel[nI + 1]], afAD[anChannel[nI + 2]], afAD[anChannel[nI + 3]]);
+						sseInc = _mm_div_ps(_mm_mul_ps(_mm_loadu_ps(afStep + nI), sseAD), _mm_set1_ps((float)nNumStep));
+
+						memcpy(&nPack, pucRamp + nI, nI < 28 ? 4 : 2);
+						sseOut = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(nPack), sseZero), sseZero));
+						sseOut = _mm_min_ps(_mm_max_ps(_mm_add_ps(sseOut, sseInc), _mm_setzero_ps()), _mm_set1_ps(255.0f));
+
+						__m128i ssePack = _mm_cvttps_epi32(sseOut);
+						ssePack = _mm_packus_epi16(_mm_packs_epi32(ssePack, sseZero), sseZero);
+						nPack = _mm_cvtsi128_si32(ssePack);
+						memcpy(pucRamp + nI, &nPack, nI < 28 ? 4 : 2);
 					}
 				}
 			}
-
-			inptr += 3;
-			outptr += 3;
-			n_pixel++;
 		}
 	}
 }
 
 
+/*
+	Function: CheckFrame
+	Description: check the size and the type of the input and output images.
+		The images may be views (ROI of a larger image, padded rows) and the
+		output may be the input itself (in-place). An empty output is allocated.
+	Parameter:
+		imInput - input image
+		imOutput - output image
+	Return:
+		true if the images can be processed
+ */
+bool dehazing::CheckFrame(cv::Mat& imInput, cv::Mat& imOutput)
+{
+	if (imInput.cols != m_nWid || imInput.rows != m_nHei || imInput.type() != CV_8UC3)
+	{
+		printf("The input image must be %dx%d CV_8UC3.\n", m_nWid, m_nHei);
+		return false;
+	}
+
+	if (imOutput.empty())
+		imOutput.create(m_nHei, m_nWid, CV_8UC3);
+	else if (imOutput.cols != m_nWid || imOutput.rows != m_nHei || imOutput.type() != CV_8UC3)
+	{
+		printf("The output image must be %dx%d CV_8UC3.\n", m_nWid, m_nHei);
+		return false;
+	}
+
+	return true;
+}
+
 /*
 	Function: HazeRemoval
 	Description: haze removal process
+		The input and output images may be views with any stride, and
+		imOutput may be imInput (in-place). An empty output is allocated.
 
 	Parameter:
 		imInput - input image
@@ -583,16 +957,90 @@ void dehazing::PostProcessing(cv::Mat& imInput, cv::Mat& imOutput)
  */
 void dehazing::HazeRemoval(cv::Mat& imInput, cv::Mat& imOutput, int nFrame)
 {
-	if (nFrame == 0)
+	if (CheckFrame(imInput, imOutput) == false)
+		return;
+
+	int nEstFrame = PrepareFrame(imInput, nFrame);
+
+	// integer only path (fixedpoint.cpp)
+	if (m_bFixedPoint == true)
 	{
-		cv::Mat imAir;
-		// initializing
-		MakeExpLUT();
-		GuideLUTMaker();
-		GammaLUTMaker(0.7f);
+		double dStage = omp_get_wtime();
+		IplImageToInt(imInput, m_pnYImg);
+		DownsampleImageQ();
+		TransmissionEstimationQ(m_pnSmallYImg, m_pnSmallTransQ, m_pnSmallYImgP, m_pnSmallTransQP, nEstFrame, 320, 240);
+
+		memcpy(m_pnSmallTransQP, m_pnSmallTransQ, 320 * 240 * sizeof(int));
+		memcpy(m_pnSmallYImgP, m_pnSmallYImg, 320 * 240 * sizeof(int));
+		if (m_pucState != NULL)
+			StoreState(m_pnSmallYImg, NULL, m_pnSmallTransQ);
+		m_afStageMs[STAGE_ESTIMATION] = (float)((omp_get_wtime() - dStage) * 1000.0);
+
+		dStage = omp_get_wtime();
+		UpsampleTransmissionQ();
+		// eps = 0.001 (Q16)
+		GuidedFilterQ(m_nWid, m_nHei, 66);
+		m_afStageMs[STAGE_REFINE] = (float)((omp_get_wtime() - dStage) * 1000.0);
+
+		dStage = omp_get_wtime();
+		RestoreImageQ(imInput, imOutput);
+		m_afStageMs[STAGE_RESTORE] = (float)((omp_get_wtime() - dStage) * 1000.0);
+		return;
+	}
+
+	double dStart = omp_get_wtime();
+
+	float fStrength = EstimationStage(imInput, nEstFrame, m_pnYImg, m_pnSmallYImg, m_pfSmallTrans);
+	RestorationStage(imInput, imOutput, fStrength);
+
+	// the settings of the next frame (the bypassed frames are not measured)
+	if (m_bGovernor == true && fStrength > 0)
+		GovernorUpdate((float)((omp_get_wtime() - dStart) * 1000.0));
+}
+
+/*
+	Function: PrepareFrame
+	Description: the atmospheric light at the first frame, and the map of the region of interest when it is changed.
+		With a loaded state (PersistState), the first frame uses the stored
+		atmospheric light and temporal information.
+	Parameter:
+		imInput - input image
+		nFrame - frame number
+	Return:
+		frame number of the estimation (0: the temporal information is reset,
+		e.g. the ROI or the estimation mode is changed)
+ */
+int dehazing::PrepareFrame(cv::Mat& imInput, int nFrame)
+{
+	int nK;
+	int nEstFrame = nFrame;
+	double dStart = omp_get_wtime();
+
+	if (nFrame == 0 && m_bStateWarm == true)
+	{
+		if (m_bFixedPoint == true)
+		{
+			for (nK = 0; nK < 320 * 240; nK++)
+				m_pnSmallTransQP[nK] = (int)(m_pfSmallTransP[nK] * (float)TRS_ONE + 0.5f);
+		}
+		m_nAirlight = (((int)(uchar)m_anAirlight[0] * 25 + (int)(uchar)m_anAirlight[1] * 129 + (int)(uchar)m_anAirlight[2] * 66 + 128) >> 8) + 16;
 
+		// the R, G, B images of the color transmission are not stored
+		if (m_bTransColor == false)
+			nEstFrame = 1;
+		m_bStateWarm = false;
+	}
+	else if (nFrame == 0)
+	{
+		cv::Mat imAir;
+		// (the look up tables are made by the constructor and FixedPointMode)
 		// specify the ROI region of atmospheric light estimation(optional)
-		imInput.rowRange(m_nTopLeftY, m_nBottomRightY).colRange(m_nTopLeftX, m_nBottomRightX).copyTo(imAir);
+		if (imInput.type() == CV_8UC1)
+			YUVRegionToBGR(imInput, cv::Rect(m_nTopLeftX, m_nTopLeftY, m_nBottomRightX - m_nTopLeftX, m_nBottomRightY - m_nTopLeftY), imAir);
+		else if (imInput.type() == CV_16UC3)
+			HighBitRegionToBGR(imInput, cv::Rect(m_nTopLeftX, m_nTopLeftY, m_nBottomRightX - m_nTopLeftX, m_nBottomRightY - m_nTopLeftY), imAir);
+		else
+			imInput.rowRange(m_nTopLeftY, m_nBottomRightY).colRange(m_nTopLeftX, m_nBottomRightX).copyTo(imAir);
 		//cvSetImageROI(imInput, cvRect(m_nTopLeftX, m_nTopLeftY, m_nBottomRightX - m_nTopLeftX, m_nBottomRightY - m_nTopLeftY));
 		//imAir = cvCreateImage(cvSize(m_nBottomRightX - m_nTopLeftX, m_nBottomRightY - m_nTopLeftY), IPL_DEPTH_8U, 3);
 		//cvCopyImage(imInput, imAir);
@@ -606,36 +1054,192 @@ void dehazing::HazeRemoval(cv::Mat& imInput, cv::Mat& imOutput, int nFrame)
 		//cvResetImageROI(imInput);
 	}
 
-	IplImageToInt(imInput);
-	// down sampling to fast estimation
-	DownsampleImage();
-
-	// trnasmission estimation
-	TransmissionEstimation(m_pnSmallYImg, m_pfSmallTrans, m_pnSmallYImgP, m_pfSmallTransP, nFrame, 320, 240);
-
-	// store a data for temporal coherent processing
-	memcpy(m_pfSmallTransP, m_pfSmallTrans, 320 * 240);
-	memcpy(m_pnSmallYImgP, m_pnSmallYImg, 320 * 240);
-
-	UpsampleTransmission();
+	// rebuild the map of the region of interest, the previous frame is not valid
+	// for the blocks which were not estimated
+	if (m_bROIUpdate == true)
+	{
+		if (m_bROIFlag == true)
+			UpdateROIMap();
+		m_bROIUpdate = false;
+		nEstFrame = 0;
+	}
 
-	/*
-	IplImage *test = cvCreateImage(cvSize(320, 240),IPL_DEPTH_8U, 1);
-	for(int nK = 0; nK < 320*240; nK++)
-		test->imageData[nK] = (uchar)(m_pnSmallYImg[nK]);
-	cvNamedWindow("tests");
-	cvShowImage("tests", test);
-	cvWaitKey(-1);
-	*/
-	FastGuidedFilter();
+	// the estimation mode is changed (TransColorMode, TransDarkChannelMode)
+	if (m_bTemporalReset == true)
+	{
+		m_bTemporalReset = false;
+		nEstFrame = 0;
+	}
 
-	// (9) 영상 복원 수행
-	RestoreImage(imInput, imOutput);
+	m_afStageMs[STAGE_PREPARE] = (float)((omp_get_wtime() - dStart) * 1000.0);
+	return nEstFrame;
 }
 
 /*
-	Function: ImageHazeRemoval
-	Description: haze removal process for a single image
+	Function: EstimationStage
+	Description: the transmission estimation of a frame (video dehazing).
+		It depends only on the previous estimation (m_pnSmallYImgP, m_pfSmallTransP),
+		hence the estimation of the next frame can run with RestorationStage
+		of the current frame on another set of the buffers (async.cpp).
+		With the haze detection, the strength follows the haze density of the
+		frame by m_nHazeRamp frames from 0 to 1, and the transmission is not
+		estimated at the strength 0 (bypass). The frame after a bypass is
+		estimated without the temporal information.
+	Parameter:
+		imInput - input image
+		nFrame - frame number (0: no temporal information)
+	Return:
+		pnYImg - Y image (m_pnYImg)
+		pnSmallYImg - down-sampled Y image (m_pnSmallYImg)
+		pfSmallTrans - initial transmission (m_pfSmallTrans)
+		dehazing strength of the frame (1 without the haze detection)
+ */
+float dehazing::EstimationStage(cv::Mat& imInput, int nFrame, int* pnYImg, int* pnSmallYImg, float* pfSmallTrans)
+{
+	float fStrength = 1.0f;
+	double dStart = omp_get_wtime();
+
+	// the luma plane of a YUV frame (yuv.cpp), the Y of a high bit depth frame (highbit.cpp)
+	if (imInput.type() == CV_8UC1)
+		IplImageToIntYUV(imInput, pnYImg);
+	else if (imInput.type() == CV_16UC3)
+		IplImageToInt16(imInput, pnYImg);
+	else
+		IplImageToInt(imInput, pnYImg);
+
+	// down sampling to fast estimation
+	DownsampleImage(pnYImg, pnSmallYImg);
+	if (m_bTransColor == true || m_bTransDark == true)
+		DownsampleImageColor(imInput);
+
+	if (m_bHazeDetect == true)
+	{
+		float fTarget, fStep = 1.0f / (float)m_nHazeRamp;
+
+		m_fHazeDensity = HazeDensity(pnSmallYImg);
+		fTarget = CLIP_Z((m_fHazeDensity - m_fHazeClear) / (m_fHazeHazy - m_fHazeClear));
+
+		// the first frame starts at the target
+		if (m_fHazeStrength < 0)
+			m_fHazeStrength = fTarget;
+		else if (fTarget > m_fHazeStrength)
+			m_fHazeStrength = __min(m_fHazeStrength + fStep, fTarget);
+		else
+			m_fHazeStrength = __max(m_fHazeStrength - fStep, fTarget);
+
+		fStrength = m_fHazeStrength;
+		if (fStrength <= 0)
+		{
+			m_bHazeResume = true;
+			m_afStageMs[STAGE_ESTIMATION] = (float)((omp_get_wtime() - dStart) * 1000.0);
+			return 0.0f;
+		}
+		if (m_bHazeResume == true)
+		{
+			nFrame = 0;
+			m_bHazeResume = false;
+		}
+	}
+
+	// trnasmission estimation
+	TransmissionEstimation(pnSmallYImg, pfSmallTrans, m_pnSmallYImgP, m_pfSmallTransP, nFrame, 320, 240);
+
+	// store a data for temporal coherent processing
+	memcpy(m_pfSmallTransP, pfSmallTrans, 320 * 240 * sizeof(float));
+	memcpy(m_pnSmallYImgP, pnSmallYImg, 320 * 240 * sizeof(int));
+	if (m_bTransColor == true)
+	{
+		memcpy(m_pnSmallRImgP, m_pnSmallRImg, 320 * 240 * sizeof(int));
+		memcpy(m_pnSmallGImgP, m_pnSmallGImg, 320 * 240 * sizeof(int));
+		memcpy(m_pnSmallBImgP, m_pnSmallBImg, 320 * 240 * sizeof(int));
+	}
+	if (m_pucState != NULL)
+		StoreState(pnSmallYImg, pfSmallTrans, NULL);
+
+	/*
+	IplImage *test = cvCreateImage(cvSize(320, 240),IPL_DEPTH_8U, 1);
+	for(int nK = 0; nK < 320*240; nK++)
+		test->imageData[nK] = (uchar)(m_pnSmallYImg[nK]);
+	cvNamedWindow("tests");
+	cvShowImage("tests", test);
+	cvWaitKey(-1);
+	*/
+
+	m_afStageMs[STAGE_ESTIMATION] = (float)((omp_get_wtime() - dStart) * 1000.0);
+	return fStrength;
+}
+
+/*
+	Function: RestorationStage
+	Description: the refinement of the transmission and the restoration of a frame
+		(video dehazing) from m_pnYImg, m_pnSmallYImg and m_pfSmallTrans.
+		The bypassed frame (strength 0) is copied. A YUV frame (CV_8UC1) is
+		restored by RestoreImageYUV, and a high bit depth frame (CV_16UC3) by
+		RestoreImage16.
+		Limitations of the YUV and the high bit depth frames: the refinements
+		with the RGB guidance (REFINE_COLOR, REFINE_SHIFTABLE) use the Y
+		guidance (REFINE_GREY, see Refine), the post processing (deblocking) is
+		not applied, and the integer only path (FixedPointMode, rejected by
+		CheckFrameYUV and CheckFrame16) and SubmitFrame are not supported.
+	Parameter:
+		imInput - input image
+		fStrength - dehazing strength (EstimationStage)
+	Return:
+		imOutput - output image
+ */
+void dehazing::RestorationStage(cv::Mat& imInput, cv::Mat& imOutput, float fStrength)
+{
+	if (fStrength <= 0)
+	{
+		if (imOutput.data != imInput.data)
+			imInput.copyTo(imOutput);
+		m_afStageMs[STAGE_REFINE] = 0.0f;
+		m_afStageMs[STAGE_RESTORE] = 0.0f;
+		return;
+	}
+
+	// upsampling and refinement of the transmission (FastGuidedFilter by default)
+	Refine(imInput, true);
+
+	// (9) 영상 복원 수행
+	double dStart = omp_get_wtime();
+	m_fRestoreStrength = fStrength;
+	if (imInput.type() == CV_8UC1)
+		RestoreImageYUV(imInput, imOutput);
+	else if (imInput.type() == CV_16UC3)
+		RestoreImage16(imInput, imOutput);
+	else
+		RestoreImage(imInput, imOutput);
+	m_fRestoreStrength = 1.0f;
+	m_afStageMs[STAGE_RESTORE] = (float)((omp_get_wtime() - dStart) * 1000.0);
+}
+
+/*
+	Function: HazeRemoval
+	Description: haze removal process of the external buffers (BGR, 3 bytes per pixel).
+		The buffers are wrapped without copy, and pucOutput may be pucInput (in-place).
+
+	Parameter:
+		pucInput - input image
+		nInputStep - bytes per row of the input image
+		nOutputStep - bytes per row of the output image
+		nFrame - frame number
+	Return:
+		pucOutput - output image
+ */
+void dehazing::HazeRemoval(uchar* pucInput, int nInputStep, uchar* pucOutput, int nOutputStep, int nFrame)
+{
+	cv::Mat imInput(m_nHei, m_nWid, CV_8UC3, pucInput, nInputStep);
+	cv::Mat imOutput(m_nHei, m_nWid, CV_8UC3, pucOutput, nOutputStep);
+
+	HazeRemoval(imInput, imOutput, nFrame);
+}
+
+/*
+	Function: ImageHazeRemoval
+	Description: haze removal process for a single image
+		The input and output images may be views with any stride, and
+		imOutput may be imInput (in-place). An empty output is allocated.
 
 	Parameter:
 		imInput - input image
@@ -646,10 +1250,11 @@ void dehazing::ImageHazeRemoval(cv::Mat& imInput, cv::Mat& imOutput)
 {
 	cv::Mat imAir;
 	cv::Mat imSmallInput;
-	// look up table creation
-	MakeExpLUT();
-	GuideLUTMaker();
-	GammaLUTMaker(0.7f);
+
+	if (CheckFrame(imInput, imOutput) == false)
+		return;
+
+	// the look up tables are made by the constructor and the settings
 
 	// specify the ROI region of atmospheric light estimation(optional)
 	//cvSetImageROI(imInput, cvRect(m_nTopLeftX, m_nTopLeftY, m_nBottomRightX - m_nTopLeftX, m_nBottomRightY - m_nTopLeftY));
@@ -667,12 +1272,18 @@ void dehazing::ImageHazeRemoval(cv::Mat& imInput, cv::Mat& imOutput)
 	imAir.release();
 
 	// iplimage to int
+	AllocColorImage();
 	IplImageToIntColor(imInput);
 
 	TransmissionEstimationColor(m_pnRImg, m_pnGImg, m_pnBImg, m_pfTransmission, m_pnRImg, m_pnGImg, m_pnBImg, m_pfTransmission, 0, m_nWid, m_nHei);
 
-	GuidedFilter(m_nWid, m_nHei, 0.001);
-	//GuidedFilterShiftableWindow(0.001);
+	// the transmission is estimated in the whole image, and only the region of interest is restored
+	// (m_bROIUpdate is kept for the temporal reset of HazeRemoval)
+	if (m_bROIFlag == true && m_bROIUpdate == true)
+		UpdateROIMap();
+
+	// refinement of the transmission (GuidedFilter by default)
+	Refine(imInput, false);
 	/*
 	IplImage *test = cvCreateImage(cvSize(m_nWid, m_nHei),IPL_DEPTH_8U, 1);
 	for(int nK = 0; nK < m_nWid*m_nHei; nK++)
@@ -687,6 +1298,26 @@ void dehazing::ImageHazeRemoval(cv::Mat& imInput, cv::Mat& imOutput)
 	imSmallInput.release();
 }
 
+/*
+	Function: ImageHazeRemoval
+	Description: haze removal process of the external buffers for a single image
+		(BGR, 3 bytes per pixel). pucOutput may be pucInput (in-place).
+
+	Parameter:
+		pucInput - input image
+		nInputStep - bytes per row of the input image
+		nOutputStep - bytes per row of the output image
+	Return:
+		pucOutput - output image
+ */
+void dehazing::ImageHazeRemoval(uchar* pucInput, int nInputStep, uchar* pucOutput, int nOutputStep)
+{
+	cv::Mat imInput(m_nHei, m_nWid, CV_8UC3, pucInput, nInputStep);
+	cv::Mat imOutput(m_nHei, m_nWid, CV_8UC3, pucOutput, nOutputStep);
+
+	ImageHazeRemoval(imInput, imOutput);
+}
+
 /*
 	Function:GetAirlight
 	Return: air light value
@@ -709,14 +1340,156 @@ int* dehazing::GetYImg()
 
 /*
 	Function:GetTransmission
+	Description: When the refinement was deferred to RestoreImage, the refined
+		transmission is computed here (once per frame).
 	Return: get refined transmission array
  */
 float* dehazing::GetTransmission()
 {
+	int nY;
+
+	if (m_bTransDeferred == true && m_bTransValid == false)
+	{
+#pragma omp parallel for
+		for (nY = 0; nY < m_nHei; nY++)
+		{
+			if (m_bROIFlag == true)
+				TransmissionRow(nY, m_pnROISpan[nY * 2], __max(m_pnROISpan[nY * 2 + 1], m_pnROISpan[nY * 2]), m_pfTransmissionR + nY * m_nWid);
+			else
+				TransmissionRow(nY, 0, m_nWid, m_pfTransmissionR + nY * m_nWid);
+		}
+		m_bTransValid = true;
+	}
+
 	// (1) 전달량 주소 리턴
 	return m_pfTransmissionR;
 }
 
+/*
+	Function:GetSkippedBlocks
+	Return: number of blocks which reused the previous transmission at the last frame
+ */
+int dehazing::GetSkippedBlocks()
+{
+	return m_nSkippedBlocks;
+}
+
+/*
+	Function:GetSkipRate
+	Return: ratio of the reused blocks to the estimated blocks at the last frame (0 ~ 1)
+ */
+float dehazing::GetSkipRate()
+{
+	if (m_nSkippedBlocks + m_nEstimatedBlocks == 0)
+		return 0.0f;
+	return (float)m_nSkippedBlocks / (float)(m_nSkippedBlocks + m_nEstimatedBlocks);
+}
+
+/*
+	Function:GetRefineMethod
+	Return: refinement method (REFINE_*) used at the last call
+ */
+int dehazing::GetRefineMethod()
+{
+	return m_nRefineUsed;
+}
+
+/*
+	Function:GetRefineCost
+	Return: modeled cost (ms) of the refinement method at the image size,
+		which is corrected by the measured time of the previous calls
+ */
+float dehazing::GetRefineCost(int nMethod)
+{
+	if (nMethod < 0 || nMethod >= REFINE_NUM)
+		return 0.0f;
+	return m_afRefineScale[nMethod] * (m_astRefine[nMethod].fFixedMs + m_astRefine[nMethod].fPixelNs * (float)(m_nWid * m_nHei) * 1e-6f);
+}
+
+/*
+	Function:GetGovernorLevel
+	Return: current level of the quality governor (0: the settings of the user)
+ */
+int dehazing::GetGovernorLevel()
+{
+	return m_nGovLevel;
+}
+
+/*
+	Function:GetGovernorLevelName
+	Return: name of the current level of the quality governor
+ */
+const char* dehazing::GetGovernorLevelName()
+{
+	return m_astGovernor[m_nGovLevel].pcName;
+}
+
+/*
+	Function:GetFrameTime
+	Return: smoothed frame time (ms) measured by the quality governor
+ */
+float dehazing::GetFrameTime()
+{
+	return m_fFrameMs;
+}
+
+/*
+	Function:GetStageTime
+	Return: time (ms) of the stage (STAGE_*) of the last frame of the video
+		dehazing
+ */
+float dehazing::GetStageTime(int nStage)
+{
+	if (nStage < 0 || nStage >= STAGE_NUM)
+		return 0.0f;
+	return m_afStageMs[nStage];
+}
+
+/*
+	Function:GetHazeDensity
+	Return: haze density of the last frame (HazeDetection)
+ */
+float dehazing::GetHazeDensity()
+{
+	return m_fHazeDensity;
+}
+
+/*
+	Function:GetHazeStrength
+	Return: dehazing strength of the last frame (0: bypassed, 1: full strength)
+ */
+float dehazing::GetHazeStrength()
+{
+	return m_bHazeDetect == true ? __max(m_fHazeStrength, 0.0f) : 1.0f;
+}
+
+/*
+	Function:GetWidth
+	Return: frame width of the engine
+ */
+int dehazing::GetWidth()
+{
+	return m_nWid;
+}
+
+/*
+	Function:GetHeight
+	Return: frame height of the engine
+ */
+int dehazing::GetHeight()
+{
+	return m_nHei;
+}
+
+/*
+	Function:GetOutputTone
+	Return: output tone curve (256 values), which can be shared by OutputTone
+ */
+const uchar* dehazing::GetOutputTone()
+{
+	return m_pucGammaLUT;
+}
+
 /*
 	Function:LambdaSetting
 		chnage labmda values
@@ -732,6 +1505,9 @@ void dehazing::LambdaSetting(float fLambdaLoss, float fLambdaTemp)
 		m_fLambda2 = fLambdaTemp;
 	else
 		m_bPreviousFlag = false;
+
+	m_nLambda1Q = (int)(m_fLambda1 * 256.0f + 0.5f);
+	m_nLambda2Q = (int)(m_fLambda2 * 256.0f + 0.5f);
 }
 
 /*
@@ -746,6 +1522,259 @@ void dehazing::PreviousFlag(bool bPrevFlag)
 	m_bPreviousFlag = bPrevFlag;
 }
 
+/*
+	Function:BlockSkipSetting
+		reuse the previous transmission of the static blocks (video dehazing)
+		A block is static when the mean absolute difference of the down-sampled
+		Y image from the previous frame is not greater than nSADThreshold.
+		A static block is estimated again at least every nRefreshPeriod frames,
+		and the refresh of the blocks is distributed over the period.
+	Parameter:
+		bSkipFlag - flag
+		nSADThreshold - mean absolute difference threshold (0 ~ 255)
+		nRefreshPeriod - maximum number of frames a block is reused (1 ~ 254)
+ */
+void dehazing::BlockSkipSetting(bool bSkipFlag, int nSADThreshold, int nRefreshPeriod)
+{
+	m_bBlockSkip = bSkipFlag;
+	m_nSkipSAD = __min(__max(nSADThreshold, 0), 255);
+	m_nRefreshPeriod = __min(__max(nRefreshPeriod, 1), 254);
+
+	if (m_pucBlockAge == NULL)
+		m_pucBlockAge = new uchar[320 * 240];
+
+	// every block is estimated at the next frame
+	memset(m_pucBlockAge, 255, 320 * 240);
+}
+
+/*
+	Function:RefineMethod
+		select the transmission refinement method of the next calls
+	Parameter:
+		nMethod - REFINE_DEFAULT, REFINE_AUTO, or REFINE_FAST ~ REFINE_COEF
+ */
+void dehazing::RefineMethod(int nMethod)
+{
+	if (nMethod < REFINE_DEFAULT || nMethod >= REFINE_NUM)
+	{
+		printf("Unknown refinement method %d\n", nMethod);
+		return;
+	}
+	m_nRefineMethod = nMethod;
+}
+
+/*
+	Function:HazeDetection
+		bypass the clear frames (video dehazing, not FixedPointMode)
+		The haze density (HazeDensity) of each frame is mapped to the target
+		strength, 0 at fClear and below, 1 at fHazy and above, and the strength
+		moves to the target by 1 / nRampFrames per frame. The output is blended
+		with the input by the strength, and a frame at the strength 0 is copied
+		without the transmission estimation and the restoration.
+	Parameter:
+		bEnable - flag
+		fClear - density of a clear frame (0.3 by default)
+		fHazy - density of a hazy frame (0.5 by default)
+		nRampFrames - frames from the bypass to the full strength (15 by default)
+ */
+void dehazing::HazeDetection(bool bEnable, float fClear, float fHazy, int nRampFrames)
+{
+	if (bEnable == true && fHazy <= fClear)
+	{
+		printf("The hazy density must be greater than the clear density.\n");
+		return;
+	}
+	if (bEnable == true && nRampFrames < 1)
+	{
+		printf("The ramp must be at least 1 frame.\n");
+		return;
+	}
+
+	m_bHazeDetect = bEnable;
+	m_fHazeClear = fClear;
+	m_fHazeHazy = fHazy;
+	m_nHazeRamp = nRampFrames;
+	m_fHazeStrength = -1.0f;
+	m_bHazeResume = false;
+}
+
+/*
+	Function:QualityGovernor
+		adjust the filter step size, the refinement (working resolution), the
+		transmission estimation and the block size between the frames to hold
+		the target frame time (video dehazing, not FixedPointMode).
+		The levels (m_astGovernor) are applied on top of the current settings,
+		which are restored when the governor is disabled. The other settings
+		must not be changed while the governor is enabled.
+		With a region of interest, the refinement of the levels is not applied
+		(the video dehazing with a ROI always uses FastGuidedFilter), hence the
+		"low-res refine" level is the same as the level above it.
+	Parameter:
+		bEnable - flag
+		fTargetMs - target frame time in milliseconds
+ */
+void dehazing::QualityGovernor(bool bEnable, float fTargetMs)
+{
+	m_fTargetMs = fTargetMs;
+	if (bEnable == m_bGovernor)
+		return;
+
+	if (bEnable == true)
+	{
+		m_nGovBaseStep = m_nStepSize;
+		m_nGovBaseBlock = m_nTBlockSize;
+		m_nGovBasePyramid = m_nPyramidLevel;
+		m_nGovBaseRefine = m_nRefineMethod;
+		m_bGovBaseSkip = m_bBlockSkip;
+
+		m_nGovLevel = 0;
+		m_fFrameMs = 0.0f;
+		m_nGovOver = 0;
+		m_nGovUnder = 0;
+		m_nGovHold = 0;
+		for (int nI = 0; nI < GOV_LEVEL_NUM; nI++)
+			m_afGovLevelMs[nI] = 0.0f;
+	}
+	else
+		ApplyGovernorLevel(0);
+
+	m_bGovernor = bEnable;
+}
+
+/*
+	Function:GovernorUpdate
+		measure the frame time and select the level of the next frames.
+		Hysteresis: the quality is lowered after nDegradeFrames frames over the
+		target, and raised after nUpgradeFrames frames under fUpgradeRatio of the
+		target when the better level was not too slow at the last measurement.
+		No decision is made for nHoldFrames frames after a change.
+	Parameter:
+		fFrameMs - time of the last frame
+ */
+void dehazing::GovernorUpdate(float fFrameMs)
+{
+	const int nDegradeFrames = 3;
+	const int nUpgradeFrames = 30;
+	const int nHoldFrames = 10;
+	const float fUpgradeRatio = 0.8f;
+
+	m_fFrameMs = m_fFrameMs == 0.0f ? fFrameMs : 0.75f * m_fFrameMs + 0.25f * fFrameMs;
+	m_afGovLevelMs[m_nGovLevel] = m_fFrameMs;
+
+	// the measurements of the other levels are forgotten slowly
+	for (int nI = 0; nI < GOV_LEVEL_NUM; nI++)
+		if (nI != m_nGovLevel)
+			m_afGovLevelMs[nI] *= 0.99f;
+
+	if (m_nGovHold > 0)
+	{
+		m_nGovHold--;
+		return;
+	}
+
+	m_nGovOver = m_fFrameMs > m_fTargetMs ? m_nGovOver + 1 : 0;
+	m_nGovUnder = m_fFrameMs < fUpgradeRatio * m_fTargetMs ? m_nGovUnder + 1 : 0;
+
+	int nLevel = m_nGovLevel;
+	if (m_nGovOver >= nDegradeFrames && m_nGovLevel < GOV_LEVEL_NUM - 1)
+		nLevel = m_nGovLevel + 1;
+	else if (m_nGovUnder >= nUpgradeFrames && m_nGovLevel > 0 && m_afGovLevelMs[m_nGovLevel - 1] < m_fTargetMs)
+		nLevel = m_nGovLevel - 1;
+
+	if (nLevel != m_nGovLevel)
+	{
+		ApplyGovernorLevel(nLevel);
+		m_nGovLevel = nLevel;
+		m_nGovOver = 0;
+		m_nGovUnder = 0;
+		m_nGovHold = nHoldFrames;
+		m_fFrameMs = m_afGovLevelMs[nLevel];
+	}
+}
+
+/*
+	Function:ApplyGovernorLevel
+		change the settings to the level of the governor
+		(only the settings which are changed are set, since some of them reset
+		 the temporal information)
+	Parameter:
+		nLevel - level (m_astGovernor)
+ */
+void dehazing::ApplyGovernorLevel(int nLevel)
+{
+	const GovernorLevel* pstLevel = &m_astGovernor[nLevel];
+
+	int nStep = __max(m_nGovBaseStep / pstLevel->nStepDiv, 1);
+	if (nStep != m_nStepSize)
+		SetFilterStepSize(nStep);
+
+	// the block size has to divide the down-sampled image
+	int nBlock = m_nGovBaseBlock * pstLevel->nBlockMul;
+	if (320 % nBlock != 0 || 240 % nBlock != 0)
+		nBlock = m_nGovBaseBlock;
+	if (nBlock != m_nTBlockSize)
+		TransBlockSize(nBlock);
+
+	int nPyramid = __max(m_nGovBasePyramid, pstLevel->nPyramid);
+	if (nPyramid != m_nPyramidLevel)
+		TransPyramidLevel(nPyramid);
+
+	bool bSkip = m_bGovBaseSkip || pstLevel->bBlockSkip;
+	if (bSkip != m_bBlockSkip)
+		BlockSkipSetting(bSkip, m_nSkipSAD, m_nRefreshPeriod);
+
+	// the video dehazing with a region of interest always uses FastGuidedFilter
+	// (SelectRefine), hence the refinement of the level is not applied
+	if (m_bROIFlag == true)
+		m_nRefineMethod = m_nGovBaseRefine;
+	else
+		m_nRefineMethod = pstLevel->nRefine == REFINE_DEFAULT ? m_nGovBaseRefine : pstLevel->nRefine;
+}
+
+/*
+	Function:RefineBudget
+		change the latency budget of the refinement for REFINE_AUTO
+	Parameter:
+		fBudgetMs - budget in milliseconds
+ */
+void dehazing::RefineBudget(float fBudgetMs)
+{
+	m_fRefineBudget = fBudgetMs;
+}
+
+/*
+	Function:AllocColorImage
+		allocate the RGB arrays of the image size, which are not allocated by the
+		constructor without the block sizes
+ */
+void dehazing::AllocColorImage()
+{
+	if (m_pnRImg != NULL)
+		return;
+
+	m_pnRImg = new int[m_nCapPixels];
+	m_pnGImg = new int[m_nCapPixels];
+	m_pnBImg = new int[m_nCapPixels];
+}
+
+/*
+	Function:AllocSmallColorImage
+		allocate the down-sampled R, G, B arrays (and of the previous frame), which
+		are not allocated by the constructor without the block sizes
+ */
+void dehazing::AllocSmallColorImage()
+{
+	if (m_pnSmallRImg != NULL)
+		return;
+
+	m_pnSmallRImg = new int[320 * 240];
+	m_pnSmallRImgP = new int[320 * 240];
+	m_pnSmallGImg = new int[320 * 240];
+	m_pnSmallGImgP = new int[320 * 240];
+	m_pnSmallBImg = new int[320 * 240];
+	m_pnSmallBImgP = new int[320 * 240];
+}
+
 /*
 	Function:TransBlockSize
 		change the block size of transmission estimation
@@ -756,6 +1785,100 @@ void dehazing::TransBlockSize(int nBlockSize)
 {
 	// (1) 전달량 계산의 블록 크기 결정
 	m_nTBlockSize = nBlockSize;
+	m_bROIUpdate = m_bROIFlag;
+
+	// the block indices are changed, every block is estimated again
+	if (m_pucBlockAge != NULL)
+		memset(m_pucBlockAge, 255, 320 * 240);
+}
+
+/*
+	Function:TransPyramidLevel
+		change the number of pyramid levels of transmission estimation (video dehazing)
+		The transmission is searched in all candidates at the coarsest level, and
+		each finer level halves the step of the candidates around the parent.
+		The number of levels used at the estimation may be smaller (see
+		TransmissionEstimationPyramid).
+	Parameter:
+		nLevel - number of levels (1: single scale, 2 ~ 3)
+ */
+void dehazing::TransPyramidLevel(int nLevel)
+{
+	m_nPyramidLevel = __min(__max(nLevel, 1), 3);
+
+	if (m_nPyramidLevel > 1 && m_pnPyramidY == NULL)
+	{
+		m_pnPyramidY = new int[160 * 120 + 80 * 60];
+		m_pnPyramidYP = new int[160 * 120 + 80 * 60];
+		m_pfPyramidTrans = new float[80 * 60];
+		m_pucPyramidState = new uchar[80 * 60];
+	}
+}
+
+/*
+	Function:TransDenseMode
+		estimate the transmission at each pixel (video dehazing)
+		The cost of the block estimation is evaluated in the window of each pixel
+		(TransmissionEstimationDense), and the transmission map is smooth, hence
+		a lighter refinement (e.g. REFINE_COEF, a smaller filter block) is enough.
+		The pyramid levels and the block skip are not used in the dense mode.
+	Parameter:
+		bDense - true: dense estimation, false: block estimation
+ */
+void dehazing::TransDenseMode(bool bDense)
+{
+	m_bTransDense = bDense;
+
+	// the blocks are estimated again when the mode is turned off
+	if (m_pucBlockAge != NULL)
+		memset(m_pucBlockAge, 255, 320 * 240);
+}
+
+/*
+	Function:TransColorMode
+		estimate the transmission from the R, G, B images (video dehazing)
+		The blocks are estimated by NFTrsEstimationColor (NFTrsEstimationPColor
+		with the previous frame) on the down-sampled R, G, B images, which are
+		sampled from the frame without the full size R, G, B arrays (a YUV frame
+		is converted at the samples). The planes are summed with SSE2, so the
+		estimation costs about the same as the luma estimation.
+		The dense mode and the pyramid levels use the luma.
+	Parameter:
+		bColor - true: R, G, B, false: luma
+ */
+void dehazing::TransColorMode(bool bColor)
+{
+	m_bTransColor = bColor;
+
+	if (m_bTransColor == true)
+		AllocSmallColorImage();
+
+	// the previous R, G, B images are not valid, the temporal information is
+	// reset at the next frame
+	m_bTemporalReset = true;
+}
+
+/*
+	Function:TransDarkChannelMode
+		estimate the transmission by the dark channel prior instead of the block
+		search (TransmissionEstimationDark), in the video and the image dehazing.
+		The dark channel is the minimum of R, G, B in the window of
+		m_nTBlockSize + 1 pixels, of the down-sampled image for the video.
+		The refinement and the restoration are the same.
+	Parameter:
+		bDark - true: dark channel prior, false: block search
+		fOmega - amount of the haze removed (0.95 in He et al.)
+ */
+void dehazing::TransDarkChannelMode(bool bDark, float fOmega)
+{
+	m_bTransDark = bDark;
+	m_fDarkOmega = fOmega;
+
+	if (m_bTransDark == true)
+		AllocSmallColorImage();
+
+	// the block search continues without the temporal information
+	m_bTemporalReset = true;
 }
 
 /*
@@ -768,6 +1891,7 @@ void dehazing::FilterBlockSize(int nBlockSize)
 {
 	// (1) 전달량 계산의 블록 크기 결정
 	m_nGBlockSize = nBlockSize;
+	m_bROIUpdate = m_bROIFlag;
 }
 
 /*
@@ -780,6 +1904,7 @@ void dehazing::SetFilterStepSize(int nStepSize)
 {
 	// (1) guided filter의 step size 수정
 	m_nStepSize = nStepSize;
+	m_bROIUpdate = m_bROIFlag;
 }
 
 /*
@@ -811,6 +1936,298 @@ void dehazing::AirlightSerachRange(cv::Point pointTopLeft, cv::Point pointBottom
 void dehazing::FilterSigma(float nSigma)
 {
 	m_fGSigma = nSigma;
+	m_bROIUpdate = m_bROIFlag;
+}
+
+/*
+	Function: OutputTone
+	Description: set the output tone of the restored image as a gamma curve.
+		The table is made once and applied in the restoration (TONE_GAMMA_DEFAULT
+		by default).
+	Parameter:
+		fGamma - gamma (1: no tone mapping)
+ */
+void dehazing::OutputTone(float fGamma)
+{
+	GammaLUTMaker(fGamma);
+}
+
+/*
+	Function: OutputTone
+	Description: set the output tone of the restored image as an arbitrary curve,
+		e.g. the curve of another instance (GetOutputTone).
+	Parameter:
+		pucCurve - 256 output values for the restored values 0 ~ 255
+ */
+void dehazing::OutputTone(const uchar* pucCurve)
+{
+	memcpy(m_pucGammaLUT, pucCurve, 256);
+	m_fToneGamma = -1.0f;
+	m_nToneBits = 0;
+}
+
+/*
+	Function: SetROI
+	Description: Restrict the video dehazing (HazeRemoval) to a rectangle.
+		The transmission estimation, guided filtering, and restoration run only
+		over the ROI and the halo needed by the filter windows, and the other
+		pixels are copied from the input. The transmission (GetTransmission)
+		is valid only inside the ROI. The post processing does not read the
+		pixels out of the ROI, hence the result may differ from the whole frame
+		processing within 31 pixels of the left and right boundary. The guided
+		filter accumulates the windows which reach the ROI within 3 sigma of the
+		Gaussian weight, and the tails of the recursive Gaussian beyond them are
+		left out, hence the refined transmission differs slightly (about 1e-4)
+		from the whole frame processing.
+		The temporal information is reset at the next frame, and the integer
+		path (FixedPointMode) ignores the ROI.
+	Parameter:
+		rectROI - region of interest
+ */
+void dehazing::SetROI(cv::Rect rectROI)
+{
+	rectROI = rectROI & cv::Rect(0, 0, m_nWid, m_nHei);
+	if (rectROI.width <= 0 || rectROI.height <= 0)
+	{
+		printf("The region of interest is empty\n");
+		return;
+	}
+
+	if (m_pucROIMask != NULL)
+		delete[] m_pucROIMask;
+	m_pucROIMask = NULL;
+
+	m_rectROI = rectROI;
+	m_bROIFlag = true;
+	m_bROIUpdate = true;
+}
+
+/*
+	Function: SetROI
+	Description: Restrict the video dehazing (HazeRemoval) to a mask.
+		The processing cost follows the cells covered by the mask, and the
+		pixels out of the mask are copied from the input.
+	Parameter:
+		imMask - CV_8UC1 mask of the frame size, nonzero pixels are the region of interest
+ */
+void dehazing::SetROI(cv::Mat& imMask)
+{
+	int nX, nY;
+	int nMinX = m_nWid, nMinY = m_nHei, nMaxX = -1, nMaxY = -1;
+
+	if (imMask.cols != m_nWid || imMask.rows != m_nHei || imMask.type() != CV_8UC1)
+	{
+		printf("The mask should be CV_8UC1 of the frame size\n");
+		return;
+	}
+
+	if (m_pucROIMask == NULL)
+		m_pucROIMask = new uchar[m_nCapPixels];
+
+	for (nY = 0; nY < m_nHei; nY++)
+	{
+		uchar* pucMask = imMask.ptr<uchar>(nY);
+		uchar* pucROI = m_pucROIMask + nY * m_nWid;
+		for (nX = 0; nX < m_nWid; nX++)
+		{
+			pucROI[nX] = pucMask[nX] != 0;
+			if (pucROI[nX])
+			{
+				nMinX = __min(nMinX, nX);
+				nMaxX = __max(nMaxX, nX);
+				nMinY = __min(nMinY, nY);
+				nMaxY = __max(nMaxY, nY);
+			}
+		}
+	}
+
+	if (nMaxX < 0)
+	{
+		printf("The region of interest is empty\n");
+		ResetROI();
+		return;
+	}
+
+	m_rectROI = cv::Rect(nMinX, nMinY, nMaxX - nMinX + 1, nMaxY - nMinY + 1);
+	m_bROIFlag = true;
+	m_bROIUpdate = true;
+}
+
+/*
+	Function: ResetROI
+	Description: Process the whole frame again.
+ */
+void dehazing::ResetROI()
+{
+	if (m_pucROIMask != NULL)
+		delete[] m_pucROIMask;
+	m_pucROIMask = NULL;
+
+	m_bROIUpdate = m_bROIFlag;
+	m_bROIFlag = false;
+
+	// the refinement of the governor level is applied without the ROI
+	if (m_bGovernor == true)
+		ApplyGovernorLevel(m_nGovLevel);
+}
+
+/*
+	Function: UpdateROIMap
+	Description: Build the cell map of the region of interest.
+		The cell size is the sampling step of FastGuidedFilter, so each filter
+		window covers whole cells.
+		(1) ROI_CELL_RESTORE - cells containing the ROI, and the ROI span of each row
+			(and the run of the mask pixels of PostProcessing).
+		(2) ROI_CELL_FILTER - cells of every window overlapping the ROI, or
+			reaching it by the Gaussian weight (3 sigma, FastGuidedFilterAccumulate).
+		(3) m_pucROIBlock - transmission blocks upsampled into the filter cells.
+		(4) ROI_CELL_SAMPLE - cells read by DownsampleImage for those blocks.
+	Return:
+		m_pucROICell, m_pucROIBlock, m_pnROISpan, m_pucROIRun, m_pnUpX, m_pnUpY
+ */
+void dehazing::UpdateROIMap()
+{
+	int nX, nY, nCX, nCY, nBX, nBY, nI, nJ;
+
+	m_nCellSize = __max(m_nGBlockSize / m_nStepSize, 1);
+	m_nCellW = (m_nWid + m_nCellSize - 1) / m_nCellSize;
+	m_nCellH = (m_nHei + m_nCellSize - 1) / m_nCellSize;
+
+	const int nBlockW = (320 + m_nTBlockSize - 1) / m_nTBlockSize;
+	const int nBlockH = (240 + m_nTBlockSize - 1) / m_nTBlockSize;
+
+	if (m_pucROICell != NULL)
+		delete[] m_pucROICell;
+	if (m_pucROIBlock != NULL)
+		delete[] m_pucROIBlock;
+	m_pucROICell = new uchar[m_nCellW * m_nCellH];
+	m_pucROIBlock = new uchar[nBlockW * nBlockH];
+	memset(m_pucROICell, 0, m_nCellW * m_nCellH);
+	memset(m_pucROIBlock, 0, nBlockW * nBlockH);
+
+	if (m_pnROISpan == NULL)
+	{
+		m_pnROISpan = new int[m_nCapLine * 2];
+		m_pnUpX = new int[m_nCapLine];
+		m_pnUpY = new int[m_nCapLine];
+	}
+
+	// (1) cells containing the ROI
+	for (nY = 0; nY < m_nHei; nY++)
+	{
+		m_pnROISpan[nY * 2] = m_nWid;
+		m_pnROISpan[nY * 2 + 1] = 0;
+	}
+	if (m_pucROIMask != NULL && m_pucROIRun == NULL)
+		m_pucROIRun = new uchar[m_nCapPixels];
+	for (nY = m_rectROI.y; nY < m_rectROI.y + m_rectROI.height; nY++)
+	{
+		uchar* pucCell = m_pucROICell + (nY / m_nCellSize) * m_nCellW;
+		int nRun = 0;
+		for (nX = m_rectROI.x; nX < m_rectROI.x + m_rectROI.width; nX++)
+		{
+			if (m_pucROIMask == NULL || m_pucROIMask[nY * m_nWid + nX])
+			{
+				pucCell[nX / m_nCellSize] |= ROI_CELL_RESTORE;
+				m_pnROISpan[nY * 2] = __min(m_pnROISpan[nY * 2], nX);
+				m_pnROISpan[nY * 2 + 1] = nX + 1;
+				nRun = __min(nRun + 1, 255);
+			}
+			else
+				nRun = 0;
+			if (m_pucROIMask != NULL)
+				m_pucROIRun[nY * m_nWid + nX] = (uchar)nRun;
+		}
+	}
+
+	// (2) every window overlapping a ROI cell covers at most nSpan - 1 cells beyond it,
+	//     and nReach cells more are reached by the Gaussian weight of the window
+	const int nSpan = (m_nGBlockSize + m_nCellSize - 1) / m_nCellSize;
+	const int nReach = (int)ceilf(3.0f * m_fGSigma / m_nCellSize);
+	for (nCY = 0; nCY < m_nCellH; nCY++)
+	{
+		for (nCX = 0; nCX < m_nCellW; nCX++)
+		{
+			if (!(m_pucROICell[nCY * m_nCellW + nCX] & ROI_CELL_RESTORE))
+				continue;
+			for (nJ = __max(nCY - nSpan - nReach + 1, 0); nJ < __min(nCY + nSpan + nReach, m_nCellH); nJ++)
+				for (nI = __max(nCX - nSpan - nReach + 1, 0); nI < __min(nCX + nSpan + nReach, m_nCellW); nI++)
+					m_pucROICell[nJ * m_nCellW + nI] |= ROI_CELL_FILTER;
+		}
+	}
+
+	// (3) transmission blocks of the filter cells (1 pixel margin for the float stepping)
+	for (nCY = 0; nCY < m_nCellH; nCY++)
+	{
+		for (nCX = 0; nCX < m_nCellW; nCX++)
+		{
+			if (!(m_pucROICell[nCY * m_nCellW + nCX] & ROI_CELL_FILTER))
+				continue;
+			int nX0 = __max(nCX * m_nCellSize * 320 / m_nWid - 1, 0);
+			int nX1 = __min((__min((nCX + 1) * m_nCellSize, m_nWid) - 1) * 320 / m_nWid + 1, 319);
+			int nY0 = __max(nCY * m_nCellSize * 240 / m_nHei - 1, 0);
+			int nY1 = __min((__min((nCY + 1) * m_nCellSize, m_nHei) - 1) * 240 / m_nHei + 1, 239);
+			for (nBY = nY0 / m_nTBlockSize; nBY <= nY1 / m_nTBlockSize; nBY++)
+				for (nBX = nX0 / m_nTBlockSize; nBX <= nX1 / m_nTBlockSize; nBX++)
+					m_pucROIBlock[nBY * nBlockW + nBX] = 1;
+		}
+	}
+
+	// (4) cells sampled by the estimated blocks
+	for (nBY = 0; nBY < nBlockH; nBY++)
+	{
+		for (nBX = 0; nBX < nBlockW; nBX++)
+		{
+			if (!m_pucROIBlock[nBY * nBlockW + nBX])
+				continue;
+			int nX0 = __max(nBX * m_nTBlockSize * m_nWid / 320 - 1, 0);
+			int nX1 = __min((__min((nBX + 1) * m_nTBlockSize, 320) - 1) * m_nWid / 320 + 1, m_nWid - 1);
+			int nY0 = __max(nBY * m_nTBlockSize * m_nHei / 240 - 1, 0);
+			int nY1 = __min((__min((nBY + 1) * m_nTBlockSize, 240) - 1) * m_nHei / 240 + 1, m_nHei - 1);
+			for (nCY = nY0 / m_nCellSize; nCY <= nY1 / m_nCellSize; nCY++)
+				for (nCX = nX0 / m_nCellSize; nCX <= nX1 / m_nCellSize; nCX++)
+					m_pucROICell[nCY * m_nCellW + nCX] |= ROI_CELL_SAMPLE;
+		}
+	}
+
+	// upsampling index with the same float stepping as UpsampleTransmission
+	float fRatioX = (float)320 / (float)m_nWid;
+	float fRatioY = (float)240 / (float)m_nHei;
+	float frx = 0, fry = 0;
+	for (nX = 0; nX < m_nWid; nX++)
+	{
+		m_pnUpX[nX] = (int)frx;
+		frx += fRatioX;
+	}
+	for (nY = 0; nY < m_nHei; nY++)
+	{
+		m_pnUpY[nY] = (int)fry;
+		fry += fRatioY;
+	}
+}
+
+/*
+	Function: ROIWindow
+	Description: Check whether the guided filter window starting at the cell
+		overlaps the region of interest, or reaches it by the Gaussian weight
+		(3 sigma, the same as UpdateROIMap).
+	Parameter:
+		nCellX - x index of the first cell of the window
+		nCellY - y index of the first cell of the window
+	Return:
+		boolean value
+ */
+bool dehazing::ROIWindow(int nCellX, int nCellY)
+{
+	const int nSpan = (m_nGBlockSize + m_nCellSize - 1) / m_nCellSize;
+	const int nReach = (int)ceilf(3.0f * m_fGSigma / m_nCellSize);
+	int nI, nJ;
+
+	for (nJ = __max(nCellY - nReach, 0); nJ < __min(nCellY + nSpan + nReach, m_nCellH); nJ++)
+		for (nI = __max(nCellX - nReach, 0); nI < __min(nCellX + nSpan + nReach, m_nCellW); nI++)
+			if (m_pucROICell[nJ * m_nCellW + nI] & ROI_CELL_RESTORE)
+				return true;
+	return false;
 }
 
 /*
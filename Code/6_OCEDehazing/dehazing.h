@@ -2,43 +2,152 @@
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <emmintrin.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <string>
 
 #define CLIP(x) ((x)<(0)?0:((x)>(255)?(255):(x)))
 #define CLIP_Z(x) ((x)<(0)?0:((x)>(1.0f)?(1.0f):(x)))
 #define CLIP_TRS(x) ((x)<(0.1f)?0.1f:((x)>(1.0f)?(1.0f):(x)))
 
+// Fixed-point transmission (Q12, 4096 == 1.0)
+#define TRS_SHIFT 12
+#define TRS_ONE (1 << TRS_SHIFT)
+#define CLIP_TRSQ(x) ((x)<(1)?1:((x)>(TRS_ONE)?(TRS_ONE):(x)))
+#define GUIDE_Q_MAX_RADIUS 128	// largest radius of GuidedFilterQ (32-bit window sums)
+
+// Cell flags of the region of interest map
+#define ROI_CELL_RESTORE 1		// the cell contains the region of interest
+#define ROI_CELL_FILTER 2		// the cell is covered by the guided filter windows of the region
+#define ROI_CELL_SAMPLE 4		// the cell is sampled by the transmission estimation
+
+// Transmission refinement methods (RefineMethod)
+#define REFINE_DEFAULT -2		// FastGuidedFilter for video, GuidedFilter for image
+#define REFINE_AUTO -1			// the best method within the latency budget (RefineBudget)
+#define REFINE_FAST 0			// FastGuidedFilter (Y guidance, sampled windows)
+#define REFINE_FAST_SMALL 1		// FastGuidedFilterS on 320*240 and bilinear upsampling (video only)
+#define REFINE_GREY 2			// GuidedFilterY (Y guidance)
+#define REFINE_COLOR 3			// GuidedFilter (RGB guidance)
+#define REFINE_SHIFTABLE 4		// GuidedFilterShiftableWindow (RGB guidance)
+#define REFINE_COEF 5			// GuidedFilterCoef on 320*240, coefficients upsampled in RestoreImage (video only)
+#define REFINE_NUM 6
+
+// Stages of the video dehazing (GetStageTime)
+#define STAGE_PREPARE 0			// PrepareFrame (atmospheric light, ROI map)
+#define STAGE_ESTIMATION 1		// EstimationStage (conversion, down sampling, transmission)
+#define STAGE_REFINE 2			// Refine (also ImageHazeRemoval)
+#define STAGE_RESTORE 3			// restoration of RestorationStage
+#define STAGE_NUM 4
+
+// Gamma of the output tone by default (OutputTone)
+#define TONE_GAMMA_DEFAULT 0.7f
+
+// YUV 4:2:0 layouts (HazeRemovalYUV)
+#define YUV_I420 0				// Y plane, U plane, V plane
+#define YUV_NV12 1				// Y plane, interleaved UV plane
+
+// Quality levels of the governor (QualityGovernor), 0 is the best
+#define GOV_LEVEL_NUM 5
+
+// Overrun policies of the frame ring (FrameRing)
+#define RING_DROP_OLDEST 0		// the producer drops the oldest queued frame
+#define RING_BLOCK 1			// the producer waits for a released frame
+
 using namespace std;
 
+// Called by the worker thread when a submitted frame is restored (SubmitFrame)
+typedef void (*FrameCallback)(cv::Mat& imOutput, double dTimestamp, void* pUserData);
+
+// Sums of the restored block of the transmission estimation (Transmission.cpp)
+typedef void (*BlockSumFunc)(const int* pnImageY, int nStride, int nCols, int nRows, int nAirlight, int nTrans, int* pnSums);
+
 class dehazing
 {
 public:
-	dehazing();
+	// the buffers are allocated for a frame size (Reconfigure changes it),
+	// hence there is no default constructor
+	dehazing() = delete;
 	dehazing(int nW, int nH, bool bPrevFlag, bool bPosFlag);
 	dehazing(int nW, int nH, int nTBlockSize, bool bPrevFlag, bool bPosFlag, float fL1, float fL2, int nGBlock);
 	~dehazing(void);
 
+	// the worker thread and the mutexes refer to the object, hence it is not
+	// copied nor moved. DehazingEngine (below) is the supported owner of a
+	// movable engine
+	dehazing(const dehazing&) = delete;
+	dehazing& operator=(const dehazing&) = delete;
+	dehazing(dehazing&&) = delete;
+	dehazing& operator=(dehazing&&) = delete;
+
+	void	Reconfigure(int nW, int nH, int nTBlockSize, int nGBlock);
+
 	void	HazeRemoval(cv::Mat& imInput, cv::Mat& imOutput, int nFrame);
+	void	HazeRemoval(uchar* pucInput, int nInputStep, uchar* pucOutput, int nOutputStep, int nFrame);
 	void	ImageHazeRemoval(cv::Mat& imInput, cv::Mat& imOutput);
+	void	ImageHazeRemoval(uchar* pucInput, int nInputStep, uchar* pucOutput, int nOutputStep);
+	void	HazeRemovalYUV(cv::Mat& imInput, cv::Mat& imOutput, int nFormat, int nFrame);
+	void	HazeRemovalYUV(uchar* pucInput, int nInputStep, uchar* pucOutput, int nOutputStep, int nFormat, int nFrame);
+	void	HazeRemoval16(cv::Mat& imInput, cv::Mat& imOutput, int nBits, int nFrame);
+	void	HazeRemoval16(unsigned short* pusInput, int nInputStep, unsigned short* pusOutput, int nOutputStep, int nBits, int nFrame);
+	static void HazeRemovalBatch(dehazing** ppEngine, cv::Mat* pimInput, cv::Mat* pimOutput, const int* pnFrame, int nBatch);
+	std::future<double>	SubmitFrame(cv::Mat& imInput, cv::Mat& imOutput, double dTimestamp);
+	void	SetFrameCallback(FrameCallback pfnCallback, void* pUserData);
+	void	Flush();
 	void	LambdaSetting(float fLambdaLoss, float fLambdaTemp);
 	void	DecisionUse(bool bChoice);
 	void	TransBlockSize(int nBlockSize);
+	void	TransPyramidLevel(int nLevel);
+	void	TransDenseMode(bool bDense);
+	void	TransColorMode(bool bColor);
+	void	TransDarkChannelMode(bool bDark, float fOmega = 0.95f);
 	void	FilterBlockSize(int nBlockSize);
 	void	AirlightSerachRange(cv::Point pointTopLeft, cv::Point pointBottomRight);
+	void	SetROI(cv::Rect rectROI);
+	void	SetROI(cv::Mat& imMask);
+	void	ResetROI();
 	void	SetFilterStepSize(int nStepsize);
 	void	PreviousFlag(bool bPrevFlag);
 	void	FilterSigma(float nSigma);
+	void	FixedPointMode(bool bFixedFlag);
+	void	BlockSkipSetting(bool bSkipFlag, int nSADThreshold, int nRefreshPeriod);
+	void	RefineMethod(int nMethod);
+	void	RefineBudget(float fBudgetMs);
+	void	QualityGovernor(bool bEnable, float fTargetMs);
+	void	OutputTone(float fGamma);
+	void	OutputTone(const uchar* pucCurve);
+	void	HazeDetection(bool bEnable, float fClear, float fHazy, int nRampFrames);
+	bool	PersistState(const char* pszCameraID, const char* pszDirectory = ".", int nPeriod = 300);
 	bool	Decision(cv::Mat& imInput, cv::Mat& imOutput, int nThreshold);
+	static BlockSumFunc BlockSumKernel(int nIndex, int* pnBlockW);
 
 	int* GetAirlight();
 	int* GetYImg();
 	float* GetTransmission();
+	int* GetTransmissionQ();
+	int		GetSkippedBlocks();
+	float	GetSkipRate();
+	int		GetRefineMethod();
+	float	GetRefineCost(int nMethod);
+	int		GetGovernorLevel();
+	const char* GetGovernorLevelName();
+	float	GetFrameTime();
+	float	GetStageTime(int nStage);
+	const uchar* GetOutputTone();
+	float	GetHazeDensity();
+	float	GetHazeStrength();
+	int		GetWidth();
+	int		GetHeight();
 
 private:
 
 	//320*240 size
 	float* m_pfSmallY;			//Y image
-	float* m_pfSmallPk_p;		//(Y image) - (mean of Y image)
-	float* m_pfSmallNormPk;	//Normalize된 Y image
 	float* m_pfSmallInteg;		//Gaussian weight가 적용된 transmission 결과
 	float* m_pfSmallDenom;		//Gaussian weight가 저장된 행렬
 
@@ -59,8 +168,6 @@ private:
 
 	//Original size
 	float* m_pfY;				//Y image
-	float* m_pfPk_p;			//(Y image) - (mean of Y image)
-	float* m_pfNormPk;			//Normalize된 Y image
 	float* m_pfInteg;			//Gaussian weight가 적용된 transmission 결과
 	float* m_pfDenom;			//Gaussian weight가 저장된 행렬
 
@@ -81,11 +188,10 @@ private:
 
 	//////////////////////////////////////////////////////////////////////////
 	int		m_nStepSize;		//Guided filter의 step size;
-	float* m_pfGuidedLUT;		//Guided filter 내의 gaussian weight를 위한 LUT
 	float	m_fGSigma;			//Guided filter 내의 gaussian weight에 대한 sigma
 
 	int		m_anAirlight[3];	// atmospheric light value
-	uchar	m_pucGammaLUT[256];	//감마 보정을 위한 LUT
+	uchar	m_pucGammaLUT[256];	//감마 보정을 위한 LUT (output tone, applied in RestoreImage)
 	float	m_pfExpLUT[256];	//Transmission 계산시, 픽셀 차이에 대한 weight용 LUT
 
 	int		m_nAirlight;		//안개값(grey)
@@ -97,6 +203,10 @@ private:
 	int		m_nWid;				//너비
 	int		m_nHei;				//높이
 
+	//Capacity of the buffers (Reconfigure)
+	int		m_nCapPixels;		// Elements of the buffers of the frame size
+	int		m_nCapLine;			// Elements of the tables of a row or a column (twice for m_pnROISpan)
+
 	int		m_nTBlockSize;		// Block size for transmission estimation
 	int		m_nGBlockSize;		// Block size for guided filter
 
@@ -107,22 +217,201 @@ private:
 	int		m_nBottomRightY;
 
 	bool	m_bPostFlag;		// Flag for post processing(deblocking)
+
+	//Region of interest (video dehazing)
+	bool	m_bROIFlag;			// Flag for region of interest processing
+	bool	m_bROIUpdate;		// The ROI map should be rebuilt
+	cv::Rect m_rectROI;			// Bounding rectangle of the ROI
+	uchar* m_pucROIMask;		// Pixel mask of the ROI (NULL for a rectangle)
+	uchar* m_pucROIRun;			// Mask pixels in a row ending at each pixel (saturated to 255)
+	uchar* m_pucROICell;		// ROI_CELL_* flags of each cell
+	uchar* m_pucROIBlock;		// Transmission blocks (320*240) to be estimated
+	int* m_pnROISpan;			// First and last+1 x of the ROI at each row
+	int* m_pnUpX;				// Upsampling index of x (UpsampleTransmission)
+	int* m_pnUpY;				// Upsampling index of y (UpsampleTransmission)
+	int		m_nCellSize;		// Cell size (sampling step of the guided filter)
+	int		m_nCellW;			// Number of cells in x
+	int		m_nCellH;			// Number of cells in y
+
+	//Coarse-to-fine transmission estimation (video dehazing)
+	int		m_nPyramidLevel;	// Number of pyramid levels (1: single scale)
+	int* m_pnPyramidY;			// Y image of the levels 1 ~ (160*120 + 80*60)
+	int* m_pnPyramidYP;			// Y image of the previous frame of the levels 1 ~
+	float* m_pfPyramidTrans;	// Block transmission of the current level
+	uchar* m_pucPyramidState;	// Coarse block state (0: estimated, 1: reused, 2: out of ROI)
+
+	//Dense transmission estimation (video dehazing)
+	bool	m_bTransDense;		// The transmission is estimated at each pixel (TransDenseMode)
+
+	//Color transmission estimation (video dehazing)
+	bool	m_bTransColor;		// The transmission is estimated from R, G, B (TransColorMode)
+
+	//Dark channel prior (TransDarkChannelMode)
+	bool	m_bTransDark;		// The transmission is estimated by the dark channel prior
+	float	m_fDarkOmega;		// Amount of the haze removed (omega of He et al.)
+
+	//Change of the estimation mode (video dehazing)
+	bool	m_bTemporalReset;	// The next frame is estimated without the temporal information
+
+	//Transmission refinement
+	typedef void (dehazing::*RefineFunc)(cv::Mat& imInput, bool bVideo);
+	struct RefineBackend
+	{
+		const char* pcName;
+		RefineFunc	pfnRefine;
+		bool	bVideoOnly;		// the input is the 320*240 transmission of the video dehazing (not upsampled)
+		float	fFixedMs;		// cost model: fFixedMs + fPixelNs * (width * height)
+		float	fPixelNs;
+	};
+	static const RefineBackend m_astRefine[REFINE_NUM];
+	static const int m_anRefineQuality[REFINE_NUM];	// methods from the best to the cheapest
+
+	int		m_nRefineMethod;	// Selected method (REFINE_*)
+	int		m_nRefineUsed;		// Method used at the last call
+	float	m_fRefineBudget;	// Latency budget of the refinement (ms) for REFINE_AUTO
+	float	m_afRefineScale[REFINE_NUM];	// Measured cost / modeled cost of each method
+	float	m_afStageMs[STAGE_NUM];		// Time (ms) of each stage of the last frame (GetStageTime)
+	float* m_pfSmallA;			// Mean of coefficient a of the guided filter (320*240, REFINE_COEF)
+	float* m_pfSmallB;			// Mean of coefficient b of the guided filter (320*240, REFINE_COEF)
+	int* m_pnCoefX;				// Left sample of the bilinear upsampling of each column
+	float* m_pfCoefWX;			// Weight of the right sample of each column
+	float* m_pfTransRows;		// Refined transmission rows of the restoration, 2 * m_nCapLine per thread
+	int		m_nTransRowThreads;	// Threads of m_pfTransRows
+	bool	m_bTransDeferred;	// The refined transmission is computed row by row in RestoreImage
+	bool	m_bTransValid;		// m_pfTransmissionR holds the refined transmission of the last frame
+
+	//Quality governor (video dehazing)
+	struct GovernorLevel
+	{
+		const char* pcName;
+		int		nStepDiv;		// the filter step size is divided (sparser windows)
+		int		nRefine;		// refinement method (REFINE_DEFAULT: the base method)
+		int		nPyramid;		// minimum number of pyramid levels
+		bool	bBlockSkip;		// the static blocks are skipped
+		int		nBlockMul;		// the transmission block size is multiplied
+	};
+	static const GovernorLevel m_astGovernor[GOV_LEVEL_NUM];
+
+	bool	m_bGovernor;		// Flag for the quality governor
+	float	m_fTargetMs;		// Target frame time (ms)
+	int		m_nGovLevel;		// Current level (m_astGovernor)
+	float	m_fFrameMs;			// Smoothed frame time (ms)
+	float	m_afGovLevelMs[GOV_LEVEL_NUM];	// Smoothed frame time last measured at each level (0: unknown)
+	int		m_nGovOver;			// Consecutive frames over the target
+	int		m_nGovUnder;		// Consecutive frames well under the target
+	int		m_nGovHold;			// Frames until the next decision
+	int		m_nGovBaseStep;		// Settings at QualityGovernor(true, ...)
+	int		m_nGovBaseBlock;
+	int		m_nGovBasePyramid;
+	int		m_nGovBaseRefine;
+	bool	m_bGovBaseSkip;
+
+	//Haze detection (video dehazing)
+	bool	m_bHazeDetect;		// Flag for the bypass of the clear frames
+	float	m_fHazeClear;		// Density of a clear frame (bypassed)
+	float	m_fHazeHazy;		// Density of a hazy frame (full strength)
+	int		m_nHazeRamp;		// Frames of the ramp from bypass to full strength
+	float	m_fHazeDensity;		// Haze density of the last frame (HazeDensity)
+	float	m_fHazeStrength;	// Dehazing strength of the last frame (0: bypass, < 0: no frame yet)
+	bool	m_bHazeResume;		// The last frame was bypassed, the temporal information is not valid
+	float	m_fRestoreStrength;	// Dehazing strength of RestoreImage
+
+	//Persisted temporal state (video dehazing)
+	uchar* m_pucState;			// Mapped state file of the camera (PersistState)
+	void* m_hStateFile;			// Handle of the state file (Windows)
+	std::string m_strStateCamera;	// Camera ID of the state file
+	bool	m_bStateWarm;		// The next frame 0 uses the loaded state
+	unsigned int m_nStateSequence;	// Sequence number of the last written slot
+	int		m_nStateSlot;		// Slot of the next write (0, 1)
+	int		m_nStatePeriod;		// Estimated frames between the writes
+	int		m_nStateFrames;		// Estimated frames since the last write
+	bool	m_bStateFixed;		// The last estimated frame is Q12 (FixedPointMode)
+
+	//YUV input (video dehazing)
+	int		m_nYUVFormat;		// Layout of the last YUV frame (YUV_I420, YUV_NV12)
+
+	//High bit depth input (video dehazing)
+	int		m_nBitShift;		// Bit depth - 8 of the last high bit depth frame
+	unsigned short* m_pusToneLUT;	// Output tone of the high bit depth (2^m_nToneBits values)
+	int		m_nToneBits;		// Bit depth of m_pusToneLUT (0: not made)
+	float	m_fToneGamma;		// Gamma of the output tone (< 0: the curve of OutputTone)
+
+	//Temporal block skip (video dehazing)
+	bool	m_bBlockSkip;		// Flag for reusing the transmission of static blocks
+	int		m_nSkipSAD;			// Mean absolute difference of a static block
+	int		m_nRefreshPeriod;	// Maximum number of frames a block is reused
+	uchar* m_pucBlockAge;		// Frames since the last estimation of each block
+	int		m_nSkippedBlocks;	// Reused blocks of the last frame
+	int		m_nEstimatedBlocks;	// Estimated blocks of the last frame
+
+	//Fixed-point processing
+	bool	m_bFixedPoint;		// Flag for integer only processing
+	int* m_pnSmallTransQ;		// Q12 initial transmission (320*240)
+	int* m_pnSmallTransQP;	// Q12 transmission of previous frame (320*240)
+	int* m_pnTransmissionQ;	// Q12 upsampled initial transmission
+	int* m_pnTransmissionRQ;	// Q12 refined transmission
+	int* m_pnRecipLUT;		// Q16 reciprocal of Q12 transmission (TRS_ONE + 1)
+	unsigned int* m_pnGuideSumQ;	// window sums of I, p, II and the cumulative sums of GuidedFilterQ (4 * capacity)
+	long long* m_pnGuideSumIpQ;	// window sums of Ip, a, b and the cumulative sums of GuidedFilterQ (3 * capacity)
+	int		m_anExpLUTQ[256];	// Q15 version of m_pfExpLUT
+	int		m_anTransQ[7];		// Q12 transmission candidates
+	int		m_anKappa[7];		// Q7 inverse of the candidates
+	int		m_nLambda1Q;		// Q8 loss cost
+	int		m_nLambda2Q;		// Q8 temporal cost
+
+	//Asynchronous processing (video dehazing)
+	struct AsyncFrame
+	{
+		cv::Mat	imInput;
+		cv::Mat	imOutput;
+		double	dTimestamp;
+		int		nFrame;
+		float	fStrength;		// dehazing strength (EstimationStage)
+		std::promise<double> promiseDone;
+	};
+	std::thread	m_threadAsync;			// Worker thread, started by the first SubmitFrame
+	std::mutex	m_mutexAsync;
+	std::condition_variable m_condSubmit;	// A frame is submitted, or the worker is stopped
+	std::condition_variable m_condDone;		// A frame is done
+	std::deque<AsyncFrame*> m_dqAsyncFrame;	// Submitted frames which are not estimated yet
+	bool	m_bAsyncStop;
+	int		m_nAsyncFrame;		// Frame number of the next submitted frame
+	int		m_nAsyncPending;	// Submitted frames which are not done
+	FrameCallback m_pfnFrameCallback;
+	void* m_pFrameCallbackData;
+	int* m_pnYImgN;				// Y image of the next frame (swapped with m_pnYImg)
+	int* m_pnSmallYImgN;		// Down-sampled Y image of the next frame (swapped with m_pnSmallYImg)
+	float* m_pfSmallTransN;		// Initial transmission of the next frame (swapped with m_pfSmallTrans)
 	// function.cpp
 
-	void	DownsampleImage();
-	void	DownsampleImageColor();
+	void	DownsampleImage(int* pnYImg, int* pnSmallYImg);
+	void	DownsampleImageColor(cv::Mat& imInput);
 	void	UpsampleTransmission();
+	void	UpsampleRefinedTransmission();
 	void	MakeExpLUT();
-	void	GuideLUTMaker();
 	void	GammaLUTMaker(float fParameter);
-	void	IplImageToInt(cv::Mat& imInput);
+	void	IplImageToInt(cv::Mat& imInput, int* pnYImg);
 	void	IplImageToIntColor(cv::Mat& imInput);
-	void	IplImageToIntYUV(cv::Mat& imInput);
+	void	IntColorToY();
+	void	IplImageToIntYUV(cv::Mat& imInput, int* pnYImg);
+	void	IplImageToInt16(cv::Mat& imInput, int* pnYImg);
 
 	// dehazing.cpp
+	void	InitEngine(int nW, int nH, bool bPrevFlag, bool bPosFlag);
 	void	AirlightEstimation(cv::Mat& imInput);
+	float	HazeDensity(int* pnSmallYImg);
+	bool	CheckFrame(cv::Mat& imInput, cv::Mat& imOutput);
+	int		PrepareFrame(cv::Mat& imInput, int nFrame);
+	float	EstimationStage(cv::Mat& imInput, int nFrame, int* pnYImg, int* pnSmallYImg, float* pfSmallTrans);
+	void	RestorationStage(cv::Mat& imInput, cv::Mat& imOutput, float fStrength);
 	void	RestoreImage(cv::Mat& imInput, cv::Mat& imOutput);
-	void	PostProcessing(cv::Mat& imInput, cv::Mat& imOutput);
+	void	PostProcessing(cv::Mat& imOutput);
+	void	UpdateROIMap();
+	void	AllocColorImage();
+	void	AllocSmallColorImage();
+	bool	ROIWindow(int nCellX, int nCellY);
+	void	GovernorUpdate(float fFrameMs);
+	void	ApplyGovernorLevel(int nLevel);
 
 	// TransmissionRefinement.cpp
 	void	TransmissionEstimation(int* pnImageY, float* pfTransmission, int* pnImageYP, float* pfTransmissionP, int nFrame, int nWid, int nHei);
@@ -130,6 +419,11 @@ private:
 
 	float	NFTrsEstimation(int* pnImageY, int nStartX, int nStartY, int nWid, int nHei);
 	float	NFTrsEstimationP(int* pnImageY, int* pnImageYP, float* pfTransmissionP, int nStartX, int nStartY, int nWid, int nHei);
+	void	TransmissionEstimationPyramid(int* pnImageY, float* pfTransmission, int* pnImageYP, float* pfTransmissionP, int nFrame, int nWid, int nHei);
+	void	TransmissionEstimationDark(int* pnImageR, int* pnImageG, int* pnImageB, float* pfTransmission, int nWid, int nHei);
+	void	TransmissionEstimationDense(int* pnImageY, float* pfTransmission, int* pnImageYP, float* pfTransmissionP, int nFrame, int nWid, int nHei);
+	float	NFTrsEstimationRange(int* pnImageY, int* pnImageYP, float fPreTrs, int nStartX, int nStartY, int nBlockSize, int nWid, int nHei, float fTransMin, float fTransStep, int nCandidates);
+	bool	StaticBlock(int* pnImageY, int* pnImageYP, int nStartX, int nStartY, int nWid, int nHei);
 
 	float	NFTrsEstimationColor(int* pnImageR, int* pnImageG, int* pnImageB, int nStartX, int nStartY, int nWid, int nHei);
 	float	NFTrsEstimationPColor(int* pnImageR, int* pnImageG, int* pnImageB, int* pnImageRP, int* pnImageGP, int* pnImageBP, float* pfTransmissionP, int nStartX, int nStartY, int nWid, int nHei);
@@ -145,5 +439,103 @@ private:
 
 	void	FastGuidedFilterS();
 	void	FastGuidedFilter();
+	void	FastGuidedFilterAccumulate(int* pnY, float* pfTrans, int nW, int nH, bool bROI, float* pfCoefA, float* pfInteg, float* pfDenom);
+
+	int		SelectRefine(bool bVideo);
+	void	Refine(cv::Mat& imInput, bool bVideo);
+	void	RefineFast(cv::Mat& imInput, bool bVideo);
+	void	RefineFastSmall(cv::Mat& imInput, bool bVideo);
+	void	RefineGrey(cv::Mat& imInput, bool bVideo);
+	void	RefineColor(cv::Mat& imInput, bool bVideo);
+	void	RefineShiftable(cv::Mat& imInput, bool bVideo);
+	void	RefineCoef(cv::Mat& imInput, bool bVideo);
+	void	GuidedFilterCoef(float fEps);
+	void	CoefTransmissionRow(int nY, int nStartX, int nEndX, float* pfTransR);
+	void	FastGuidedFilterRow(int nY, int nStartX, int nEndX, float* pfTransR);
+	void	TransmissionRow(int nY, int nStartX, int nEndX, float* pfTransR);
+
+	// fixedpoint.cpp
+	void	MakeFixedPointLUT();
+	void	DownsampleImageQ();
+	void	UpsampleTransmissionQ();
+	void	TransmissionEstimationQ(int* pnImageY, int* pnTransmission, int* pnImageYP, int* pnTransmissionP, int nFrame, int nWid, int nHei);
+	int		NFTrsEstimationQ(int* pnImageY, int nStartX, int nStartY, int nWid, int nHei);
+	int		NFTrsEstimationPQ(int* pnImageY, int* pnImageYP, int* pnTransmissionP, int nStartX, int nStartY, int nWid, int nHei);
+	void	BoxFilter(long long* pnInArray, int nR, int nWid, int nHei, long long*& pnOutArray);
+	void	GuidedFilterQ(int nW, int nH, int nEpsQ16);
+	void	RestoreImageQ(cv::Mat& imInput, cv::Mat& imOutput);
+
+	// yuv.cpp
+	bool	CheckFrameYUV(cv::Mat& imInput, cv::Mat& imOutput, int nFormat);
+	void	YUVPixelToBGR(cv::Mat& imInput, int nX, int nY, uchar* pucBGR);
+	void	YUVRegionToBGR(cv::Mat& imInput, cv::Rect rectRegion, cv::Mat& imBGR);
+	void	RestoreImageYUV(cv::Mat& imInput, cv::Mat& imOutput);
+
+	// highbit.cpp
+	bool	CheckFrame16(cv::Mat& imInput, cv::Mat& imOutput, int nBits);
+	void	HighBitRegionToBGR(cv::Mat& imInput, cv::Rect rectRegion, cv::Mat& imBGR);
+	void	ToneLUTMaker16(int nBits);
+	void	RestoreImage16(cv::Mat& imInput, cv::Mat& imOutput);
+
+	// state.cpp
+	void	StoreState(int* pnSmallYImg, float* pfSmallTrans, int* pnSmallTransQ);
+	void	WriteState(int* pnSmallYImg, float* pfSmallTrans, int* pnSmallTransQ);
+	void	FlushState();
+	void	CloseState();
+
+	// async.cpp
+	void	AsyncWorker();
+	void	AsyncDone(AsyncFrame* pstFrame);
+	void	AsyncStop();
+
+};
+
+// Movable, non-copyable owner of an engine, the supported way to move an engine
+// (dehazing itself is not movable). An engine is recycled for a new stream by
+// moving the owner and calling Reconfigure (and PersistState for the camera of
+// the new stream), e.g.
+//	DehazingEngine engine(new dehazing(nW, nH, 16, false, false, 5.0f, 1.0f, 40));
+typedef std::unique_ptr<dehazing> DehazingEngine;
+
+// Lock-free ring of the preallocated frames between the capture thread and
+// the dehazing thread (ring.cpp)
+class FrameRing
+{
+public:
+	FrameRing(dehazing& engine, int nSlots, int nPolicy);
+	~FrameRing(void);
+
+	FrameRing(const FrameRing&) = delete;
+	FrameRing& operator=(const FrameRing&) = delete;
 
+	// producer
+	cv::Mat* AcquireSlot();
+	void	PublishSlot(double dTimestamp);
+	// consumer
+	cv::Mat* TakeFrame(double* pdTimestamp, int* pnFrame, bool bWait);
+	void	ReleaseFrame();
+
+	void	Close();
+	long long GetDropped();
+
+private:
+	int		m_nSlots;				// Number of the frames
+	int		m_nPolicy;				// RING_DROP_OLDEST, RING_BLOCK
+	cv::Mat* m_pimSlot;				// Preallocated frames
+	double* m_pdTimestamp;			// Timestamp of the published frame
+	std::atomic<int>* m_pnQueue;	// Indices of the published frames
+	std::atomic<int>* m_pnFree;		// Indices of the released frames
+
+	// positions of the queues, on their own cache lines
+	alignas(64) std::atomic<long long> m_nHead;		// Published (producer)
+	alignas(64) std::atomic<long long> m_nTail;		// Taken (consumer) or dropped (producer)
+	alignas(64) std::atomic<long long> m_nFreeHead;	// Released (consumer)
+	alignas(64) std::atomic<long long> m_nFreeTail;	// Reused (producer)
+
+	// state of each side
+	alignas(64) int m_nProducerSlot;	// Frame lent to the producer (-1: none)
+	std::atomic<long long> m_nDropped;
+	alignas(64) int m_nConsumerSlot;	// Frame lent to the consumer (-1: none)
+	int		m_nTaken;				// Frame number of the next taken frame
+	std::atomic<bool> m_bClosed;
 };
\ No newline at end of file
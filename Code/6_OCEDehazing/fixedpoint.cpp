@@ -0,0 +1,673 @@
+﻿/*
+	This source file contains the fixed-point (integer only) version of the
+	video dehazing path, for embedded cores without a fast FPU.
+	It is enabled by FixedPointMode(true) and used by HazeRemoval.
+
+	Number formats:
+		transmission		Q12 (TRS_ONE == 4096 == 1.0)
+		candidate 1/t		Q7  (same as nTrans in NFTrsEstimation)
+		lambda				Q8
+		temporal weight		Q15
+		guided filter a, b	Q20 (a per grey level, b in transmission)
+		1/t in restoration	Q16 (m_pnRecipLUT, indexed by Q12 transmission)
+
+	Only the look up tables (FixedPointMode) and the atmospheric light
+	estimation use floating point. The per frame path uses 32/64-bit integers; the window
+	sums of the guided filter are 32-bit where the ranges allow (GuidedFilterQ),
+	and the buffers are allocated once (FixedPointMode, Reconfigure).
+
+	Throughput: the path has been measured only on x86-64 with a scalar build
+	(-O2 -fno-tree-vectorize, 1 thread), 14 ms at 640x480 and 107 ms at
+	1920x1080. That core has a hardware FPU and fast 64-bit arithmetic, hence
+	the numbers do not predict a NEON-less 32-bit ARM core, where the 64-bit
+	parts (sum(Ip), a, b and the cost of the block search) are relatively slower.
+	It has not been measured on such a target.
+
+	Error bound against the float path:
+		- Transmission estimation: the restored values and the loss/contrast sums
+		  are the same integers as NFTrsEstimation. The cost is compared exactly
+		  (int64, scaled by N*256), hence the selected candidate is the same unless
+		  two costs are closer than the float rounding of the float path itself.
+		  With the temporal cost, kappa is accumulated in Q12 with Q15 weights,
+		  |delta kappa| <= 2^-12 + 2^-15 * 256 / sum(w).
+		- Guided filter: GuidedFilterQ is the integer twin of GuidedFilterY.
+		  Rounding of a, b (Q20) and of the output (Q12) gives
+		  |delta t| <= 2^-12 + 255 * 2^-20 + 2^-20, i.e. less than 1/2048.
+		  (GuidedFilterY accumulates the window sums in float, so for large frames
+		  its own rounding error is usually the larger of the two.)
+		- Restoration: with 1/t in Q16 and t in Q12, before the gamma LUT
+		  |delta J| <= 1 + |I - A| * dt / t^2, i.e. at most 1 grey level at t = 1
+		  and 1 + 255 * 2^-11 / t^2 for the guided filter error above.
+		- Resampling: the sampling positions are exact integer ratios, while
+		  DownsampleImage/UpsampleTransmission accumulate a float ratio. Where the
+		  float accumulation drifts (e.g. 720 / 240), a pixel on a block border
+		  may take the neighbouring block, and the bounds above apply from there.
+
+	Last updated: 2026-10-19
+ */
+#include "dehazing.h"
+
+/*
+	Function: FixedPointMode
+	Description: switch the video dehazing (HazeRemoval) to the integer only path.
+		The Q12 buffers are allocated at the first call, and the look up tables
+		are made when the path is enabled. The mode may be switched between
+		frames: the next frame is estimated without the temporal information,
+		as the previous transmission is kept by the other path only.
+		The post processing (deblocking) is not applied in this mode.
+	Parameters:
+		bFixedFlag - flag
+ */
+void dehazing::FixedPointMode(bool bFixedFlag)
+{
+	bool bChanged = m_bFixedPoint != bFixedFlag;
+	m_bFixedPoint = bFixedFlag;
+
+	if (m_bFixedPoint == true && m_pnTransmissionQ == NULL)
+	{
+		m_pnSmallTransQ = new int[320 * 240];
+		m_pnSmallTransQP = new int[320 * 240];
+		m_pnTransmissionQ = new int[m_nCapPixels];
+		m_pnTransmissionRQ = new int[m_nCapPixels];
+		m_pnRecipLUT = new int[TRS_ONE + 1];
+		m_pnGuideSumQ = new unsigned int[m_nCapPixels * 4];
+		m_pnGuideSumIpQ = new long long[m_nCapPixels * 3];
+	}
+
+	if (m_bFixedPoint == true)
+		MakeFixedPointLUT();
+
+	m_nLambda1Q = (int)(m_fLambda1 * 256.0f + 0.5f);
+	m_nLambda2Q = (int)(m_fLambda2 * 256.0f + 0.5f);
+
+	// the transmission of the previous frame is not valid after switching
+	if (bChanged == true)
+	{
+		m_bTemporalReset = true;
+		if (m_pucBlockAge != NULL)
+			memset(m_pucBlockAge, 255, 320 * 240);
+	}
+}
+
+/*
+	Function: MakeFixedPointLUT
+	Description: Make the Look Up Tables(LUT) of the fixed-point path.
+		The candidates are generated with the same float steps as NFTrsEstimation,
+		hence m_anKappa is identical to its nTrans.
+	Return:
+		m_anTransQ, m_anKappa - transmission candidates
+		m_anExpLUTQ - weight for applying previous information
+		m_pnRecipLUT - reciprocal of transmission
+ */
+void dehazing::MakeFixedPointLUT()
+{
+	int nIdx;
+	float fTrans = 0.3f;
+
+	for (nIdx = 0; nIdx < 7; nIdx++)
+	{
+		m_anTransQ[nIdx] = (int)(fTrans * TRS_ONE + 0.5f);
+		m_anKappa[nIdx] = nIdx == 0 ? 427 : (int)(1.0f / fTrans * 128.0f);
+		fTrans += 0.1f;
+	}
+
+	for (nIdx = 0; nIdx < 256; nIdx++)
+	{
+		m_anExpLUTQ[nIdx] = (int)(expf(-(float)(nIdx * nIdx) / 10.0f) * 32768.0f + 0.5f);
+	}
+
+	// (1 << 28) / t : Q16 when t is Q12, t = 0 is treated as the smallest step
+	m_pnRecipLUT[0] = 1 << 28;
+	for (nIdx = 1; nIdx <= TRS_ONE; nIdx++)
+	{
+		m_pnRecipLUT[nIdx] = ((1 << 28) + nIdx / 2) / nIdx;
+	}
+}
+
+/*
+	Function: DownsampleImageQ
+	Description: Downsample the image to fixed sized image (320 x 240)
+		The sampling position (nX * m_nWid / 320) is stepped exactly in integer.
+
+	Parameters:(hidden)
+		m_pnYImg - input Y Image
+	Return:
+		m_pnSmallYImg - output down sampled image
+*/
+void dehazing::DownsampleImageQ()
+{
+	int nX, nY;
+	int nSrcX, nSrcY, nErrX, nErrY;
+
+	int n_pixel = 0;
+	nSrcY = 0;
+	nErrY = 0;
+	for (nY = 0; nY < 240; nY++)
+	{
+		int* pnRow = m_pnYImg + nSrcY * m_nWid;
+		nSrcX = 0;
+		nErrX = 0;
+		for (nX = 0; nX < 320; nX++)
+		{
+			m_pnSmallYImg[n_pixel++] = pnRow[nSrcX];
+
+			// nSrcX = (nX + 1) * m_nWid / 320
+			nErrX += m_nWid;
+			while (nErrX >= 320)
+			{
+				nErrX -= 320;
+				nSrcX++;
+			}
+		}
+		nErrY += m_nHei;
+		while (nErrY >= 240)
+		{
+			nErrY -= 240;
+			nSrcY++;
+		}
+	}
+}
+
+/*
+	Function: UpsampleTransmissionQ
+	Description: upsample the fixed sized transmission to original size
+		The sampling position (nX * 320 / m_nWid) is stepped exactly in integer.
+
+	Parameters:(hidden)
+		m_pnSmallTransQ - input transmission (320 x 240)
+	Return:
+		m_pnTransmissionQ - output transmission
+*/
+void dehazing::UpsampleTransmissionQ()
+{
+	int nX, nY;
+	int nSrcX, nSrcY, nErrX, nErrY;
+
+	int n_pixel = 0;
+	nSrcY = 0;
+	nErrY = 0;
+	for (nY = 0; nY < m_nHei; nY++)
+	{
+		int* pnRow = m_pnSmallTransQ + nSrcY * 320;
+		nSrcX = 0;
+		nErrX = 0;
+		for (nX = 0; nX < m_nWid; nX++)
+		{
+			m_pnTransmissionQ[n_pixel++] = pnRow[nSrcX];
+
+			// nSrcX = (nX + 1) * 320 / m_nWid
+			nErrX += 320;
+			if (nErrX >= m_nWid)
+			{
+				nErrX -= m_nWid;
+				nSrcX++;
+			}
+		}
+		nErrY += 240;
+		if (nErrY >= m_nHei)
+		{
+			nErrY -= m_nHei;
+			nSrcY++;
+		}
+	}
+}
+
+/*
+	Function: TransmissionEstimationQ
+	Description: Estiamte the Q12 transmission in the frame
+	Parameters:
+		nFrame - frame no.
+		nWid - frame width
+		nHei - frame height.
+	Return:
+		pnTransmission
+ */
+void dehazing::TransmissionEstimationQ(int* pnImageY, int* pnTransmission, int* pnImageYP, int* pnTransmissionP, int nFrame, int nWid, int nHei)
+{
+	int nX, nY, nXstep, nYstep;
+	int nTrans;
+
+	for (nY = 0; nY < nHei; nY += m_nTBlockSize)
+	{
+		for (nX = 0; nX < nWid; nX += m_nTBlockSize)
+		{
+			if (m_bPreviousFlag == true && nFrame > 0)
+				nTrans = NFTrsEstimationPQ(pnImageY, pnImageYP, pnTransmissionP, nX, nY, nWid, nHei);
+			else
+				nTrans = NFTrsEstimationQ(pnImageY, nX, nY, nWid, nHei);
+
+			for (nYstep = nY; nYstep < __min(nY + m_nTBlockSize, nHei); nYstep++)
+			{
+				for (nXstep = nX; nXstep < __min(nX + m_nTBlockSize, nWid); nXstep++)
+				{
+					pnTransmission[nYstep * nWid + nXstep] = nTrans;
+				}
+			}
+		}
+	}
+}
+
+/*
+	Function: NFTrsEstimationQ
+	Description: Estiamte the transmission in the block (integer only).
+		The same exhaustive search with NFTrsEstimation. The cost is scaled
+		by (number of pixels * 256) to be compared in integer:
+		lambda1 * loss - 256 * (N * sum(out^2) - sum(out)^2) / N
+
+	Parameters:
+		nStartx - top left point of a block
+		nStarty - top left point of a block
+		nWid - frame width
+		nHei - frame height.
+	Return:
+		nOptTrs - Q12 transmission
+ */
+int dehazing::NFTrsEstimationQ(int* pnImageY, int nStartX, int nStartY, int nWid, int nHei)
+{
+	int nCounter;
+	int nX, nY;
+	int nEndX, nEndY;
+
+	int nOut, nTrans;
+	int nSumofOuts, nSumofSquaredOuts, nSumofSLoss;
+	int nNumberofPixels;
+	long long nCost, nMinCost = 0;
+	int nOptTrs = m_anTransQ[0];
+
+	nEndX = __min(nStartX + m_nTBlockSize, nWid);
+	nEndY = __min(nStartY + m_nTBlockSize, nHei);
+
+	nNumberofPixels = (nEndY - nStartY) * (nEndX - nStartX);
+
+	for (nCounter = 0; nCounter < 7; nCounter++)
+	{
+		nTrans = m_anKappa[nCounter];
+		nSumofSLoss = 0;
+		nSumofSquaredOuts = 0;
+		nSumofOuts = 0;
+		for (nY = nStartY; nY < nEndY; nY++)
+		{
+			int* pnRow = pnImageY + nY * nWid;
+			for (nX = nStartX; nX < nEndX; nX++)
+			{
+				nOut = ((pnRow[nX] - m_nAirlight) * nTrans + 128 * m_nAirlight) >> 7;
+
+				if (nOut > 255)
+					nSumofSLoss += (nOut - 255) * (nOut - 255);
+				else if (nOut < 0)
+					nSumofSLoss += nOut * nOut;
+
+				nSumofSquaredOuts += nOut * nOut;
+				nSumofOuts += nOut;
+			}
+		}
+
+		nCost = (long long)m_nLambda1Q * nSumofSLoss
+			- (((long long)nSumofSquaredOuts * nNumberofPixels - (long long)nSumofOuts * nSumofOuts) * 256) / nNumberofPixels;
+
+		if (nCounter == 0 || nMinCost > nCost)
+		{
+			nMinCost = nCost;
+			nOptTrs = m_anTransQ[nCounter];
+		}
+	}
+	return nOptTrs;
+}
+
+/*
+	Function: NFTrsEstimationPQ
+	Description: Estiamte the transmission in the block (integer only).
+		The previous frame information is used to estimate transmission.
+		The temporal cost of NFTrsEstimationP,
+			lambda2 * sum(w) / N * ((Tp - t) / Tp)^2 * 255^2,
+		is scaled in the same way with NFTrsEstimationQ.
+
+	Parameters:
+		nStartx - top left point of a block
+		nStarty - top left point of a block
+		nWid - frame width
+		nHei - frame height.
+	Return:
+		nOptTrs - Q12 transmission
+ */
+int dehazing::NFTrsEstimationPQ(int* pnImageY, int* pnImageYP, int* pnTransmissionP, int nStartX, int nStartY, int nWid, int nHei)
+{
+	int nCounter;
+	int nX, nY;
+	int nEndX, nEndY;
+
+	int nOut, nTrans;
+	int nSumofOuts, nSumofSquaredOuts, nSumofSLoss;
+	int nNumberofPixels;
+	long long nCost, nMinCost = 0;
+	int nOptTrs = m_anTransQ[0];
+
+	nEndX = __min(nStartX + m_nTBlockSize, nWid);
+	nEndY = __min(nStartY + m_nTBlockSize, nHei);
+
+	nNumberofPixels = (nEndY - nStartY) * (nEndX - nStartX);
+
+	long long nNewKSum = 0;		// Sum of new kappa (Q12) which is multiplied the weight (Q15)
+	long long nWsum = 0;		// Sum of weight (Q15)
+	int nPreJ, nWi, nValid = 0;
+
+	for (nY = nStartY; nY < nEndY; nY++)
+	{
+		for (nX = nStartX; nX < nEndX; nX++)
+		{
+			nPreJ = pnImageYP[nY * nWid + nX] - m_nAirlight;
+			if (nPreJ != 0)
+			{
+				nWi = m_anExpLUTQ[abs(pnImageY[nY * nWid + nX] - pnImageYP[nY * nWid + nX])];
+				nWsum += nWi;
+				nNewKSum += (long long)nWi * ((pnImageY[nY * nWid + nX] - m_nAirlight) * TRS_ONE / nPreJ);
+				nValid++;
+			}
+		}
+	}
+
+	// the float path has no valid kappa (0/0) and keeps the first candidate
+	if (nValid == 0)
+		return m_anTransQ[0];
+
+	// Update the previous transmission using new kappa
+	int nPreTrs = 0;
+	if (nWsum > 0)
+		nPreTrs = (int)(((long long)pnTransmissionP[nStartY * nWid + nStartX] * (nNewKSum / nWsum)) / TRS_ONE);
+
+	if (nPreTrs == 0 && nWsum > 0)
+		return m_anTransQ[0];
+
+	// lambda2 * sum(w) / N * 255^2 scaled by N * 256 (Q8 * Q15 >> 15), saturated
+	// to 2^46 (reached at lambda2 * N > 4.2e6, e.g. a block of 320*240 with
+	// lambda2 > 55), hence the temporal cost below is less than 2^62 + 2^28
+	long long nTempW = (long long)m_nLambda2Q * nWsum >> 15;
+	nTempW = __min(nTempW, (1LL << 46) / 65025) * 65025;
+
+	for (nCounter = 0; nCounter < 7; nCounter++)
+	{
+		nTrans = m_anKappa[nCounter];
+		nSumofSLoss = 0;
+		nSumofSquaredOuts = 0;
+		nSumofOuts = 0;
+		for (nY = nStartY; nY < nEndY; nY++)
+		{
+			int* pnRow = pnImageY + nY * nWid;
+			for (nX = nStartX; nX < nEndX; nX++)
+			{
+				nOut = ((pnRow[nX] - m_nAirlight) * nTrans + 128 * m_nAirlight) >> 7;
+
+				if (nOut > 255)
+					nSumofSLoss += (nOut - 255) * (nOut - 255);
+				else if (nOut < 0)
+					nSumofSLoss += nOut * nOut;
+
+				nSumofSquaredOuts += nOut * nOut;
+				nSumofOuts += nOut;
+			}
+		}
+
+		nCost = (long long)m_nLambda1Q * nSumofSLoss
+			- (((long long)nSumofSquaredOuts * nNumberofPixels - (long long)nSumofOuts * nSumofOuts) * 256) / nNumberofPixels;
+
+		// ((Tp - t) / Tp)^2 in Q12 (< 2^28, the ratio is saturated to 256).
+		// nTempW * ratio^2 >> TRS_SHIFT is split at TRS_SHIFT bits of nTempW,
+		// which gives the same value without the 64-bit overflow of the product
+		if (nPreTrs != 0)
+		{
+			long long nRatio = ((long long)(nPreTrs - m_anTransQ[nCounter]) * TRS_ONE) / nPreTrs;
+			nRatio = __max(__min(nRatio, 256LL * TRS_ONE), -256LL * TRS_ONE);
+			long long nRatio2 = (nRatio * nRatio) >> TRS_SHIFT;
+			nCost += (nTempW >> TRS_SHIFT) * nRatio2 + (((nTempW & (TRS_ONE - 1)) * nRatio2) >> TRS_SHIFT);
+		}
+
+		if (nCounter == 0 || nMinCost > nCost)
+		{
+			nMinCost = nCost;
+			nOptTrs = m_anTransQ[nCounter];
+		}
+	}
+	return nOptTrs;
+}
+
+/*
+	Function: BoxFilter (integer)
+	Description: cummulative function for calculating the integral image, 64-bit version
+		of the float BoxFilter.
+	Parameters:
+		pnInArray - input array
+		nR - radius of filter window
+		nWid - width of array
+		nHei - height of array
+	Return:
+		pnOutArray - output array (integrated array)
+ */
+void dehazing::BoxFilter(long long* pnInArray, int nR, int nWid, int nHei, long long*& pnOutArray)
+{
+	long long* pnArrayCum = new long long[nWid * nHei];
+
+	//cumulative sum over Y axis
+	for (int nX = 0; nX < nWid; nX++)
+		pnArrayCum[nX] = pnInArray[nX];
+
+	for (int nIdx = nWid; nIdx < nWid * nHei; nIdx++)
+		pnArrayCum[nIdx] = pnArrayCum[nIdx - nWid] + pnInArray[nIdx];
+
+	//difference over Y axis
+	for (int nIdx = 0; nIdx < nWid * (nR + 1); nIdx++)
+		pnOutArray[nIdx] = pnArrayCum[nIdx + nR * nWid];
+
+	for (int nIdx = (nR + 1) * nWid; nIdx < (nHei - nR) * nWid; nIdx++)
+		pnOutArray[nIdx] = pnArrayCum[nIdx + nR * nWid] - pnArrayCum[nIdx - nR * nWid - nWid];
+
+	for (int nY = nHei - nR; nY < nHei; nY++)
+		for (int nX = 0; nX < nWid; nX++)
+			pnOutArray[nY * nWid + nX] = pnArrayCum[(nHei - 1) * nWid + nX] - pnArrayCum[(nY - nR - 1) * nWid + nX];
+
+	//cumulative sum over X axis
+	for (int nIdx = 0; nIdx < nHei * nWid; nIdx += nWid)
+		pnArrayCum[nIdx] = pnOutArray[nIdx];
+
+	for (int nY = 0; nY < nHei * nWid; nY += nWid)
+		for (int nX = 1; nX < nWid; nX++)
+			pnArrayCum[nY + nX] = pnArrayCum[nY + nX - 1] + pnOutArray[nY + nX];
+
+	//difference over X axis
+	for (int nY = 0; nY < nHei * nWid; nY += nWid)
+		for (int nX = 0; nX < nR + 1; nX++)
+			pnOutArray[nY + nX] = pnArrayCum[nY + nX + nR];
+
+	for (int nY = 0; nY < nHei * nWid; nY += nWid)
+		for (int nX = nR + 1; nX < nWid - nR; nX++)
+			pnOutArray[nY + nX] = pnArrayCum[nY + nX + nR] - pnArrayCum[nY + nX - nR - 1];
+
+	for (int nY = 0; nY < nHei * nWid; nY += nWid)
+		for (int nX = nWid - nR; nX < nWid; nX++)
+			pnOutArray[nY + nX] = pnArrayCum[nY + nWid - 1] - pnArrayCum[nY + nX - nR - 1];
+
+	delete[]pnArrayCum;
+}
+
+/*
+	Function: BoxFilterQ
+	Description: window sums of an array in place, the integer BoxFilter without the
+		allocation. With unsigned int the cumulative sums wrap around, but the
+		differences (the window sums) are exact while they are less than 2^32.
+	Parameters:
+		ptArray - input array, window sums on return
+		nR - radius of filter window
+		nWid - width of array
+		nHei - height of array
+		ptCum - buffer of the cumulative sums (nWid * nHei)
+ */
+template <typename T>
+static void BoxFilterQ(T* ptArray, int nR, int nWid, int nHei, T* ptCum)
+{
+	int nX, nY, nIdx;
+
+	//cumulative sum over Y axis
+	for (nX = 0; nX < nWid; nX++)
+		ptCum[nX] = ptArray[nX];
+
+	for (nIdx = nWid; nIdx < nWid * nHei; nIdx++)
+		ptCum[nIdx] = ptCum[nIdx - nWid] + ptArray[nIdx];
+
+	//difference over Y axis
+	for (nIdx = 0; nIdx < nWid * (nR + 1); nIdx++)
+		ptArray[nIdx] = ptCum[nIdx + nR * nWid];
+
+	for (nIdx = (nR + 1) * nWid; nIdx < (nHei - nR) * nWid; nIdx++)
+		ptArray[nIdx] = ptCum[nIdx + nR * nWid] - ptCum[nIdx - nR * nWid - nWid];
+
+	for (nY = nHei - nR; nY < nHei; nY++)
+		for (nX = 0; nX < nWid; nX++)
+			ptArray[nY * nWid + nX] = ptCum[(nHei - 1) * nWid + nX] - ptCum[(nY - nR - 1) * nWid + nX];
+
+	//cumulative sum over X axis
+	for (nY = 0; nY < nHei * nWid; nY += nWid)
+	{
+		ptCum[nY] = ptArray[nY];
+		for (nX = 1; nX < nWid; nX++)
+			ptCum[nY + nX] = ptCum[nY + nX - 1] + ptArray[nY + nX];
+	}
+
+	//difference over X axis
+	for (nY = 0; nY < nHei * nWid; nY += nWid)
+	{
+		for (nX = 0; nX < nR + 1; nX++)
+			ptArray[nY + nX] = ptCum[nY + nX + nR];
+		for (nX = nR + 1; nX < nWid - nR; nX++)
+			ptArray[nY + nX] = ptCum[nY + nX + nR] - ptCum[nY + nX - nR - 1];
+		for (nX = nWid - nR; nX < nWid; nX++)
+			ptArray[nY + nX] = ptCum[nY + nWid - 1] - ptCum[nY + nX - nR - 1];
+	}
+}
+
+/*
+	Function: GuidedFilterQ
+	Description: the guided filter for gray image (integer only), the twin of GuidedFilterY.
+		The window statistics are kept as sums, so the means are never rounded:
+			a = (N*sum(Ip) - sum(I)*sum(p)) / (N*sum(II) - sum(I)^2 + eps*N^2)
+			b = (sum(p) - a*sum(I)) / N
+		With I <= 255 and p <= TRS_ONE, sum(I), sum(p) and sum(II) are less than
+		2^32 up to a radius of GUIDE_Q_MAX_RADIUS, hence they are summed in 32 bits
+		(the radius is limited to GUIDE_Q_MAX_RADIUS). sum(Ip) exceeds 2^32 above
+		a radius of 31, and it is summed in 64 bits with a and b.
+		The buffers are allocated by FixedPointMode.
+	Parameter:
+		nW - width of array
+		nH - height of array
+		nEpsQ16 - epsilon (Q16)
+	(member variable)
+		m_pnTransmissionQ - initial transmission (Q12)
+		m_pnYImg - guidance image (Y image)
+	Return:
+		m_pnTransmissionRQ - filtered transmission (Q12)
+ */
+void dehazing::GuidedFilterQ(int nW, int nH, int nEpsQ16)
+{
+	const int nR = __min(m_nGBlockSize, GUIDE_Q_MAX_RADIUS);
+	const int nPixels = nW * nH;
+	unsigned int* pnSumI = m_pnGuideSumQ;
+	unsigned int* pnSumP = m_pnGuideSumQ + nPixels;
+	unsigned int* pnSumII = m_pnGuideSumQ + nPixels * 2;
+	unsigned int* pnCum = m_pnGuideSumQ + nPixels * 3;
+	long long* pnSumIp = m_pnGuideSumIpQ;
+	long long* pnB = m_pnGuideSumIpQ + nPixels;
+	long long* pnCumIp = m_pnGuideSumIpQ + nPixels * 2;
+
+	int nIdx, nX, nY;
+
+	for (nIdx = 0; nIdx < nPixels; nIdx++)
+	{
+		const unsigned int nI = (unsigned int)m_pnYImg[nIdx];
+		const unsigned int nP = (unsigned int)m_pnTransmissionQ[nIdx];
+		pnSumI[nIdx] = nI;
+		pnSumP[nIdx] = nP;
+		pnSumII[nIdx] = nI * nI;
+		pnSumIp[nIdx] = (long long)(nI * nP);
+	}
+
+	BoxFilterQ(pnSumI, nR, nW, nH, pnCum);
+	BoxFilterQ(pnSumP, nR, nW, nH, pnCum);
+	BoxFilterQ(pnSumII, nR, nW, nH, pnCum);
+	BoxFilterQ(pnSumIp, nR, nW, nH, pnCumIp);
+
+	// Calculate coefficient a (Q20, in place of sum(Ip)) and coefficient b (Q20)
+	long long* pnA = pnSumIp;
+#pragma omp parallel for private(nX, nIdx)
+	for (nY = 0; nY < nH; nY++)
+	{
+		const long long nNY = __min(nY + nR, nH - 1) - __max(nY - nR, 0) + 1;
+		for (nX = 0; nX < nW; nX++)
+		{
+			nIdx = nY * nW + nX;
+			long long nN = nNY * (__min(nX + nR, nW - 1) - __max(nX - nR, 0) + 1);
+			long long nCov = nN * pnSumIp[nIdx] - (long long)pnSumI[nIdx] * pnSumP[nIdx];
+			long long nVar = nN * pnSumII[nIdx] - (long long)pnSumI[nIdx] * pnSumI[nIdx] + ((nEpsQ16 * nN * nN) >> 16);
+
+			pnA[nIdx] = nVar > 0 ? (nCov * 256) / nVar : 0;
+			pnB[nIdx] = ((long long)pnSumP[nIdx] * 256 - pnA[nIdx] * pnSumI[nIdx]) / nN;
+		}
+	}
+
+	// Transmission refinement at each pixel
+	BoxFilterQ(pnA, nR, nW, nH, pnCumIp);
+	BoxFilterQ(pnB, nR, nW, nH, pnCumIp);
+
+#pragma omp parallel for private(nX, nIdx)
+	for (nY = 0; nY < nH; nY++)
+	{
+		const long long nNY = __min(nY + nR, nH - 1) - __max(nY - nR, 0) + 1;
+		for (nX = 0; nX < nW; nX++)
+		{
+			nIdx = nY * nW + nX;
+			long long nN = nNY * (__min(nX + nR, nW - 1) - __max(nX - nR, 0) + 1);
+			long long nQ = (pnA[nIdx] * m_pnYImg[nIdx] + pnB[nIdx]) / nN;
+			m_pnTransmissionRQ[nIdx] = (int)((nQ + 128) >> 8);
+		}
+	}
+}
+
+/*
+	Function: RestoreImageQ
+	Description: Dehazed the image using Q12 transmission and atmospheric light (integer only).
+		I' = (I - Airlight) * (1/Transmission) + Airlight, 1/Transmission from m_pnRecipLUT.
+	Parameter:
+		imInput - Input hazy image.
+	Return:
+		imOutput - Dehazed image.
+ */
+void dehazing::RestoreImageQ(cv::Mat& imInput, cv::Mat& imOutput)
+{
+	int nX, nY;
+	const int nA_B = m_anAirlight[0];
+	const int nA_G = m_anAirlight[1];
+	const int nA_R = m_anAirlight[2];
+
+#pragma omp parallel for private(nX)
+	for (nY = 0; nY < m_nHei; nY++)
+	{
+		uchar* inptr = imInput.ptr<uchar>(nY);
+		uchar* outptr = imOutput.ptr<uchar>(nY);
+		int* pnTransR = m_pnTransmissionRQ + nY * m_nWid;
+		for (nX = 0; nX < m_nWid; nX++)
+		{
+			const long long nRecip = m_pnRecipLUT[__max(__min(pnTransR[nX], TRS_ONE), 0)];
+			outptr[0] = m_pucGammaLUT[CLIP((int)((((long long)inptr[0] - nA_B) * nRecip) >> 16) + nA_B)];
+			outptr[1] = m_pucGammaLUT[CLIP((int)((((long long)inptr[1] - nA_G) * nRecip) >> 16) + nA_G)];
+			outptr[2] = m_pucGammaLUT[CLIP((int)((((long long)inptr[2] - nA_R) * nRecip) >> 16) + nA_R)];
+			inptr += 3;
+			outptr += 3;
+		}
+	}
+}
+
+/*
+	Function:GetTransmissionQ
+	Return: get refined transmission array (Q12, fixed-point mode)
+ */
+int* dehazing::GetTransmissionQ()
+{
+	return m_pnTransmissionRQ;
+}
@@ -15,27 +15,53 @@
  /*
 	 Function: IplImageToInt
 	 Description: Convert the opencv type IplImage to integer
+		 (the rows are read with the stride of the image, hence a view is accepted)
 
 	 Parameters:
 		 imInput - input IplImage
 	 Return:
-		 m_pnYImg - output integer array
+		 pnYImg - output integer array (m_pnYImg)
+		 (with a region of interest, only the cells used by the ROI are converted)
  */
-void dehazing::IplImageToInt(cv::Mat& imInput)
+void dehazing::IplImageToInt(cv::Mat& imInput, int* pnYImg)
 {
 	int nY, nX;
-	uchar* inptr = imInput.data;
+	uchar* inptr;
 
-	int n_pixel = 0, n_step = 0;
+	if (m_bROIFlag == true && m_bFixedPoint == false)
+	{
+		int nCX;
+		for (nY = 0; nY < m_nHei; nY++)
+		{
+			uchar* pucCell = m_pucROICell + (nY / m_nCellSize) * m_nCellW;
+			inptr = imInput.ptr<uchar>(nY);
+			for (nCX = 0; nCX < m_nCellW; nCX++)
+			{
+				if (pucCell[nCX] == 0)
+					continue;
+				int nEndX = __min((nCX + 1) * m_nCellSize, m_nWid);
+				for (nX = nCX * m_nCellSize; nX < nEndX; nX++)
+				{
+					uchar* pucPixel = inptr + nX * 3;
+					pnYImg[nY * m_nWid + nX] = (pucPixel[0] * 7471 + pucPixel[1] * 38470 + pucPixel[2] * 19595) >> 16;
+				}
+			}
+		}
+		return;
+	}
+
+	int n_pixel = 0, n_step;
 	for (nY = 0; nY < m_nHei; nY++)
 	{
+		inptr = imInput.ptr<uchar>(nY);
+		n_step = 0;
 		for (nX = 0; nX < m_nWid; nX++)
 		{
 			// (1) IplImage 를 YUV의 Y채널로 변환 하여 int형 배열 m_pnYImg에 저장
-			m_pnYImg[n_pixel] = inptr[n_step++] * 7471;
-			m_pnYImg[n_pixel] += inptr[n_step++] * 38470;
-			m_pnYImg[n_pixel] += inptr[n_step++] * 19595;
-			m_pnYImg[n_pixel] = m_pnYImg[n_pixel] >> 16;	// divide 65536
+			pnYImg[n_pixel] = inptr[n_step++] * 7471;
+			pnYImg[n_pixel] += inptr[n_step++] * 38470;
+			pnYImg[n_pixel] += inptr[n_step++] * 19595;
+			pnYImg[n_pixel] = pnYImg[n_pixel] >> 16;	// divide 65536
 			n_pixel++;
 		}
 	}
@@ -44,6 +70,7 @@ void dehazing::IplImageToInt(cv::Mat& imInput)
 /*
 	Function: IplImageToIntColor
 	Description: Convert the opencv type IplImage to integer (3 arrays)
+		(the rows are read with the stride of the image)
 
 	Parameters:
 		imInput - input IplImage
@@ -55,11 +82,13 @@ void dehazing::IplImageToInt(cv::Mat& imInput)
 void dehazing::IplImageToIntColor(cv::Mat& imInput)
 {
 	int nY, nX;
-	uchar* inptr = imInput.data;
+	uchar* inptr;
 
-	int n_pixel = 0, n_step = 0;
+	int n_pixel = 0, n_step;
 	for (nY = 0; nY < m_nHei; nY++)
 	{
+		inptr = imInput.ptr<uchar>(nY);
+		n_step = 0;
 		for (nX = 0; nX < m_nWid; nX++)
 		{
 			m_pnBImg[n_pixel] = inptr[n_step++];
@@ -70,16 +99,87 @@ void dehazing::IplImageToIntColor(cv::Mat& imInput)
 	}
 }
 
+/*
+	Function: IplImageToIntYUV
+	Description: copy the luma plane of a YUV 4:2:0 frame (yuv.cpp) to
+		the integer array.
+
+	Parameters:
+		imInput - input image (CV_8UC1, the first m_nHei rows are the luma)
+	Return:
+		pnYImg - output integer array
+*/
+void dehazing::IplImageToIntYUV(cv::Mat& imInput, int* pnYImg)
+{
+	int nY, nX;
+
+	for (nY = 0; nY < m_nHei; nY++)
+	{
+		uchar* inptr = imInput.ptr<uchar>(nY);
+		int* pnY = pnYImg + nY * m_nWid;
+		for (nX = 0; nX < m_nWid; nX++)
+			pnY[nX] = inptr[nX];
+	}
+}
+
+/*
+	Function: IplImageToInt16
+	Description: Convert the high bit depth image (highbit.cpp) to the Y channel
+		of the 8 bit scale, with the same weights as IplImageToInt.
+		(the sum of the weights is 65536, hence the 16 bit samples fit in unsigned int)
+
+	Parameters:
+		imInput - input image (CV_16UC3, m_nBitShift + 8 bits)
+	Return:
+		pnYImg - output integer array
+*/
+void dehazing::IplImageToInt16(cv::Mat& imInput, int* pnYImg)
+{
+	int nY, nX;
+	const int nShift = 16 + m_nBitShift;
+
+	for (nY = 0; nY < m_nHei; nY++)
+	{
+		const unsigned short* inptr = imInput.ptr<unsigned short>(nY);
+		int* pnY = pnYImg + nY * m_nWid;
+		for (nX = 0; nX < m_nWid; nX++)
+		{
+			pnY[nX] = (int)(((unsigned int)inptr[0] * 7471u + (unsigned int)inptr[1] * 38470u + (unsigned int)inptr[2] * 19595u) >> nShift);
+			inptr += 3;
+		}
+	}
+}
+
+/*
+	Function: IntColorToY
+	Description: Compute the Y channel from the integer arrays of R, G, B
+		with the same weights as IplImageToInt.
+
+	Parameters:(hidden)
+		m_pnRImg, m_pnGImg, m_pnBImg - input integer arrays
+	Return:
+		m_pnYImg - output integer array
+*/
+void dehazing::IntColorToY()
+{
+	int nIdx;
+
+	for (nIdx = 0; nIdx < m_nWid * m_nHei; nIdx++)
+	{
+		m_pnYImg[nIdx] = (m_pnBImg[nIdx] * 7471 + m_pnGImg[nIdx] * 38470 + m_pnRImg[nIdx] * 19595) >> 16;
+	}
+}
+
 /*
 	Function: DownsampleImage
 	Description: Downsample the image to fixed sized image (320 x 240)
 
-	Parameters:(hidden)
-		m_pnYImg - input Y Image
+	Parameters:
+		pnYImg - input Y Image (m_pnYImg)
 	Return:
-		m_pnSmallYImg - output down sampled image
+		pnSmallYImg - output down sampled image (m_pnSmallYImg)
 */
-void dehazing::DownsampleImage()
+void dehazing::DownsampleImage(int* pnYImg, int* pnSmallYImg)
 {
 	int nX, nY;
 
@@ -95,7 +195,7 @@ void dehazing::DownsampleImage()
 		for (nX = 0; nX < 320; nX++)
 		{
 			// (1) 멤버 변수인 m_pnYImg를 m_pnSmallYImg로 다운샘플링(크기는 320x240)
-			m_pnSmallYImg[n_pixel++] = m_pnYImg[(int)fry * m_nWid + (int)frx];
+			pnSmallYImg[n_pixel++] = pnYImg[(int)fry * m_nWid + (int)frx];
 			frx += fRatioX;
 		}
 		fry += fRatioY;
@@ -106,17 +206,18 @@ void dehazing::DownsampleImage()
 /*
 	Function: DownsampleImageColor
 	Description: Downsample the image to fixed sized image (320 x 240) ** for color
+		The pixels of DownsampleImage are sampled from the frame, so the full
+		size R, G, B arrays are not needed. A YUV frame (yuv.cpp) is converted
+		at the samples.
 
-	Parameters:(hidden)
-		m_pnRImg - input R Image
-		m_pnGImg - input G Image
-		m_pnBImg - input B Image
+	Parameters:
+		imInput - input image
 	Return:
 		m_pnSmallRImg - output down sampled image
 		m_pnSmallGImg - output down sampled image
 		m_pnSmallBImg - output down sampled image
 */
-void dehazing::DownsampleImageColor()
+void dehazing::DownsampleImageColor(cv::Mat& imInput)
 {
 	int nX, nY;
 
@@ -125,26 +226,57 @@ void dehazing::DownsampleImageColor()
 	fRatioX = (float)m_nWid / (float)320;
 	fRatioY = (float)m_nHei / (float)240;
 
-	int n_pixel = 0, n_step = 0;
+	int n_pixel = 0;
 	float fry = 0, frx = 0;
+	uchar aucBGR[3];
+	// the input type is decided once (YUV 4:2:0, high bit depth or BGR)
+	const int nType = imInput.type();
 	for (nY = 0; nY < 240; nY++)
 	{
-		for (nX = 0; nX < 320; nX++)
+		// (1) 입력 영상을 m_pnSmallRImg, m_pnSmallGImg, m_pnSmallBImg로 다운샘플링(크기는 320x240)
+		if (nType == CV_8UC1)
 		{
-			// (1) 멤버 변수인 m_pnYImg를 m_pnSmallYImg로 다운샘플링(크기는 320x240)
-			n_step = (int)fry * m_nWid + (int)frx;
-			m_pnSmallRImg[n_pixel] = m_pnRImg[n_step];
-			m_pnSmallGImg[n_pixel] = m_pnGImg[n_step];
-			m_pnSmallBImg[n_pixel] = m_pnBImg[n_step];
-			n_pixel++;
-			frx += fRatioX;
+			for (nX = 0; nX < 320; nX++)
+			{
+				YUVPixelToBGR(imInput, (int)frx, (int)fry, aucBGR);
+				m_pnSmallBImg[n_pixel] = aucBGR[0];
+				m_pnSmallGImg[n_pixel] = aucBGR[1];
+				m_pnSmallRImg[n_pixel] = aucBGR[2];
+				n_pixel++;
+				frx += fRatioX;
+			}
+		}
+		else if (nType == CV_16UC3)
+		{
+			const unsigned short* pusRow = imInput.ptr<unsigned short>((int)fry);
+			for (nX = 0; nX < 320; nX++)
+			{
+				const unsigned short* pusPixel = pusRow + (int)frx * 3;
+				m_pnSmallBImg[n_pixel] = (uchar)(pusPixel[0] >> m_nBitShift);
+				m_pnSmallGImg[n_pixel] = (uchar)(pusPixel[1] >> m_nBitShift);
+				m_pnSmallRImg[n_pixel] = (uchar)(pusPixel[2] >> m_nBitShift);
+				n_pixel++;
+				frx += fRatioX;
+			}
+		}
+		else
+		{
+			uchar* inptr = imInput.ptr<uchar>((int)fry);
+			for (nX = 0; nX < 320; nX++)
+			{
+				uchar* pucPixel = inptr + (int)frx * 3;
+				m_pnSmallBImg[n_pixel] = pucPixel[0];
+				m_pnSmallGImg[n_pixel] = pucPixel[1];
+				m_pnSmallRImg[n_pixel] = pucPixel[2];
+				n_pixel++;
+				frx += fRatioX;
+			}
 		}
 		fry += fRatioY;
 		frx = 0;
 	}
 }
 
-
 /*
 	Function: UpsampleImage
 	Description: upsample the fixed sized transmission to original size
@@ -153,12 +285,33 @@ void dehazing::DownsampleImageColor()
 		m_pfSmallTransR - input transmission (320 x 240)
 	Return:
 		m_pfTransmission - output transmission
+		(with a region of interest, only the filter cells are upsampled)
 
 */
 void dehazing::UpsampleTransmission()
 {
 	int nX, nY;
 
+	if (m_bROIFlag == true)
+	{
+		int nCX;
+		for (nY = 0; nY < m_nHei; nY++)
+		{
+			uchar* pucCell = m_pucROICell + (nY / m_nCellSize) * m_nCellW;
+			float* pfSmallTrans = m_pfSmallTrans + m_pnUpY[nY] * 320;
+			float* pfTrans = m_pfTransmission + nY * m_nWid;
+			for (nCX = 0; nCX < m_nCellW; nCX++)
+			{
+				if (!(pucCell[nCX] & ROI_CELL_FILTER))
+					continue;
+				int nEndX = __min((nCX + 1) * m_nCellSize, m_nWid);
+				for (nX = nCX * m_nCellSize; nX < nEndX; nX++)
+					pfTrans[nX] = pfSmallTrans[m_pnUpX[nX]];
+			}
+		}
+		return;
+	}
+
 	float fRatioY, fRatioX;
 	// 업샘플링 비율 결정
 	fRatioX = (float)320 / (float)m_nWid;
@@ -180,78 +333,78 @@ void dehazing::UpsampleTransmission()
 }
 
 /*
-	Function: MakeExpLUT
-	Description: Make a Look Up Table(LUT) for applying previous information.
+	Function: UpsampleRefinedTransmission
+	Description: upsample the refined transmission (320 x 240) to original size
+		using bilinear interpolation, pixel centers are aligned.
 
+	Parameters:(hidden)
+		m_pfSmallTransR - input refined transmission (320 x 240)
 	Return:
-		m_pfExpLUT - output table
+		m_pfTransmissionR - output refined transmission
 
 */
-void dehazing::MakeExpLUT()
+void dehazing::UpsampleRefinedTransmission()
 {
-	int nIdx;
+	int nX, nY;
 
-	for (nIdx = 0; nIdx < 256; nIdx++)
+	int* pnX0 = new int[m_nWid];
+	float* pfWX = new float[m_nWid];
+
+	for (nX = 0; nX < m_nWid; nX++)
 	{
-		m_pfExpLUT[nIdx] = expf(-(float)(nIdx * nIdx) / 10.0f);
+		float fX = __min(__max(((float)nX + 0.5f) * 320.0f / (float)m_nWid - 0.5f, 0.0f), 319.0f);
+		pnX0[nX] = __min((int)fX, 318);
+		pfWX[nX] = fX - (float)pnX0[nX];
 	}
+
+#pragma omp parallel for private(nX)
+	for (nY = 0; nY < m_nHei; nY++)
+	{
+		float fY = __min(__max(((float)nY + 0.5f) * 240.0f / (float)m_nHei - 0.5f, 0.0f), 239.0f);
+		int nY0 = __min((int)fY, 238);
+		float fWY = fY - (float)nY0;
+		float* pfRow0 = m_pfSmallTransR + nY0 * 320;
+		float* pfRow1 = pfRow0 + 320;
+		float* pfOut = m_pfTransmissionR + nY * m_nWid;
+
+		for (nX = 0; nX < m_nWid; nX++)
+		{
+			float fTop = pfRow0[pnX0[nX]] + (pfRow0[pnX0[nX] + 1] - pfRow0[pnX0[nX]]) * pfWX[nX];
+			float fBottom = pfRow1[pnX0[nX]] + (pfRow1[pnX0[nX] + 1] - pfRow1[pnX0[nX]]) * pfWX[nX];
+			pfOut[nX] = fTop + (fBottom - fTop) * fWY;
+		}
+	}
+
+	delete[] pnX0;
+	delete[] pfWX;
 }
 
 /*
-	Function: GuideLUTMaker
-	Description: Make a Look Up Table(LUT) for guided filtering
+	Function: MakeExpLUT
+	Description: Make a Look Up Table(LUT) for applying previous information.
 
 	Return:
-		m_pfGuidedLUT - output table
+		m_pfExpLUT - output table
 
 */
-void dehazing::GuideLUTMaker()
+void dehazing::MakeExpLUT()
 {
-	int nX, nY;
-	const int msz = m_nGBlockSize / 2;	
-	int* xd2 = new int[msz];
-	int* yd2 = new int[msz];
-	int dist = -msz + 1;
-	for (nX = 0; nX < msz; nX++)
-	{
-		xd2[nX] = dist * dist;
-		yd2[nX] = xd2[nX];
-		dist++;
-	}
+	int nIdx;
 
-	int midx = m_nGBlockSize - 1;
-	int prowi = 0;
-	int nrowi = midx * m_nGBlockSize;
-	const float denom = 1 / (2 * m_fGSigma * m_fGSigma);
-	int tl, tr, bl, br;
-	for (nY = 0; nY < msz; nY++)
+	for (nIdx = 0; nIdx < 256; nIdx++)
 	{
-		for (nX = 0; nX < msz; nX++)
-		{
-			tl = prowi + nX;
-			tr = prowi + midx - nX;
-			bl = nrowi + nX;
-			br = nrowi + midx - nX;
-			m_pfGuidedLUT[tl] = expf(-(xd2[nX] + yd2[nY]) * denom);
-			m_pfGuidedLUT[tr] = m_pfGuidedLUT[tl];
-			m_pfGuidedLUT[bl] = m_pfGuidedLUT[tl];
-			m_pfGuidedLUT[br] = m_pfGuidedLUT[tl];
-		}
-		prowi += m_nGBlockSize;
-		nrowi -= m_nGBlockSize;
+		m_pfExpLUT[nIdx] = expf(-(float)(nIdx * nIdx) / 10.0f);
 	}
-
-	delete[] xd2;
-	delete[] yd2;
 }
+
 /*
 	Function: GammaLUTMaker
-	Description: Make a Look Up Table(LUT) for gamma correction
+	Description: Make a Look Up Table(LUT) for gamma correction (rounded to the nearest)
 
 	parameter:
 		fParameter - gamma value.
 	Return:
-		m_pfGuidedLUT - output table
+		m_pucGammaLUT - output table
 
 */
 void dehazing::GammaLUTMaker(float fParameter)
@@ -260,6 +413,10 @@ void dehazing::GammaLUTMaker(float fParameter)
 
 	for (nIdx = 0; nIdx < 256; nIdx++)
 	{
-		m_pucGammaLUT[nIdx] = (uchar)(powf((float)nIdx / 255, fParameter) * 255.0f);
+		m_pucGammaLUT[nIdx] = (uchar)(powf((float)nIdx / 255, fParameter) * 255.0f + 0.5f);
 	}
+
+	// the table of the high bit depth is made again at the next frame
+	m_fToneGamma = fParameter;
+	m_nToneBits = 0;
 }
\ No newline at end of file
@@ -9,15 +9,36 @@
 	"An advanced contrast enhancement using partially overlapped subblock
 	histogram equalization," IEEE Trans. Circuits and Syst. Video Technol.
 	11 (4) (2001) 475-484. Also, at each window, the gussian weight is applied.
+	The weighted outputs of the windows are accumulated by a recursive Gaussian
+	filter, hence the cost does not depend on the window size and the sigma.
 
 	The guided filter with shiftable window is the enhanced algorithm of original
 	guided image filtering by shifting the filter window.
 
+	The filters are registered as refinement methods (m_astRefine), and the
+	method is selected for each call by RefineMethod() or by the cost model.
+
 	Last updated: 2013-02-06
 	Author: Jin-Hwan, Kim.
  */
 #include "dehazing.h"
 
+// refinement methods, the cost model is measured on x86-64 (single thread, SSE2)
+const dehazing::RefineBackend dehazing::m_astRefine[REFINE_NUM] =
+{
+	{ "fast",		&dehazing::RefineFast,		false,	0.0f,	6.5f },
+	{ "fast small",	&dehazing::RefineFastSmall,	true,	0.5f,	1.5f },
+	{ "grey",		&dehazing::RefineGrey,		false,	0.0f,	50.0f },
+	{ "color",		&dehazing::RefineColor,		false,	0.0f,	185.0f },
+	{ "shiftable",	&dehazing::RefineShiftable,	false,	0.0f,	14500.0f },
+	{ "coefficient",	&dehazing::RefineCoef,	true,	1.6f,	0.0f },
+};
+
+const int dehazing::m_anRefineQuality[REFINE_NUM] =
+{
+	REFINE_SHIFTABLE, REFINE_COLOR, REFINE_GREY, REFINE_COEF, REFINE_FAST, REFINE_FAST_SMALL
+};
+
 
  /*
 	 Function: CalcAcoeff
@@ -559,448 +580,436 @@ void dehazing::GuidedFilter(int nW, int nH, float fEps)
 }
 
 /*
-	Function: FastGuidedFilter (downsampled image)
-	Description: Transmission refinement based on guided fitlering, but we approximate the filtering
-		using partial window. In addtion, we analyze the guided filter using projection method.
-		SSE (SIMD) is applied.
-		* Limitation - In this code, we do not consider the border line of filtering, hence we will update the code.
-					   The user may regulate the window size that the image size divides into the window size.
+	Function: RecursiveGaussianCoef
+	Description: coefficients of the recursive Gaussian filter of Young and
+		van Vliet ("Recursive implementation of the Gaussian filter," Signal
+		Processing 44 (1995) 139-151). A causal and an anti-causal pass of
+		w[n] = pfCoef[0] * x[n] + pfCoef[1] * w[n-1] + pfCoef[2] * w[n-2] + pfCoef[3] * w[n-3]
+		approximate the Gaussian of fSigma with 7 multiplications per sample.
 	Parameters:
-		nW - width of down-sampled image
-		nH - height of down-sampled image
-	(hidden)
-		m_pnSmallYImg - down-sampled image
-		m_pnSmallTrans - down-sampled initial transmission
+		fSigma - standard deviation (>= 0.5)
 	Return:
-		m_pfSmallTransR - down-sampled refined transmission
+		pfCoef - B, b1 / b0, b2 / b0, b3 / b0
  */
-void dehazing::FastGuidedFilterS()
+static void RecursiveGaussianCoef(float fSigma, float* pfCoef)
+{
+	fSigma = __max(fSigma, 0.5f);
+	const float fQ = fSigma >= 2.5f ? 0.98711f * fSigma - 0.96330f : 3.97156f - 4.14554f * sqrtf(1.0f - 0.26891f * fSigma);
+	const float fQ2 = fQ * fQ, fQ3 = fQ2 * fQ;
+	const float fB0 = 1.57825f + 2.44413f * fQ + 1.4281f * fQ2 + 0.422205f * fQ3;
+
+	pfCoef[1] = (2.44413f * fQ + 2.85619f * fQ2 + 1.26661f * fQ3) / fB0;
+	pfCoef[2] = -(1.4281f * fQ2 + 1.26661f * fQ3) / fB0;
+	pfCoef[3] = 0.422205f * fQ3 / fB0;
+	pfCoef[0] = 1.0f - (pfCoef[1] + pfCoef[2] + pfCoef[3]);
+}
+
+/*
+	Function: RecursiveGaussianRow
+	Description: the recursive Gaussian filter of a row, in place
+		(the samples out of the row are 0).
+	Parameters:
+		pfRow - row
+		nLen - length of the row
+		pfCoef - RecursiveGaussianCoef
+ */
+static void RecursiveGaussianRow(float* pfRow, int nLen, const float* pfCoef)
 {
-	int nW = 320;
-	int nH = 240;
-	int nStep = m_nStepSize;
-	int nWstep = m_nGBlockSize / nStep;		// Step size of x-axis
-	int nHstep = m_nGBlockSize / nStep;		// Step size of y-axis
-
-	int nYb, nXb, nYa, nXa;
-	int nIdxA, nIdxB, nI;
-	float fDenom, fNormV1, fMeanI;
-	float fAk, fBk;
-
-	// SIMD is applied
-	__m128 sseMean, sseY, ssePk_p, sseDenom, sseInteg, sseNormPk,
-		sseAk, sseBk, sseP, sseNormV1, sseGauss, sseBkV1, sseQ;
-
-	// Initialization
-	for (nYb = 0; nYb < nH; nYb++)
+	float fW1 = 0.0f, fW2 = 0.0f, fW3 = 0.0f, fW;
+	int nX;
+
+	for (nX = 0; nX < nLen; nX++)
 	{
-		for (nXb = 0; nXb < nW; nXb++)
-		{
-			m_pfSmallY[nYb * nW + nXb] = (float)m_pnSmallYImg[nYb * nW + nXb];
-			m_pfSmallInteg[nYb * nW + nXb] = 0;
-			m_pfSmallDenom[nYb * nW + nXb] = 0;
-		}
+		fW = pfCoef[0] * pfRow[nX] + pfCoef[1] * fW1 + pfCoef[2] * fW2 + pfCoef[3] * fW3;
+		fW3 = fW2;
+		fW2 = fW1;
+		fW1 = fW;
+		pfRow[nX] = fW;
 	}
-	// Transmission refinement is applied to sampling pixels
-	for (nYa = 0; nYa < (nH - m_nGBlockSize) / nHstep + 1; nYa++)
-	{
-		for (nXa = 0; nXa < (nW - m_nGBlockSize) / nWstep + 1; nXa++)
-		{
-			nIdxA = nYa * nHstep * nW + nXa * nWstep;
 
-			// vector normalize -> fNormV1
-			fNormV1 = 1.0f / m_nGBlockSize;
-			fMeanI = 0.0f;
-
-			// fNormV1 --> create perpendicular vector(m_pfSmallPk_p)
-			// m_pfSmallPk_p == m_pfSmallY - fMeanI;
+	fW1 = fW2 = fW3 = 0.0f;
+	for (nX = nLen - 1; nX >= 0; nX--)
+	{
+		fW = pfCoef[0] * pfRow[nX] + pfCoef[1] * fW1 + pfCoef[2] * fW2 + pfCoef[3] * fW3;
+		fW3 = fW2;
+		fW2 = fW1;
+		fW1 = fW;
+		pfRow[nX] = fW;
+	}
+}
 
-			sseMean = _mm_setzero_ps();
-			sseY = _mm_setzero_ps();
+/*
+	Function: RecursiveGaussianColumns
+	Description: the recursive Gaussian filter of the columns nStartX ~ nEndX - 1
+		over the rows nStartY ~ nEndY - 1, in place (the rows out of the range
+		are 0). The columns are processed with SSE, 4 at once, and the strips
+		of the columns in parallel.
+	Parameters:
+		pfImage - image
+		nStride - width of the image
+		nStartX, nEndX, nStartY, nEndY - range
+		pfCoef - RecursiveGaussianCoef
+ */
+static void RecursiveGaussianColumns(float* pfImage, int nStride, int nStartX, int nEndX, int nStartY, int nEndY, const float* pfCoef)
+{
+	const int nStrip = 64;
+	const __m128 sseC0 = _mm_set1_ps(pfCoef[0]), sseC1 = _mm_set1_ps(pfCoef[1]),
+		sseC2 = _mm_set1_ps(pfCoef[2]), sseC3 = _mm_set1_ps(pfCoef[3]);
+	float* pfZero = new float[nStride];
+	memset(pfZero, 0, nStride * sizeof(float));
+
+	#pragma omp parallel for schedule(static)
+	for (int nS = nStartX; nS < nEndX; nS += nStrip)
+	{
+		const int nE = __min(nS + nStrip, nEndX);
+		int nX, nY, nPass;
 
-			// Mean value
-			for (nYb = 0; nYb < m_nGBlockSize; nYb++)
+		for (nPass = 0; nPass < 2; nPass++)
+		{
+			// causal pass from the top, anti-causal pass from the bottom
+			const int nDir = nPass == 0 ? 1 : -1;
+			const float* pfW1 = pfZero, * pfW2 = pfZero, * pfW3 = pfZero;
+			for (nY = nPass == 0 ? nStartY : nEndY - 1; nY >= nStartY && nY < nEndY; nY += nDir)
 			{
-				for (nXb = 0; nXb < m_nGBlockSize; nXb += 4)
+				float* pfRow = pfImage + nY * nStride;
+				for (nX = nS; nX + 4 <= nE; nX += 4)
 				{
-					sseY = _mm_loadu_ps((m_pfSmallY + (nIdxA + nYb * nW + nXb)));
-					sseMean = _mm_add_ps(sseMean, sseY);
+					__m128 sseW = _mm_mul_ps(sseC0, _mm_loadu_ps(pfRow + nX));
+					sseW = _mm_add_ps(sseW, _mm_mul_ps(sseC1, _mm_loadu_ps(pfW1 + nX)));
+					sseW = _mm_add_ps(sseW, _mm_mul_ps(sseC2, _mm_loadu_ps(pfW2 + nX)));
+					sseW = _mm_add_ps(sseW, _mm_mul_ps(sseC3, _mm_loadu_ps(pfW3 + nX)));
+					_mm_storeu_ps(pfRow + nX, sseW);
 				}
+				for (; nX < nE; nX++)
+					pfRow[nX] = pfCoef[0] * pfRow[nX] + pfCoef[1] * pfW1[nX] + pfCoef[2] * pfW2[nX] + pfCoef[3] * pfW3[nX];
+				pfW3 = pfW2;
+				pfW2 = pfW1;
+				pfW1 = pfRow;
 			}
+		}
+	}
 
-			for (nI = 0; nI < 4; nI++)
-			{
-				fMeanI += *((float*)(&sseMean) + nI);
-			}
-
-			fMeanI = fMeanI / (m_nGBlockSize * m_nGBlockSize);
-
-			sseMean = _mm_set1_ps(fMeanI);
-			sseY = _mm_setzero_ps();
+	delete[] pfZero;
+}
 
-			ssePk_p;
+/*
+	Function: FastGuidedFilterAccumulate
+	Description: the Gaussian weighted accumulation of the sampled windows of
+		FastGuidedFilter and FastGuidedFilterS.
+		The output of a window k at the pixel i is q_i = a_k * (I_i - mean_k) + mean(p)_k,
+		with a_k = cov(I, p)_k / var(I)_k (0 for a flat window), the projection
+		of the transmission p on the Y image I of the window, that is,
+		q_i = A_k * I_i + B_k. The outputs of the windows are accumulated with
+		the Gaussian weight of m_fGSigma around the center of the window c_k:
+			Integ(i) = I_i * sum_k G(i - c_k) A_k + sum_k G(i - c_k) B_k
+			Denom(i) = sum_k G(i - c_k)
+		hence the sums are the Gaussian filtered fields of A_k, B_k and 1 placed
+		at the centers of the windows. The fields are filtered by the separable
+		recursive Gaussian (RecursiveGaussianCoef): the rows of the window
+		centers, then the columns. The cost per pixel does not depend on the
+		window size nor on m_fGSigma. (The Gaussian is not truncated at the
+		border of the window.)
+		The sums of a window are accumulated per row in float (exact for the
+		integer Y) and in double over the rows.
+	Parameters:
+		pnY - Y image
+		pfTrans - initial transmission
+		nW, nH - size of the image
+		bROI - only the windows overlapping the region of interest are
+			accumulated, and the columns and rows around them are filtered
+	Return:
+		pfCoefA - Gaussian filtered A (work)
+		pfInteg - weighted sum of the outputs
+		pfDenom - sum of the weights
+ */
+void dehazing::FastGuidedFilterAccumulate(int* pnY, float* pfTrans, int nW, int nH, bool bROI, float* pfCoefA, float* pfInteg, float* pfDenom)
+{
+	const int nN = m_nGBlockSize;
+	const int nStep = __max(nN / m_nStepSize, 1);				// distance between the windows
+	const int nWinW = nW >= nN ? (nW - nN) / nStep + 1 : 0;
+	const int nWinH = nH >= nN ? (nH - nN) / nStep + 1 : 0;
+	const int nCenter = (nN - 1) / 2;						// center of the window (+ 0.5 if even)
+	const bool bHalf = ((nN - 1) & 1) != 0;
+	const double dN = (double)nN * (double)nN;
+	float afCoef[4];
+	int nX, nY;
+
+	RecursiveGaussianCoef(m_fGSigma, afCoef);
+
+	// (1) coefficients of the windows, on the rows of the window centers
+	float* pfRowA = new float[__max(nWinH, 1) * nW];
+	float* pfRowB = new float[__max(nWinH, 1) * nW];
+	float* pfRowW = new float[__max(nWinH, 1) * nW];
+	memset(pfRowA, 0, nWinH * nW * sizeof(float));
+	memset(pfRowB, 0, nWinH * nW * sizeof(float));
+	memset(pfRowW, 0, nWinH * nW * sizeof(float));
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int nYa = 0; nYa < nWinH; nYa++)
+	{
+		for (int nXa = 0; nXa < nWinW; nXa++)
+		{
+			if (bROI == true && ROIWindow(nXa, nYa) == false)
+				continue;
 
-			// m_pfSmallY - fMeanI
-			for (nYb = 0; nYb < m_nGBlockSize; nYb++)
+			const int nIdxA = nYa * nStep * nW + nXa * nStep;
+			double dSumI = 0.0, dSumII = 0.0, dSumP = 0.0, dSumIP = 0.0;
+			for (int nYb = 0; nYb < nN; nYb++)
 			{
-				for (nXb = 0; nXb < m_nGBlockSize; nXb += 4)
+				const int* pnRow = pnY + nIdxA + nYb * nW;
+				const float* pfRow = pfTrans + nIdxA + nYb * nW;
+				__m128 sseI = _mm_setzero_ps(), sseII = _mm_setzero_ps(), sseP = _mm_setzero_ps(), sseIP = _mm_setzero_ps();
+				float afSum[4][4];
+				int nXb;
+				for (nXb = 0; nXb + 4 <= nN; nXb += 4)
 				{
-					sseY = _mm_loadu_ps(m_pfSmallY + (nIdxA + nYb * nW + nXb));
-					ssePk_p = _mm_sub_ps(sseY, sseMean);
-
-					for (nI = 0; nI < 4; nI++)
-					{
-						m_pfSmallPk_p[nYb * m_nGBlockSize + nXb + nI] = *((float*)(&ssePk_p) + nI);
-					}
+					__m128 sseY = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(pnRow + nXb)));
+					__m128 sseT = _mm_loadu_ps(pfRow + nXb);
+					sseI = _mm_add_ps(sseI, sseY);
+					sseII = _mm_add_ps(sseII, _mm_mul_ps(sseY, sseY));
+					sseP = _mm_add_ps(sseP, sseT);
+					sseIP = _mm_add_ps(sseIP, _mm_mul_ps(sseY, sseT));
 				}
+				_mm_storeu_ps(afSum[0], sseI);
+				_mm_storeu_ps(afSum[1], sseII);
+				_mm_storeu_ps(afSum[2], sseP);
+				_mm_storeu_ps(afSum[3], sseIP);
+				for (; nXb < nN; nXb++)
+				{
+					afSum[0][0] += (float)pnRow[nXb];
+					afSum[1][0] += (float)(pnRow[nXb] * pnRow[nXb]);
+					afSum[2][0] += pfRow[nXb];
+					afSum[3][0] += (float)pnRow[nXb] * pfRow[nXb];
+				}
+				dSumI += (double)afSum[0][0] + afSum[0][1] + afSum[0][2] + afSum[0][3];
+				dSumII += (double)afSum[1][0] + afSum[1][1] + afSum[1][2] + afSum[1][3];
+				dSumP += (double)afSum[2][0] + afSum[2][1] + afSum[2][2] + afSum[2][3];
+				dSumIP += (double)afSum[3][0] + afSum[3][1] + afSum[3][2] + afSum[3][3];
 			}
 
-			// p vector normalize -> m_pfSmallNormPk
-			// m_pfSmallPk_p^2
-			fDenom = 0.0f;
-
-			sseDenom = _mm_setzero_ps();
+			// N^2 * var(I) is an exact integer, 0 for a flat window
+			const double dVarN = dN * dSumII - dSumI * dSumI;
+			const double dA = dVarN > 0.0 ? (dN * dSumIP - dSumI * dSumP) / dVarN : 0.0;
+			const float fA = (float)dA;
+			const float fB = (float)((dSumP - dA * dSumI) / dN);
 
-			for (nIdxB = 0; nIdxB < m_nGBlockSize * m_nGBlockSize; nIdxB += 4)
+			const int nC = nYa * nW + nXa * nStep + nCenter;
+			if (bHalf == true)
 			{
-				ssePk_p = _mm_loadu_ps(m_pfSmallPk_p + nIdxB);
-				sseDenom = _mm_add_ps(sseDenom, _mm_mul_ps(ssePk_p, ssePk_p));
+				pfRowA[nC] += 0.5f * fA;
+				pfRowB[nC] += 0.5f * fB;
+				pfRowW[nC] += 0.5f;
+				pfRowA[nC + 1] += 0.5f * fA;
+				pfRowB[nC + 1] += 0.5f * fB;
+				pfRowW[nC + 1] += 0.5f;
 			}
-
-			for (nI = 0; nI < 4; nI++)
+			else
 			{
-				fDenom += *((float*)(&sseDenom) + nI);
+				pfRowA[nC] += fA;
+				pfRowB[nC] += fB;
+				pfRowW[nC] += 1.0f;
 			}
+		}
+	}
 
-			sseDenom = _mm_set1_ps(sqrt(fDenom));
-
-			sseNormPk;
-
-			fAk = 0.0f;
-			fBk = 0.0f;
-
-			sseAk = _mm_setzero_ps();
-			sseBk = _mm_setzero_ps();
-			sseP;
-
-
-			// a = q'norm_p
-			// b = q'norm_v1
-			// Exception handling (denominator == 0)
-			if (fDenom == 0)
-			{
-				// a = 0;
-				fAk = 0;
-
-				sseNormV1 = _mm_set1_ps(fNormV1);
-				for (nYb = 0; nYb < m_nGBlockSize; nYb++)
-				{
-					for (nXb = 0; nXb < m_nGBlockSize; nXb += 4)
-					{
-						sseP = _mm_loadu_ps(m_pfSmallTrans + (nIdxA + nYb * nW + nXb));
-						sseBk = _mm_add_ps(_mm_mul_ps(sseP, sseNormV1), sseBk);
-					}
-				}
-
-				// b = q'norm_v1
-				for (nI = 0; nI < 4; nI++)
-					fBk += *((float*)(&sseBk) + nI);
-			}
-			else
+	// (2) range of the filtered image (around the windows of the ROI)
+	int nStartX = 0, nEndX = nW, nStartY = 0, nEndY = nH;
+	if (bROI == true)
+	{
+		const int nMargin = (int)ceilf(3.0f * m_fGSigma);
+		nStartX = nW;
+		nEndX = 0;
+		nStartY = nH;
+		nEndY = 0;
+		for (nY = 0; nY < m_nCellH; nY++)
+		{
+			for (nX = 0; nX < m_nCellW; nX++)
 			{
-				// m_pfSmallNormPk
-				for (nIdxB = 0; nIdxB < m_nGBlockSize * m_nGBlockSize; nIdxB += 4)
-				{
-					ssePk_p = _mm_loadu_ps(m_pfSmallPk_p + nIdxB);
-					sseNormPk = _mm_div_ps(ssePk_p, sseDenom);
-
-					for (nI = 0; nI < 4; nI++)
-					{
-						m_pfSmallNormPk[nIdxB + nI] = *((float*)(&sseNormPk) + nI);
-					}
-				}
-
-				// a = q'norm_p
-				// b = q'norm_v1
-				sseNormV1 = _mm_set1_ps(fNormV1);
-
-				for (nYb = 0; nYb < m_nGBlockSize; nYb++)
+				if (m_pucROICell[nY * m_nCellW + nX] & ROI_CELL_FILTER)
 				{
-					for (nXb = 0; nXb < m_nGBlockSize; nXb += 4)
-					{
-						sseP = _mm_loadu_ps(m_pfSmallTrans + (nIdxA + nYb * nW + nXb));
-						sseNormPk = _mm_loadu_ps(m_pfSmallNormPk + (nYb * m_nGBlockSize + nXb));
-
-						sseAk = _mm_add_ps(_mm_mul_ps(sseP, sseNormPk), sseAk);
-						sseBk = _mm_add_ps(_mm_mul_ps(sseP, sseNormV1), sseBk);
-					}
-				}
-
-				for (nI = 0; nI < 4; nI++)
-				{
-					fAk += *((float*)(&sseAk) + nI);
-					fBk += *((float*)(&sseBk) + nI);
+					nStartX = __min(nStartX, nX * m_nCellSize);
+					nEndX = __max(nEndX, (nX + 1) * m_nCellSize);
+					nStartY = __min(nStartY, nY * m_nCellSize);
+					nEndY = __max(nEndY, (nY + 1) * m_nCellSize);
 				}
 			}
+		}
+		nStartX = __max(nStartX - nMargin, 0);
+		nEndX = __min(nEndX + nMargin, nW);
+		nStartY = __max(nStartY - nMargin, 0);
+		nEndY = __min(nEndY + nMargin, nH);
+		if (nStartX >= nEndX || nStartY >= nEndY)
+			nStartX = nEndX = nStartY = nEndY = 0;
+	}
 
-			sseGauss;
-			sseInteg;
-			sseBkV1 = _mm_set1_ps(fBk * fNormV1);
-			sseAk = _mm_set1_ps(fAk);
-			// Gaussian weighting
-			// Weighted_denom
+	// (3) the rows of the window centers, and the fields of the image
+	#pragma omp parallel for schedule(static)
+	for (int nYa = 0; nYa < nWinH; nYa++)
+	{
+		RecursiveGaussianRow(pfRowA + nYa * nW, nW, afCoef);
+		RecursiveGaussianRow(pfRowB + nYa * nW, nW, afCoef);
+		RecursiveGaussianRow(pfRowW + nYa * nW, nW, afCoef);
+	}
 
-			for (nYb = 0; nYb < m_nGBlockSize; nYb++)
+	for (nY = nStartY; nY < nEndY; nY++)
+	{
+		memset(pfCoefA + nY * nW + nStartX, 0, (nEndX - nStartX) * sizeof(float));
+		memset(pfInteg + nY * nW + nStartX, 0, (nEndX - nStartX) * sizeof(float));
+		memset(pfDenom + nY * nW + nStartX, 0, (nEndX - nStartX) * sizeof(float));
+	}
+	for (int nYa = 0; nYa < nWinH; nYa++)
+	{
+		const int nCY = nYa * nStep + nCenter;
+		const float fWeight = bHalf == true ? 0.5f : 1.0f;
+		for (nY = nCY; nY <= (bHalf == true ? nCY + 1 : nCY); nY++)
+		{
+			if (nY < nStartY || nY >= nEndY)
+				continue;
+			for (nX = nStartX; nX < nEndX; nX++)
 			{
-				for (nXb = 0; nXb < m_nGBlockSize; nXb += 4)
-				{
-					sseNormPk = _mm_loadu_ps(m_pfSmallNormPk + (nYb * m_nGBlockSize + nXb));
-					sseGauss = _mm_loadu_ps(m_pfGuidedLUT + (nYb * m_nGBlockSize + nXb));
-
-					sseInteg = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(sseNormPk, sseAk), sseBkV1), sseGauss);
-					// m_pfSmallInteg
-					// m_pfSmallDenom
-					for (nI = 0; nI < 4; nI++)
-					{
-						m_pfSmallInteg[nIdxA + nYb * nW + nXb + nI] += *((float*)(&sseInteg) + nI);
-						m_pfSmallDenom[nIdxA + nYb * nW + nXb + nI] += *((float*)(&sseGauss) + nI);
-					}
-				}
+				pfCoefA[nY * nW + nX] += fWeight * pfRowA[nYa * nW + nX];
+				pfInteg[nY * nW + nX] += fWeight * pfRowB[nYa * nW + nX];
+				pfDenom[nY * nW + nX] += fWeight * pfRowW[nYa * nW + nX];
 			}
 		}
 	}
 
-	// m_pfSmallTransR = m_pfSmallInteg / m_pfSmallDenom
-	for (nIdxA = 0; nIdxA < nW * nH; nIdxA += 4)
-	{
-		sseInteg = _mm_loadu_ps(m_pfSmallInteg + nIdxA);
-		sseDenom = _mm_loadu_ps(m_pfSmallDenom + nIdxA);
-
-		sseQ = _mm_div_ps(sseInteg, sseDenom);
+	// (4) the columns, and Integ = I * A + B
+	RecursiveGaussianColumns(pfCoefA, nW, nStartX, nEndX, nStartY, nEndY, afCoef);
+	RecursiveGaussianColumns(pfInteg, nW, nStartX, nEndX, nStartY, nEndY, afCoef);
+	RecursiveGaussianColumns(pfDenom, nW, nStartX, nEndX, nStartY, nEndY, afCoef);
 
-		for (nI = 0; nI < 4; nI++)
-			m_pfSmallTransR[nIdxA + nI] = *((float*)(&sseQ) + nI);
+	#pragma omp parallel for schedule(static)
+	for (int nYc = nStartY; nYc < nEndY; nYc++)
+	{
+		const int* pnRow = pnY + nYc * nW;
+		const float* pfA = pfCoefA + nYc * nW;
+		float* pfRow = pfInteg + nYc * nW;
+		int nXc;
+		for (nXc = nStartX; nXc + 4 <= nEndX; nXc += 4)
+		{
+			__m128 sseY = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(pnRow + nXc)));
+			_mm_storeu_ps(pfRow + nXc, _mm_add_ps(_mm_mul_ps(sseY, _mm_loadu_ps(pfA + nXc)), _mm_loadu_ps(pfRow + nXc)));
+		}
+		for (; nXc < nEndX; nXc++)
+			pfRow[nXc] += (float)pnRow[nXc] * pfA[nXc];
 	}
+
+	delete[] pfRowA;
+	delete[] pfRowB;
+	delete[] pfRowW;
 }
 
 /*
-	Function: FastGuidedFilter (original sized image)
+	Function: FastGuidedFilter (downsampled image)
 	Description: Transmission refinement based on guided fitlering, but we approximate the filtering
 		using partial window. In addtion, we analyze the guided filter using projection method.
-		SSE (SIMD) is applied.
-		* Limitation - In this code, we do not consider the border line of filtering, hence we will update the code.
-					   The user may regulate the window size that the image size divides into the window size.
-	Parameters:
-		nW - width of down-sampled image
-		nH - height of down-sampled image
+		The outputs of the windows are accumulated by FastGuidedFilterAccumulate.
 	(hidden)
-		m_pnYImg - down-sampled image
-		m_pnTransmission - down-sampled initial transmission
+		m_pnSmallYImg - down-sampled image
+		m_pnSmallTrans - down-sampled initial transmission
 	Return:
-		m_pfTransmissionR - down-sampled refined transmission
+		m_pfSmallTransR - down-sampled refined transmission
  */
-void dehazing::FastGuidedFilter()
+void dehazing::FastGuidedFilterS()
 {
-	int nStep = m_nStepSize;					// step size
-
-	int nEPBlockSizeL = m_nGBlockSize;
-	int nHeiL = m_nHei;
-	int nWidL = m_nWid;
-
-	float* pfYL = m_pfY;
-	float* pfIntegL = m_pfInteg;
-	float* pfDenomL = m_pfDenom;
-	int* pnYImgL = m_pnYImg;
-	float* pfPk_pL = m_pfPk_p;
-	float* pfNormPkL = m_pfNormPk;
-	float* pfGuidedLUTL = m_pfGuidedLUT;
-	float* pfTransmissionL = m_pfTransmission;
-
-	int nWstep = nEPBlockSizeL / nStep;
-	int nHstep = nEPBlockSizeL / nStep;
-
-	float fDenom, fNormV1, fMeanI;
-	float fAk = 0.0f;							// fAk : a in "a*I+b", fBk : b in "a*I+b"
-	float fBk = 0.0f;
-	int nIdxA, nYa, nXa, nYb, nXb, nI, nIdxB;	//  indexing
-
-	// SIMD is applied
-	__m128 sseMean, sseY, ssePk_p, sseDenom, sseInteg, sseNormPk,
-		sseAk, sseBk, sseP, sseNormV1, sseGauss, sseBkV1, sseQ;
-
-	// Initialization
-	for (nYb = 0; nYb < nHeiL; nYb++)
-	{
-		for (nXb = 0; nXb < nWidL; nXb++)
-		{
-			pfYL[nYb * nWidL + nXb] = (float)pnYImgL[nYb * nWidL + nXb];
-			pfIntegL[nYb * nWidL + nXb] = 0;
-			pfDenomL[nYb * nWidL + nXb] = 0;
-		}
-	}
-	// sampling points
-	for (nYa = 0; nYa < (nHeiL - nEPBlockSizeL) / nHstep + 1; nYa++)
-	{
-		for (nXa = 0; nXa < (nWidL - nEPBlockSizeL) / nWstep + 1; nXa++)
-		{
-			nIdxA = nYa * nHstep * nWidL + nXa * nWstep;
-			// 1 vector normalize -> fNormV1
-			fNormV1 = 1.0f / nEPBlockSizeL;
-			fMeanI = 0.0f;
-
-			// Create p vector(m_pfSmallPk_p) which is perpendicular to fNormV1
-			// p vector == m_pfSmallY - fMeanI
-			sseMean = _mm_setzero_ps();
-			sseY = _mm_setzero_ps();
-
-			// Mean value
-			for (nYb = 0; nYb < nEPBlockSizeL; nYb++)
-			{
-				for (nXb = 0; nXb < nEPBlockSizeL; nXb += 4)
-				{
-					sseY = _mm_loadu_ps((pfYL + (nIdxA + nYb * nWidL + nXb)));
-					sseMean = _mm_add_ps(sseMean, sseY);
-				}
-			}
-
-			for (nI = 0; nI < 4; nI++)
-			{
-				fMeanI += *((float*)(&sseMean) + nI);
-			}
-
-			fMeanI = fMeanI / (nEPBlockSizeL * nEPBlockSizeL);
-
-			sseMean = _mm_set1_ps(fMeanI);
-			sseY = _mm_setzero_ps();
+	const int nW = 320;
+	const int nH = 240;
+	int nIdxA;
 
-			// m_pfSmallY - fMeanI
-			for (nYb = 0; nYb < nEPBlockSizeL; nYb++)
-			{
-				for (nXb = 0; nXb < nEPBlockSizeL; nXb += 4)
-				{
-					sseY = _mm_loadu_ps(pfYL + (nIdxA + nYb * nWidL + nXb));
-					ssePk_p = _mm_sub_ps(sseY, sseMean);
+	FastGuidedFilterAccumulate(m_pnSmallYImg, m_pfSmallTrans, nW, nH, false, m_pfSmallY, m_pfSmallInteg, m_pfSmallDenom);
 
-					for (nI = 0; nI < 4; nI++)
-					{
-						pfPk_pL[nYb * nEPBlockSizeL + nXb + nI] = *((float*)(&ssePk_p) + nI);
-					}
-				}
-			}
-			// p vector normalize -> m_pfSmallNormPk
-			// m_pfSmallPk_p^2
-			fDenom = 0.0f;
+	// m_pfSmallTransR = m_pfSmallInteg / m_pfSmallDenom
+	for (nIdxA = 0; nIdxA < nW * nH; nIdxA += 4)
+		_mm_storeu_ps(m_pfSmallTransR + nIdxA, _mm_div_ps(_mm_loadu_ps(m_pfSmallInteg + nIdxA), _mm_loadu_ps(m_pfSmallDenom + nIdxA)));
+}
 
-			sseDenom = _mm_setzero_ps();
+/*
+	Function: FastGuidedFilter (original sized image)
+	Description: Transmission refinement based on guided fitlering, but we approximate the filtering
+		using partial window. In addtion, we analyze the guided filter using projection method.
+		The outputs of the windows are accumulated by FastGuidedFilterAccumulate.
+	(hidden)
+		m_pnYImg - Y image
+		m_pfTransmission - upsampled initial transmission
+	Return:
+		m_pfTransmissionR - refined transmission
+		(with a region of interest, only the windows overlapping the ROI are
+		 filtered and the refined transmission is valid only inside the ROI)
+		(when m_bTransDeferred is set, the division is left to RestoreImage,
+		 see FastGuidedFilterRow, and m_pfTransmissionR is not written)
+ */
+void dehazing::FastGuidedFilter()
+{
+	int nY;
 
-			for (nIdxB = 0; nIdxB < nEPBlockSizeL * nEPBlockSizeL; nIdxB += 4)
-			{
-				ssePk_p = _mm_loadu_ps(pfPk_pL + nIdxB);
-				sseDenom = _mm_add_ps(sseDenom, _mm_mul_ps(ssePk_p, ssePk_p));
-			}
+	FastGuidedFilterAccumulate(m_pnYImg, m_pfTransmission, m_nWid, m_nHei, m_bROIFlag, m_pfY, m_pfInteg, m_pfDenom);
 
-			for (nI = 0; nI < 4; nI++)
-			{
-				fDenom += *((float*)(&sseDenom) + nI);
-			}
+	if (m_bTransDeferred == true)
+		return;
 
-			sseDenom = _mm_set1_ps(sqrt(fDenom));
+	// m_pfTransmissionR = m_pfInteg / m_pfDenom
+	for (nY = 0; nY < m_nHei; nY++)
+	{
+		if (m_bROIFlag == true)
+			FastGuidedFilterRow(nY, m_pnROISpan[nY * 2], m_pnROISpan[nY * 2 + 1], m_pfTransmissionR + nY * m_nWid);
+		else
+			FastGuidedFilterRow(nY, 0, m_nWid, m_pfTransmissionR + nY * m_nWid);
+	}
+}
 
-			sseAk = _mm_setzero_ps();
-			sseBk = _mm_setzero_ps();
-			// a = q'norm_p
-			// b = q'norm_v1
-			// Exception handling (denominator == 0)
-			// a = 0;
-			fAk = 0.0f;
-			fBk = 0.0f;
+/*
+	Function: FastGuidedFilterRow
+	Description: the refined transmission of a row from the accumulation of FastGuidedFilter,
+		m_pfInteg / m_pfDenom. With a region of interest, the cells which are not
+		filtered are regarded as haze-free.
+	Parameters:
+		nY - row
+		nStartX, nEndX - range of the row
+	Return:
+		pfTransR - refined transmission of the row
+ */
+void dehazing::FastGuidedFilterRow(int nY, int nStartX, int nEndX, float* pfTransR)
+{
+	float* pfInteg = m_pfInteg + nY * m_nWid;
+	float* pfDenom = m_pfDenom + nY * m_nWid;
+	int nX;
 
-			if (fDenom == 0)
-			{
-				sseNormV1 = _mm_set1_ps(fNormV1);
-				for (nYb = 0; nYb < nEPBlockSizeL; nYb++)
-				{
-					for (nXb = 0; nXb < nEPBlockSizeL; nXb += 4)
-					{
-						sseP = _mm_loadu_ps(pfTransmissionL + (nIdxA + nYb * nWidL + nXb));
-						sseBk = _mm_add_ps(_mm_mul_ps(sseP, sseNormV1), sseBk);
-					}
-				}
-				// b = q'norm_v1
-				for (nI = 0; nI < 4; nI++)
-					fBk += *((float*)(&sseBk) + nI);
-			}
+	if (m_bROIFlag == true)
+	{
+		uchar* pucCell = m_pucROICell + (nY / m_nCellSize) * m_nCellW;
+		for (nX = nStartX; nX < nEndX; nX++)
+		{
+			if (pucCell[nX / m_nCellSize] & ROI_CELL_FILTER)
+				pfTransR[nX] = pfInteg[nX] / pfDenom[nX];
 			else
-			{
-				// m_pfSmallNormPk
-				for (nIdxB = 0; nIdxB < nEPBlockSizeL * nEPBlockSizeL; nIdxB += 4)
-				{
-					ssePk_p = _mm_loadu_ps(pfPk_pL + nIdxB);
-					sseNormPk = _mm_div_ps(ssePk_p, sseDenom);
-
-					for (int nI = 0; nI < 4; nI++)
-					{
-						pfNormPkL[nIdxB + nI] = *((float*)(&sseNormPk) + nI);
-					}
-				}
-
-				sseNormV1 = _mm_set1_ps(fNormV1);
-				// a = q'norm_p
-				// b = q'norm_v1
-				for (nYb = 0; nYb < nEPBlockSizeL; nYb++)
-				{
-					for (nXb = 0; nXb < nEPBlockSizeL; nXb += 4)
-					{
-						sseP = _mm_loadu_ps(pfTransmissionL + (nIdxA + nYb * nWidL + nXb));
-						sseNormPk = _mm_loadu_ps(pfNormPkL + (nYb * nEPBlockSizeL + nXb));
-
-						sseAk = _mm_add_ps(_mm_mul_ps(sseP, sseNormPk), sseAk);
-						sseBk = _mm_add_ps(_mm_mul_ps(sseP, sseNormV1), sseBk);
-					}
-				}
-
-				for (nI = 0; nI < 4; nI++)
-				{
-					fAk += *((float*)(&sseAk) + nI);
-					fBk += *((float*)(&sseBk) + nI);
-				}
-			}
-
-			sseBkV1 = _mm_set1_ps(fBk * fNormV1);
-			sseAk = _mm_set1_ps(fAk);
-			// Gaussian weighting
-			// Weighted_denom
-			for (nYb = 0; nYb < nEPBlockSizeL; nYb++)
-			{
-				for (nXb = 0; nXb < nEPBlockSizeL; nXb += 4)
-				{
-					sseNormPk = _mm_loadu_ps(pfNormPkL + (nYb * nEPBlockSizeL + nXb));
-					sseGauss = _mm_loadu_ps(pfGuidedLUTL + (nYb * nEPBlockSizeL + nXb));
-
-					sseInteg = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(sseNormPk, sseAk), sseBkV1), sseGauss);
-					// m_pfSmallInteg
-					// m_pfSmallDenom
-					for (nI = 0; nI < 4; nI++)
-					{
-						pfIntegL[nIdxA + nYb * nWidL + nXb + nI] += *((float*)(&sseInteg) + nI);
-						pfDenomL[nIdxA + nYb * nWidL + nXb + nI] += *((float*)(&sseGauss) + nI);
-					}
-				}
-			}
+				pfTransR[nX] = 1.0f;
 		}
+		return;
 	}
 
-	// m_pfSmallTransR = m_pfSmallInteg / m_pfSmallDenom
-	for (int nIdx = 0; nIdx < nWidL * nHeiL; nIdx += 4)
-	{
-		sseInteg = _mm_loadu_ps(pfIntegL + nIdx);
-		sseDenom = _mm_loadu_ps(pfDenomL + nIdx);
-
-		sseQ = _mm_div_ps(sseInteg, sseDenom);
+	for (nX = nStartX; nX + 4 <= nEndX; nX += 4)
+		_mm_storeu_ps(pfTransR + nX, _mm_div_ps(_mm_loadu_ps(pfInteg + nX), _mm_loadu_ps(pfDenom + nX)));
+	for (; nX < nEndX; nX++)
+		pfTransR[nX] = pfInteg[nX] / pfDenom[nX];
+}
 
-		for (int nI = 0; nI < 4; nI++)
-			m_pfTransmissionR[nIdx + nI] = *((float*)(&sseQ) + nI);
-	}
+/*
+	Function: TransmissionRow
+	Description: the refined transmission of a row when it is deferred to RestoreImage
+		(m_bTransDeferred), REFINE_FAST or REFINE_COEF.
+	Parameters:
+		nY - row
+		nStartX, nEndX - range of the row
+	Return:
+		pfTransR - refined transmission of the row
+ */
+void dehazing::TransmissionRow(int nY, int nStartX, int nEndX, float* pfTransR)
+{
+	if (m_nRefineUsed == REFINE_COEF)
+		CoefTransmissionRow(nY, nStartX, nEndX, pfTransR);
+	else
+		FastGuidedFilterRow(nY, nStartX, nEndX, pfTransR);
 }
 
 /*
@@ -1285,4 +1294,300 @@ iterative:
 
 	delete[] pnN;
 	delete[] pnVarN;
-}
\ No newline at end of file
+}
+/*
+	Function: SelectRefine
+	Description: Select the refinement method of the call.
+		REFINE_AUTO selects the best method whose modeled cost is within the
+		latency budget, or the cheapest one. The video dehazing with a region
+		of interest always uses FastGuidedFilter, because the transmission is
+		upsampled only around the region.
+	Parameters:
+		bVideo - called from HazeRemoval
+	Return:
+		REFINE_* method
+ */
+int dehazing::SelectRefine(bool bVideo)
+{
+	int nI, nMethod;
+
+	if (bVideo == true && m_bROIFlag == true)
+		return REFINE_FAST;
+
+	if (m_nRefineMethod == REFINE_DEFAULT)
+		return bVideo == true ? REFINE_FAST : REFINE_COLOR;
+
+	if (m_nRefineMethod == REFINE_AUTO)
+	{
+		for (nI = 0; nI < REFINE_NUM; nI++)
+		{
+			nMethod = m_anRefineQuality[nI];
+			if (bVideo == false && m_astRefine[nMethod].bVideoOnly == true)
+				continue;
+			if (GetRefineCost(nMethod) <= m_fRefineBudget)
+				return nMethod;
+		}
+		return bVideo == true ? REFINE_FAST_SMALL : REFINE_FAST;
+	}
+
+	if (bVideo == false && m_astRefine[m_nRefineMethod].bVideoOnly == true)
+		return REFINE_FAST;
+
+	return m_nRefineMethod;
+}
+
+/*
+	Function: Refine
+	Description: Refine the transmission with the selected method, and update
+		the cost model with the measured time. REFINE_FAST and REFINE_COEF leave
+		the last step (the division, or the upsampling of the coefficients) to
+		RestoreImage, which is not measured.
+	Parameters:
+		imInput - input image
+		bVideo - called from HazeRemoval (the initial transmission is 320*240)
+	(hidden)
+		m_pfSmallTrans / m_pfTransmission - initial transmission
+	Return:
+		m_pfTransmissionR - refined transmission
+ */
+void dehazing::Refine(cv::Mat& imInput, bool bVideo)
+{
+	int nMethod = SelectRefine(bVideo);
+	double dStart = omp_get_wtime();
+
+	// a YUV frame has no RGB guidance, nor a high bit depth frame (8 bit guidance)
+	if (imInput.type() != CV_8UC3 && (nMethod == REFINE_COLOR || nMethod == REFINE_SHIFTABLE))
+		nMethod = REFINE_GREY;
+
+	if (bVideo == true && m_astRefine[nMethod].bVideoOnly == false)
+		UpsampleTransmission();
+
+	m_nRefineUsed = nMethod;
+	m_bTransDeferred = nMethod == REFINE_FAST || nMethod == REFINE_COEF;
+	m_bTransValid = !m_bTransDeferred;
+
+	(this->*m_astRefine[nMethod].pfnRefine)(imInput, bVideo);
+
+	float fMs = (float)((omp_get_wtime() - dStart) * 1000.0);
+	m_afStageMs[STAGE_REFINE] = fMs;
+	float fModel = m_astRefine[nMethod].fFixedMs + m_astRefine[nMethod].fPixelNs * (float)(m_nWid * m_nHei) * 1e-6f;
+	m_afRefineScale[nMethod] = 0.75f * m_afRefineScale[nMethod] + 0.25f * fMs / fModel;
+}
+
+/*
+	Function: RefineFast
+	Description: FastGuidedFilter with the Y image.
+ */
+void dehazing::RefineFast(cv::Mat& imInput, bool bVideo)
+{
+	if (bVideo == false)
+		IntColorToY();
+	FastGuidedFilter();
+}
+
+/*
+	Function: RefineFastSmall
+	Description: FastGuidedFilterS on the 320*240 transmission of the video dehazing,
+		and bilinear upsampling of the refined transmission.
+ */
+void dehazing::RefineFastSmall(cv::Mat& imInput, bool bVideo)
+{
+	FastGuidedFilterS();
+	UpsampleRefinedTransmission();
+}
+
+/*
+	Function: RefineGrey
+	Description: GuidedFilterY with the Y image.
+ */
+void dehazing::RefineGrey(cv::Mat& imInput, bool bVideo)
+{
+	if (bVideo == false)
+		IntColorToY();
+	GuidedFilterY(m_nWid, m_nHei, 0.001f);
+}
+
+/*
+	Function: RefineColor
+	Description: GuidedFilter with the RGB image.
+ */
+void dehazing::RefineColor(cv::Mat& imInput, bool bVideo)
+{
+	if (bVideo == true)
+	{
+		AllocColorImage();
+		IplImageToIntColor(imInput);
+	}
+	GuidedFilter(m_nWid, m_nHei, 0.001f);
+}
+
+/*
+	Function: RefineShiftable
+	Description: GuidedFilterShiftableWindow with the Y and RGB images.
+ */
+void dehazing::RefineShiftable(cv::Mat& imInput, bool bVideo)
+{
+	if (bVideo == true)
+	{
+		AllocColorImage();
+		IplImageToIntColor(imInput);
+	}
+	else
+		IntColorToY();
+	GuidedFilterShiftableWindow(0.001f);
+}
+
+/*
+	Function: RefineCoef
+	Description: GuidedFilterCoef on the 320*240 transmission of the video dehazing.
+		The refined transmission is computed in RestoreImage (CoefTransmissionRow).
+ */
+void dehazing::RefineCoef(cv::Mat& imInput, bool bVideo)
+{
+	int nX;
+
+	if (m_pfSmallA == NULL)
+	{
+		m_pfSmallA = new float[320 * 240];
+		m_pfSmallB = new float[320 * 240];
+		m_pnCoefX = new int[m_nCapLine];
+		m_pfCoefWX = new float[m_nCapLine];
+	}
+
+	// bilinear upsampling, pixel centers are aligned
+	// (a row of weights, the width may be changed by Reconfigure)
+	for (nX = 0; nX < m_nWid; nX++)
+	{
+		float fX = __min(__max(((float)nX + 0.5f) * 320.0f / (float)m_nWid - 0.5f, 0.0f), 319.0f);
+		m_pnCoefX[nX] = __min((int)fX, 318);
+		m_pfCoefWX[nX] = fX - (float)m_pnCoefX[nX];
+	}
+
+	// eps = 0.001 for the image of [0, 1]
+	GuidedFilterCoef(0.001f * 255.0f * 255.0f);
+}
+
+/*
+	Function: GuidedFilterCoef
+	Description: the fast guided filter of He et al. (arXiv:1505.00996). The coefficients
+		a, b of the guided filter are computed on the down-sampled image, and the
+		full resolution transmission q = mean(a) * I + mean(b) is computed with the
+		bilinearly upsampled coefficients (CoefTransmissionRow). The window
+		covers m_nGBlockSize pixels of the original image. The sums of I and I*I
+		are integers (BoxFilter of long long), hence the variance is exact.
+	Parameters:
+		fEps - epsilon
+	(hidden)
+		m_pnSmallYImg - down-sampled image
+		m_pfSmallTrans - down-sampled initial transmission
+	Return:
+		m_pfSmallA, m_pfSmallB - mean of the coefficients
+ */
+void dehazing::GuidedFilterCoef(float fEps)
+{
+	const int nW = 320;
+	const int nH = 240;
+	const int nR = __max((m_nGBlockSize * nW / m_nWid) / 2, 1);
+	int nX, nY, nIdx;
+
+	long long* pnI = new long long[nW * nH];
+	long long* pnII = new long long[nW * nH];
+	long long* pnSumI = new long long[nW * nH];
+	long long* pnSumII = new long long[nW * nH];
+	float* pfIp = new float[nW * nH];
+	float* pfSumP = new float[nW * nH];
+	float* pfSumIp = new float[nW * nH];
+	float* pfN = new float[nW * nH];
+
+	for (nIdx = 0; nIdx < nW * nH; nIdx++)
+	{
+		pnI[nIdx] = m_pnSmallYImg[nIdx];
+		pnII[nIdx] = (long long)m_pnSmallYImg[nIdx] * m_pnSmallYImg[nIdx];
+		pfIp[nIdx] = (float)m_pnSmallYImg[nIdx] * m_pfSmallTrans[nIdx];
+	}
+
+	BoxFilter(pnI, nR, nW, nH, pnSumI);
+	BoxFilter(pnII, nR, nW, nH, pnSumII);
+	BoxFilter(m_pfSmallTrans, nR, nW, nH, pfSumP);
+	BoxFilter(pfIp, nR, nW, nH, pfSumIp);
+
+	// number of pixels in each window
+	for (nY = 0; nY < nH; nY++)
+	{
+		int nRows = __min(nY + nR, nH - 1) - __max(nY - nR, 0) + 1;
+		for (nX = 0; nX < nW; nX++)
+			pfN[nY * nW + nX] = (float)(nRows * (__min(nX + nR, nW - 1) - __max(nX - nR, 0) + 1));
+	}
+
+	// coefficient a and coefficient b
+	for (nIdx = 0; nIdx < nW * nH; nIdx++)
+	{
+		float fMeanI = (float)pnSumI[nIdx] / pfN[nIdx];
+		float fVarI = (float)((double)pnSumII[nIdx] / pfN[nIdx] - (double)fMeanI * fMeanI);
+		float fMeanP = pfSumP[nIdx] / pfN[nIdx];
+		float fCovIp = pfSumIp[nIdx] / pfN[nIdx] - fMeanI * fMeanP;
+
+		pfIp[nIdx] = fCovIp / (fVarI + fEps);
+		pfSumP[nIdx] = fMeanP - pfIp[nIdx] * fMeanI;
+	}
+
+	// mean of the coefficients
+	BoxFilter(pfIp, nR, nW, nH, m_pfSmallA);
+	BoxFilter(pfSumP, nR, nW, nH, m_pfSmallB);
+
+	for (nIdx = 0; nIdx < nW * nH; nIdx++)
+	{
+		m_pfSmallA[nIdx] /= pfN[nIdx];
+		m_pfSmallB[nIdx] /= pfN[nIdx];
+	}
+
+	delete[] pnI;
+	delete[] pnII;
+	delete[] pnSumI;
+	delete[] pnSumII;
+	delete[] pfIp;
+	delete[] pfSumP;
+	delete[] pfSumIp;
+	delete[] pfN;
+}
+
+/*
+	Function: CoefTransmissionRow
+	Description: the refined transmission of a row from the bilinearly upsampled
+		coefficients, q = a * I + b. The two rows of the coefficients are
+		interpolated first, and then each pixel is interpolated in x.
+	Parameters:
+		nY - row
+		nStartX, nEndX - range of the row
+	(hidden)
+		m_pfSmallA, m_pfSmallB - mean of the coefficients
+		m_pnYImg - guidance image (Y image)
+	Return:
+		pfTransR - refined transmission of the row
+ */
+void dehazing::CoefTransmissionRow(int nY, int nStartX, int nEndX, float* pfTransR)
+{
+	int nX;
+	float afA[320], afB[320];
+
+	float fY = __min(__max(((float)nY + 0.5f) * 240.0f / (float)m_nHei - 0.5f, 0.0f), 239.0f);
+	int nY0 = __min((int)fY, 238);
+	float fWY = fY - (float)nY0;
+	float* pfA0 = m_pfSmallA + nY0 * 320;
+	float* pfB0 = m_pfSmallB + nY0 * 320;
+
+	for (nX = 0; nX < 320; nX++)
+	{
+		afA[nX] = pfA0[nX] + (pfA0[nX + 320] - pfA0[nX]) * fWY;
+		afB[nX] = pfB0[nX] + (pfB0[nX + 320] - pfB0[nX]) * fWY;
+	}
+
+	int* pnY = m_pnYImg + nY * m_nWid;
+	for (nX = nStartX; nX < nEndX; nX++)
+	{
+		int nX0 = m_pnCoefX[nX];
+		float fA = afA[nX0] + (afA[nX0 + 1] - afA[nX0]) * m_pfCoefWX[nX];
+		float fB = afB[nX0] + (afB[nX0 + 1] - afB[nX0]) * m_pfCoefWX[nX];
+		pfTransR[nX] = fA * (float)pnY[nX] + fB;
+	}
+}
@@ -0,0 +1,327 @@
+/*
+	This source file contains the high bit depth front end of the video dehazing.
+
+	The frames of the HDR sensors (10, 12, 14 or 16 bits per sample) are stored
+	as CV_16UC3 BGR, with nBits significant bits (0 ~ 2^nBits - 1), and are
+	dehazed without the conversion to 8 bits and back:
+		- The transmission is estimated and refined on the Y image of the 8 bit
+		  scale (IplImageToInt16), since the transmission is a smooth field of
+		  the same range at any bit depth. The atmospheric light is estimated
+		  from the search range shifted to 8 bits, at the first frame.
+		- The restoration (RestoreImage16) runs at the full depth, with the
+		  atmospheric light shifted to the bit depth and the output tone of
+		  2^nBits values (ToneLUTMaker16), 4 pixels (12 samples) at a time
+		  with SSE.
+	All the depths are stored in 16 bit words, hence one kernel serves them,
+	with the depth as a parameter.
+
+	The limitations of the high bit depth frames (refinement, post processing,
+	FixedPointMode, SubmitFrame) are listed in RestorationStage (dehazing.cpp).
+ */
+
+#include "dehazing.h"
+
+/*
+	Function: HazeRemoval16
+	Description: haze removal process of a high bit depth frame (video dehazing).
+		imOutput may be imInput (in-place). An empty output is allocated.
+
+	Parameter:
+		imInput - input image (CV_16UC3)
+		nBits - significant bits of the samples (9 ~ 16)
+		nFrame - frame number
+	Return:
+		imOutput - output image (CV_16UC3 of nBits)
+ */
+void dehazing::HazeRemoval16(cv::Mat& imInput, cv::Mat& imOutput, int nBits, int nFrame)
+{
+	if (CheckFrame16(imInput, imOutput, nBits) == false)
+		return;
+
+	m_nBitShift = nBits - 8;
+	if (m_nToneBits != nBits)
+		ToneLUTMaker16(nBits);
+	int nEstFrame = PrepareFrame(imInput, nFrame);
+
+	double dStart = omp_get_wtime();
+
+	float fStrength = EstimationStage(imInput, nEstFrame, m_pnYImg, m_pnSmallYImg, m_pfSmallTrans);
+	RestorationStage(imInput, imOutput, fStrength);
+
+	// the settings of the next frame (the bypassed frames are not measured)
+	if (m_bGovernor == true && fStrength > 0)
+		GovernorUpdate((float)((omp_get_wtime() - dStart) * 1000.0));
+}
+
+/*
+	Function: HazeRemoval16
+	Description: haze removal process of the external buffers (BGR, 3 words per pixel).
+		The buffers are wrapped without copy, and pusOutput may be pusInput (in-place).
+
+	Parameter:
+		pusInput - input image
+		nInputStep - bytes per row of the input image
+		nOutputStep - bytes per row of the output image
+		nBits - significant bits of the samples
+		nFrame - frame number
+	Return:
+		pusOutput - output image
+ */
+void dehazing::HazeRemoval16(unsigned short* pusInput, int nInputStep, unsigned short* pusOutput, int nOutputStep, int nBits, int nFrame)
+{
+	cv::Mat imInput(m_nHei, m_nWid, CV_16UC3, pusInput, nInputStep);
+	cv::Mat imOutput(m_nHei, m_nWid, CV_16UC3, pusOutput, nOutputStep);
+
+	HazeRemoval16(imInput, imOutput, nBits, nFrame);
+}
+
+/*
+	Function: CheckFrame16
+	Description: check the size and the bit depth of the input and output images.
+	Parameter:
+		imInput - input image
+		imOutput - output image
+		nBits - significant bits of the samples
+	Return:
+		true if the images can be processed
+ */
+bool dehazing::CheckFrame16(cv::Mat& imInput, cv::Mat& imOutput, int nBits)
+{
+	if (nBits < 9 || nBits > 16)
+	{
+		printf("The bit depth must be 9 ~ 16 (%d).\n", nBits);
+		return false;
+	}
+
+	if (m_bFixedPoint == true)
+	{
+		printf("The integer only path does not support the high bit depth.\n");
+		return false;
+	}
+
+	if (imInput.cols != m_nWid || imInput.rows != m_nHei || imInput.type() != CV_16UC3)
+	{
+		printf("The input image must be %dx%d CV_16UC3.\n", m_nWid, m_nHei);
+		return false;
+	}
+
+	if (imOutput.empty())
+		imOutput.create(m_nHei, m_nWid, CV_16UC3);
+	else if (imOutput.cols != m_nWid || imOutput.rows != m_nHei || imOutput.type() != CV_16UC3)
+	{
+		printf("The output image must be %dx%d CV_16UC3.\n", m_nWid, m_nHei);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+	Function: HighBitRegionToBGR
+	Description: shift a region of the high bit depth frame to 8 bits,
+		for the estimation of the atmospheric light.
+	Parameter:
+		imInput - high bit depth image (m_nBitShift)
+		rectRegion - region of the frame
+	Return:
+		imBGR - BGR image of the region
+ */
+void dehazing::HighBitRegionToBGR(cv::Mat& imInput, cv::Rect rectRegion, cv::Mat& imBGR)
+{
+	int nX, nY;
+
+	imBGR.create(rectRegion.height, rectRegion.width, CV_8UC3);
+
+	for (nY = 0; nY < rectRegion.height; nY++)
+	{
+		const unsigned short* inptr = imInput.ptr<unsigned short>(rectRegion.y + nY) + rectRegion.x * 3;
+		uchar* outptr = imBGR.ptr<uchar>(nY);
+		for (nX = 0; nX < rectRegion.width * 3; nX++)
+			outptr[nX] = (uchar)(inptr[nX] >> m_nBitShift);
+	}
+}
+
+/*
+	Function: ToneLUTMaker16
+	Description: Make the output tone of the high bit depth: the gamma of
+		OutputTone(fGamma) at the full depth, or the curve of OutputTone(pucCurve)
+		interpolated linearly.
+	Parameter:
+		nBits - bit depth
+	Return:
+		m_pusToneLUT - output table (2^nBits values)
+ */
+void dehazing::ToneLUTMaker16(int nBits)
+{
+	const int nSize = 1 << nBits;
+	const float fMax = (float)(nSize - 1);
+	int nIdx;
+
+	if (m_pusToneLUT != NULL)
+		delete[] m_pusToneLUT;
+	m_pusToneLUT = new unsigned short[nSize];
+
+	for (nIdx = 0; nIdx < nSize; nIdx++)
+	{
+		float fValue;
+		if (m_fToneGamma >= 0)
+			fValue = powf((float)nIdx / fMax, m_fToneGamma) * fMax;
+		else
+		{
+			float fX = (float)nIdx * 255.0f / fMax;
+			int nX0 = __min((int)fX, 254);
+			float fW = fX - (float)nX0;
+			fValue = ((1.0f - fW) * (float)m_pucGammaLUT[nX0] + fW * (float)m_pucGammaLUT[nX0 + 1]) * fMax / 255.0f;
+		}
+		m_pusToneLUT[nIdx] = (unsigned short)__min(fValue + 0.5f, fMax);
+	}
+	m_nToneBits = nBits;
+}
+
+/*
+	Function: RestoreImage16
+	Description: Dehazed the high bit depth frame using estimated transmission and
+		atmospheric light, I' = (I - A) / t + A, and the output tone.
+		The samples of 4 pixels are computed with SSE as 3 vectors of
+		(B G R B) (G R B G) (R B G R), and the tone is looked up per sample.
+		With the haze detection, the strength s is applied as
+		1 / t' = 1 + s * (1 / t - 1) and as the blend of the tone.
+	Parameter:
+		imInput - Input hazy image.
+	Return:
+		imOutput - Dehazed image.
+ */
+void dehazing::RestoreImage16(cv::Mat& imInput, cv::Mat& imOutput)
+{
+	int nX, nY;
+	bool bDeferred = m_bTransDeferred == true && m_bTransValid == false;
+	const float fStrength = m_fRestoreStrength;
+	const bool bBlend = fStrength < 1.0f;
+	const unsigned short* pusTone = m_pusToneLUT;
+	const float fMax = (float)((1 << m_nToneBits) - 1);
+
+	// atmospheric light at the bit depth (the 8 bit scale is shifted, IplImageToInt16)
+	const float fScale = (float)(1 << m_nBitShift);
+	const float fA_B = (float)m_anAirlight[0] * fScale;
+	const float fA_G = (float)m_anAirlight[1] * fScale;
+	const float fA_R = (float)m_anAirlight[2] * fScale;
+	const __m128 sseA0 = _mm_setr_ps(fA_B, fA_G, fA_R, fA_B);
+	const __m128 sseA1 = _mm_setr_ps(fA_G, fA_R, fA_B, fA_G);
+	const __m128 sseA2 = _mm_setr_ps(fA_R, fA_B, fA_G, fA_R);
+	const __m128 sseMax = _mm_set1_ps(fMax);
+	const __m128 sseOne = _mm_set1_ps(1.0f);
+	const __m128 sseStrength = _mm_set1_ps(fStrength);
+	const __m128i sseZero = _mm_setzero_si128();
+
+#pragma omp parallel private(nX) num_threads(__min(omp_get_max_threads(), m_nTransRowThreads))
+	{
+		// refined transmission of a row
+		float* pfTransRow = bDeferred == true ? m_pfTransRows + omp_get_thread_num() * m_nCapLine * 2 : NULL;
+		int anValue[12];
+
+#pragma omp for
+		for (nY = 0; nY < m_nHei; nY++)
+		{
+			unsigned short* inptr = imInput.ptr<unsigned short>(nY);
+			unsigned short* outptr = imOutput.ptr<unsigned short>(nY);
+			float* pfTransR = m_pfTransmissionR + nY * m_nWid;
+			uchar* pucMask = NULL;
+			int nStartX = 0;
+			int nEndX = m_nWid;
+			int nK;
+
+			if (m_bROIFlag == true)
+			{
+				nStartX = m_pnROISpan[nY * 2];
+				nEndX = __max(m_pnROISpan[nY * 2 + 1], nStartX);
+				if (m_pucROIMask != NULL)
+					pucMask = m_pucROIMask + nY * m_nWid;
+
+				// copy through the outside of the ROI
+				if (inptr != outptr)
+				{
+					memcpy(outptr, inptr, nStartX * 3 * sizeof(unsigned short));
+					memcpy(outptr + nEndX * 3, inptr + nEndX * 3, (m_nWid - nEndX) * 3 * sizeof(unsigned short));
+				}
+			}
+
+			if (bDeferred == true)
+			{
+				pfTransR = pfTransRow;
+				TransmissionRow(nY, nStartX, nEndX, pfTransR);
+			}
+
+			// (1) 4 pixels at once (with a mask, one pixel at a time)
+			nX = nStartX;
+			if (pucMask == NULL)
+			{
+				for (; nX + 4 <= nEndX; nX += 4)
+				{
+					// 1 / t of the 4 pixels, spread over the 12 samples
+					__m128 sseRecip = _mm_div_ps(sseOne, _mm_min_ps(_mm_max_ps(_mm_loadu_ps(pfTransR + nX), _mm_setzero_ps()), sseOne));
+					if (bBlend == true)
+						sseRecip = _mm_add_ps(sseOne, _mm_mul_ps(sseStrength, _mm_sub_ps(sseRecip, sseOne)));
+					__m128 sseR0 = _mm_shuffle_ps(sseRecip, sseRecip, _MM_SHUFFLE(1, 0, 0, 0));
+					__m128 sseR1 = _mm_shuffle_ps(sseRecip, sseRecip, _MM_SHUFFLE(2, 2, 1, 1));
+					__m128 sseR2 = _mm_shuffle_ps(sseRecip, sseRecip, _MM_SHUFFLE(3, 3, 3, 2));
+
+					unsigned short* pusIn = inptr + nX * 3;
+					__m128i sseIn01 = _mm_loadu_si128((const __m128i*)pusIn);
+					__m128i sseIn2 = _mm_loadl_epi64((const __m128i*)(pusIn + 8));
+					__m128 sseI0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(sseIn01, sseZero));
+					__m128 sseI1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(sseIn01, sseZero));
+					__m128 sseI2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(sseIn2, sseZero));
+
+					// I' = (I - A) / t + A, clipped to the depth (truncated as RestoreImage)
+					sseI0 = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_sub_ps(sseI0, sseA0), sseR0), sseA0), _mm_setzero_ps()), sseMax);
+					sseI1 = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_sub_ps(sseI1, sseA1), sseR1), sseA1), _mm_setzero_ps()), sseMax);
+					sseI2 = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_sub_ps(sseI2, sseA2), sseR2), sseA2), _mm_setzero_ps()), sseMax);
+					_mm_storeu_si128((__m128i*)anValue, _mm_cvttps_epi32(sseI0));
+					_mm_storeu_si128((__m128i*)(anValue + 4), _mm_cvttps_epi32(sseI1));
+					_mm_storeu_si128((__m128i*)(anValue + 8), _mm_cvttps_epi32(sseI2));
+
+					unsigned short* pusOut = outptr + nX * 3;
+					if (bBlend == true)
+					{
+						for (nK = 0; nK < 12; nK++)
+							pusOut[nK] = (unsigned short)((float)anValue[nK] + fStrength * (float)(pusTone[anValue[nK]] - anValue[nK]) + 0.5f);
+					}
+					else
+					{
+						for (nK = 0; nK < 12; nK++)
+							pusOut[nK] = pusTone[anValue[nK]];
+					}
+				}
+			}
+
+			// (2) the rest of the row
+			for (; nX < nEndX; nX++)
+			{
+				unsigned short* pusIn = inptr + nX * 3;
+				unsigned short* pusOut = outptr + nX * 3;
+				if (pucMask != NULL && pucMask[nX] == 0)
+				{
+					pusOut[0] = pusIn[0];
+					pusOut[1] = pusIn[1];
+					pusOut[2] = pusIn[2];
+					continue;
+				}
+
+				float fRecip = 1.0f / CLIP_Z(pfTransR[nX]);
+				if (bBlend == true)
+					fRecip = 1.0f + fStrength * (fRecip - 1.0f);
+
+				anValue[0] = (int)__min(__max(((float)pusIn[0] - fA_B) * fRecip + fA_B, 0.0f), fMax);
+				anValue[1] = (int)__min(__max(((float)pusIn[1] - fA_G) * fRecip + fA_G, 0.0f), fMax);
+				anValue[2] = (int)__min(__max(((float)pusIn[2] - fA_R) * fRecip + fA_R, 0.0f), fMax);
+				for (nK = 0; nK < 3; nK++)
+				{
+					if (bBlend == true)
+						pusOut[nK] = (unsigned short)((float)anValue[nK] + fStrength * (float)(pusTone[anValue[nK]] - anValue[nK]) + 0.5f);
+					else
+						pusOut[nK] = pusTone[anValue[nK]];
+				}
+			}
+		}
+	}
+}
@@ -16,6 +16,15 @@
 #include <time.h>
 #include <conio.h>
 #include <iostream>
+#include <stdio.h>
+#include <math.h>
+#include <string>
+#include <string.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 
 
 void video_test(char** argv)
@@ -79,9 +88,353 @@ void image_test()
 }
 
 
+/*
+	benchmark_transmission_kernels() compares the specialized block sums of the
+	transmission estimation (dehazing::BlockSumKernel) with the generic loop on a
+	random 320*240 image (all blocks, 7 candidates), and prints the time of each
+	block width and the speed-up. The sums are checked to be the same.
+ */
+void benchmark_transmission_kernels(int nRepeat)
+{
+	const int nWid = 320, nHei = 240, nAirlight = 200;
+	int* pnImageY = new int[nWid * nHei];
+	int anSums[3], anSumsG[3];
+	int nI, nR, nX, nY, nCounter, nTrans, nB, nAny;
+	float fTrans;
+
+	srand(1);
+	for (nI = 0; nI < nWid * nHei; nI++)
+		pnImageY[nI] = rand() % 256;
+
+	BlockSumFunc pfnGeneric = dehazing::BlockSumKernel(-1, &nAny);
+	BlockSumFunc pfnKernel;
+
+	for (nI = 0; (pfnKernel = dehazing::BlockSumKernel(nI, &nB)) != NULL; nI++)
+	{
+		double adTime[2];
+		long long lnCheck[2] = { 0, 0 };
+		bool bSame = true;
+
+		// (1) time of the generic loop and the specialized one
+		for (int nKernel = 0; nKernel < 2; nKernel++)
+		{
+			BlockSumFunc pfnBlockSum = nKernel == 0 ? pfnGeneric : pfnKernel;
+			double dStart = omp_get_wtime();
+			for (nR = 0; nR < nRepeat; nR++)
+			{
+				for (nY = 0; nY + nB <= nHei; nY += nB)
+				{
+					for (nX = 0; nX + nB <= nWid; nX += nB)
+					{
+						for (nCounter = 0, fTrans = 0.3f; nCounter < 7; nCounter++, fTrans += 0.1f)
+						{
+							nTrans = (int)(1.0f / fTrans * 128.0f);
+							pfnBlockSum(pnImageY + nY * nWid + nX, nWid, nB, nB, nAirlight, nTrans, anSums);
+							lnCheck[nKernel] += anSums[0] + anSums[1] + anSums[2];
+						}
+					}
+				}
+			}
+			adTime[nKernel] = omp_get_wtime() - dStart;
+		}
+
+		// (2) the sums of each block
+		for (nY = 0; nY + nB <= nHei; nY += nB)
+		{
+			for (nX = 0; nX + nB <= nWid; nX += nB)
+			{
+				for (nCounter = 0, fTrans = 0.3f; nCounter < 7; nCounter++, fTrans += 0.1f)
+				{
+					nTrans = (int)(1.0f / fTrans * 128.0f);
+					pfnGeneric(pnImageY + nY * nWid + nX, nWid, nB, nB, nAirlight, nTrans, anSumsG);
+					pfnKernel(pnImageY + nY * nWid + nX, nWid, nB, nB, nAirlight, nTrans, anSums);
+					if (anSums[0] != anSumsG[0] || anSums[1] != anSumsG[1] || anSums[2] != anSumsG[2])
+						bSame = false;
+				}
+			}
+		}
+
+		printf("block %2d: generic %.3f ms, specialized %.3f ms, x%.2f%s\n", nB,
+			adTime[0] * 1000.0 / nRepeat, adTime[1] * 1000.0 / nRepeat, adTime[0] / adTime[1],
+			(bSame == true && lnCheck[0] == lnCheck[1]) ? "" : " (mismatch)");
+	}
+
+	delete[] pnImageY;
+}
+
+
+/*
+	Golden-output regression and performance harness
+
+	regression_test() runs the engine on deterministic hazy frames and compares
+	the outputs with the golden outputs (golden_dir/<case>.png, the last frame of
+	a video case). The hazy frames are made by the haze model
+	I = J * t + A * (1 - t), with a transmission ramp (hazy at the top), from a
+	generated scene and from the bundled images, and the scene moves by 2 pixels
+	per frame.
+	A case fails when the PSNR is under REG_MIN_PSNR or the maximum error is over
+	REG_MAX_ERROR (8 bit levels), and when its golden output or its image is
+	missing. The mean time of the frames and of each stage (GetStageTime) is
+	written with the result to regression.csv, so a change is checked for the
+	output drift and the speed in one run.
+	The golden outputs are in Code/6_OCEDehazing/golden, and the paths are
+	relative to Code/6_OCEDehazing (run "dehazing --regression" there).
+	"dehazing --regression --record" writes all the golden outputs again, after
+	a change of the output was reviewed.
+ */
+#define REG_MIN_PSNR 45.0
+#define REG_MAX_ERROR 8.0
+#define REG_FRAMES 12
+
+// cases of the harness
+#define REG_VIDEO 0			// HazeRemoval, default settings
+#define REG_ROI 1			// HazeRemoval with a region of interest
+#define REG_COLOR 2			// TransColorMode
+#define REG_DARK 3			// TransDarkChannelMode
+#define REG_FIXED 4			// FixedPointMode
+#define REG_FAST_SMALL 5	// REFINE_FAST_SMALL
+#define REG_HIGHBIT 6		// HazeRemoval16, 12 bits
+#define REG_IMAGE 7			// ImageHazeRemoval
+#define REG_FIXED_SWITCH 8	// FixedPointMode from the frame 1 (switched in the stream)
+
+struct reg_case
+{
+	const char* name;
+	int mode;
+	int scene;				// 0: generated, 1 ~: reg_scene_path[scene - 1]
+};
+
+const char* reg_scene_path[] =
+{
+	"../../Data/fusion/apple.jpg",
+	"../../Data/2DTranslation/lazySheeps.png",
+};
+
+const reg_case reg_cases[] =
+{
+	{ "video", REG_VIDEO, 0 },
+	{ "video_apple", REG_VIDEO, 1 },
+	{ "roi", REG_ROI, 0 },
+	{ "color", REG_COLOR, 0 },
+	{ "dark", REG_DARK, 0 },
+	{ "fixed", REG_FIXED, 0 },
+	{ "fixed_switch", REG_FIXED_SWITCH, 0 },
+	{ "fast_small", REG_FAST_SMALL, 0 },
+	{ "highbit12", REG_HIGHBIT, 0 },
+	{ "image", REG_IMAGE, 0 },
+	{ "image_sheeps", REG_IMAGE, 2 },
+};
+
+// hazy frame of the scene (imSource, or a generated scene if it is empty), nBits > 8: CV_16UC3
+void reg_hazy_frame(const cv::Mat& imSource, int nWid, int nHei, int nFrame, int nBits, cv::Mat& imHazy)
+{
+	const float afAir[3] = { 235.0f, 238.0f, 242.0f };
+	const float fScale = (float)((1 << nBits) - 1) / 255.0f;
+	int nX, nY, nC;
+
+	imHazy.create(nHei, nWid, nBits > 8 ? CV_16UC3 : CV_8UC3);
+
+	for (nY = 0; nY < nHei; nY++)
+	{
+		float fTrans = 0.15f + 0.8f * (float)nY / (float)nHei;
+		for (nX = 0; nX < nWid; nX++)
+		{
+			int nXs = nX + 2 * nFrame;
+			uchar aucScene[3];
+			if (imSource.empty())
+			{
+				// blocks of 32 pixels with hashed colors, and a fine texture
+				unsigned int nHash = (unsigned int)((nXs >> 5) * 73856093 ^ (nY >> 5) * 19349663);
+				for (nC = 0; nC < 3; nC++)
+					aucScene[nC] = (uchar)(((nHash >> (nC * 8)) & 0x9f) + ((nXs + nY * 3 + nC * 5) & 15) * 4);
+			}
+			else
+			{
+				const uchar* pucSrc = imSource.ptr<uchar>(nY % imSource.rows) + (nXs % imSource.cols) * 3;
+				aucScene[0] = pucSrc[0];
+				aucScene[1] = pucSrc[1];
+				aucScene[2] = pucSrc[2];
+			}
+
+			for (nC = 0; nC < 3; nC++)
+			{
+				float fValue = ((float)aucScene[nC] * fTrans + afAir[nC] * (1.0f - fTrans)) * fScale + 0.5f;
+				if (nBits > 8)
+					imHazy.ptr<unsigned short>(nY)[nX * 3 + nC] = (unsigned short)fValue;
+				else
+					imHazy.ptr<uchar>(nY)[nX * 3 + nC] = (uchar)fValue;
+			}
+		}
+	}
+}
+
+// PSNR and maximum error (8 bit levels) of two images of the same size and type
+void reg_compare(const cv::Mat& imA, const cv::Mat& imB, int nBits, double& dPSNR, double& dMaxError)
+{
+	const double dPeak = (double)((1 << nBits) - 1);
+	double dSum = 0.0;
+	int nX, nY;
+
+	dMaxError = 0.0;
+	for (nY = 0; nY < imA.rows; nY++)
+	{
+		for (nX = 0; nX < imA.cols * 3; nX++)
+		{
+			double dDiff = nBits > 8
+				? (double)imA.ptr<unsigned short>(nY)[nX] - (double)imB.ptr<unsigned short>(nY)[nX]
+				: (double)imA.ptr<uchar>(nY)[nX] - (double)imB.ptr<uchar>(nY)[nX];
+			dSum += dDiff * dDiff;
+			dMaxError = __max(dMaxError, fabs(dDiff) * 255.0 / dPeak);
+		}
+	}
+
+	double dMSE = dSum / ((double)imA.rows * imA.cols * 3);
+	dPSNR = dMSE > 0 ? 10.0 * log10(dPeak * dPeak / dMSE) : 99.0;
+}
+
+int regression_test(bool bRecord)
+{
+	const char* golden_dir = "golden/";
+	const char* report_path = "regression.csv";
+	const int nWid = 640;
+	const int nHei = 480;
+	const int nCases = sizeof(reg_cases) / sizeof(reg_cases[0]);
+	int nFail = 0;
+	int nCase, nFrame, nStage;
+
+	if (bRecord == true)
+	{
+#ifdef _WIN32
+		_mkdir(golden_dir);
+#else
+		mkdir(golden_dir, 0755);
+#endif
+	}
+
+	FILE* fpReport = fopen(report_path, "w");
+	if (fpReport != NULL)
+		fprintf(fpReport, "case,result,psnr,max_error,frame_ms,prepare_ms,estimation_ms,refine_ms,restore_ms\n");
+
+	for (nCase = 0; nCase < nCases; nCase++)
+	{
+		const reg_case& stCase = reg_cases[nCase];
+		const int nBits = stCase.mode == REG_HIGHBIT ? 12 : 8;
+		const int nFrames = stCase.mode == REG_IMAGE ? 3 : REG_FRAMES;
+		cv::Mat imSource, imHazy, imOutput;
+		double dFrameMs = 0.0;
+		double adStageMs[STAGE_NUM] = { 0.0 };
+		int nTimed = 0;
+
+		if (stCase.scene > 0)
+		{
+			imSource = cv::imread(reg_scene_path[stCase.scene - 1]);
+			if (imSource.empty())
+			{
+				std::cout << stCase.name << ": FAIL (no " << reg_scene_path[stCase.scene - 1] << ")" << std::endl;
+				nFail++;
+				continue;
+			}
+		}
+
+		dehazing dehazingImg(nWid, nHei, 16, false, false, 5.0f, 1.0f, 40);
+		if (stCase.mode == REG_ROI)
+			dehazingImg.SetROI(cv::Rect(nWid / 5, nHei / 4, nWid / 2, nHei / 2));
+		else if (stCase.mode == REG_COLOR)
+			dehazingImg.TransColorMode(true);
+		else if (stCase.mode == REG_DARK)
+			dehazingImg.TransDarkChannelMode(true);
+		else if (stCase.mode == REG_FIXED)
+			dehazingImg.FixedPointMode(true);
+		else if (stCase.mode == REG_FAST_SMALL)
+			dehazingImg.RefineMethod(REFINE_FAST_SMALL);
+
+		// (1) the frames, timed after 2 frames
+		for (nFrame = 0; nFrame < nFrames; nFrame++)
+		{
+			if (stCase.mode == REG_FIXED_SWITCH && nFrame == 1)
+				dehazingImg.FixedPointMode(true);
+			reg_hazy_frame(imSource, nWid, nHei, stCase.mode == REG_IMAGE ? 0 : nFrame, nBits, imHazy);
+
+			double dStart = omp_get_wtime();
+			if (stCase.mode == REG_IMAGE)
+				dehazingImg.ImageHazeRemoval(imHazy, imOutput);
+			else if (stCase.mode == REG_HIGHBIT)
+				dehazingImg.HazeRemoval16(imHazy, imOutput, nBits, nFrame);
+			else
+				dehazingImg.HazeRemoval(imHazy, imOutput, nFrame);
+			double dMs = (omp_get_wtime() - dStart) * 1000.0;
+
+			if (nFrame >= 2 || nFrames < 3)
+			{
+				dFrameMs += dMs;
+				for (nStage = 0; nStage < STAGE_NUM; nStage++)
+					adStageMs[nStage] += dehazingImg.GetStageTime(nStage);
+				nTimed++;
+			}
+		}
+		dFrameMs /= nTimed;
+		for (nStage = 0; nStage < STAGE_NUM; nStage++)
+			adStageMs[nStage] /= nTimed;
+
+		// (2) the golden output of the last frame
+		std::string strGolden = std::string(golden_dir) + stCase.name + ".png";
+		const char* result;
+		double dPSNR = 0.0, dMaxError = 0.0;
+		cv::Mat imGolden;
+		if (bRecord == false)
+			imGolden = cv::imread(strGolden, cv::IMREAD_UNCHANGED);
+
+		if (bRecord == true)
+		{
+			result = cv::imwrite(strGolden, imOutput) ? "RECORD" : "FAIL (not recorded)";
+			if (result[0] == 'F')
+				nFail++;
+		}
+		else if (imGolden.empty())
+		{
+			result = "FAIL (no golden)";
+			nFail++;
+		}
+		else if (imGolden.size() != imOutput.size() || imGolden.type() != imOutput.type())
+		{
+			result = "FAIL (size)";
+			nFail++;
+		}
+		else
+		{
+			reg_compare(imOutput, imGolden, nBits, dPSNR, dMaxError);
+			result = (dPSNR >= REG_MIN_PSNR && dMaxError <= REG_MAX_ERROR) ? "PASS" : "FAIL";
+			if (result[0] == 'F')
+				nFail++;
+		}
+
+		printf("%-14s %-20s PSNR %6.2f dB  max %5.1f  %7.2f ms (prepare %.2f, estimation %.2f, refine %.2f, restore %.2f)\n",
+			stCase.name, result, dPSNR, dMaxError, dFrameMs, adStageMs[STAGE_PREPARE], adStageMs[STAGE_ESTIMATION], adStageMs[STAGE_REFINE], adStageMs[STAGE_RESTORE]);
+		if (fpReport != NULL)
+			fprintf(fpReport, "%s,%s,%.2f,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f\n", stCase.name, result, dPSNR, dMaxError,
+				dFrameMs, adStageMs[STAGE_PREPARE], adStageMs[STAGE_ESTIMATION], adStageMs[STAGE_REFINE], adStageMs[STAGE_RESTORE]);
+	}
+
+	if (fpReport != NULL)
+		fclose(fpReport);
+
+	std::cout << nCases << " cases, " << nFail << " failed" << std::endl;
+	return nFail;
+}
+
 
 int main(int argc, char** argv)
 {
+	// dehazing --regression [--record]: golden-output regression (regression_test)
+	// dehazing --benchmark: block sums of the transmission estimation
+	if (argc > 1 && strcmp(argv[1], "--regression") == 0)
+		return regression_test(argc > 2 && strcmp(argv[2], "--record") == 0) == 0 ? 0 : 1;
+	if (argc > 1 && strcmp(argv[1], "--benchmark") == 0)
+	{
+		benchmark_transmission_kernels(50);
+		return 0;
+	}
+
 	video_test(argv);
 	//image_test();
 
@@ -0,0 +1,242 @@
+/*
+	This source file contains the frame ring of the video dehazing.
+
+	The capture thread (producer) and the thread calling HazeRemoval (consumer)
+	exchange the frames through a ring of preallocated frames of the engine size,
+	without a lock and without an allocation per frame:
+		producer	AcquireSlot		lend a free frame, which is filled in place
+					PublishSlot		queue the frame with its timestamp
+		consumer	TakeFrame		lend the oldest queued frame (HazeRemoval)
+					ReleaseFrame	return the frame to the free list
+	The frames are lent, not copied. One frame at a time is lent to each side.
+	The frames are numbered by the consumer in the order they are taken, hence
+	the first frame which reaches HazeRemoval is the frame 0 (a dropped frame
+	never reaches it).
+
+	The ring is two single-producer/single-consumer queues of the frame indices:
+		m_pnQueue	published frames (producer -> consumer)
+		m_pnFree	released frames (consumer -> producer)
+	Each index is written before the position is stored (release) and read after
+	the position is loaded (acquire). All the frames are in one of the queues or
+	lent, hence neither queue overflows, and at most nSlots - 1 frames wait.
+
+	When no frame is free, all the other frames are queued (the consumer is slow):
+		RING_DROP_OLDEST	the producer takes the oldest queued frame back. The
+							consumer takes the same position by compare-and-swap,
+							hence exactly one of them gets the frame.
+		RING_BLOCK			the producer waits until a frame is released.
+	The waiting (RING_BLOCK, TakeFrame with bWait) yields, then sleeps 100 us.
+ */
+
+#include "dehazing.h"
+
+/*
+	Function: RingWait
+	Description: back off while the ring is waited on.
+	Parameters:
+		nCount - number of the previous tries
+ */
+static void RingWait(int nCount)
+{
+	if (nCount < 64)
+		std::this_thread::yield();
+	else
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+}
+
+/*
+	Function: FrameRing
+	Description: allocate the frames (CV_8UC3 of the frame size of the engine).
+	Parameters:
+		engine - engine which dehazes the frames (after Reconfigure, make a new ring)
+		nSlots - number of the frames (>= 3: one lent to each side and one queued)
+		nPolicy - RING_DROP_OLDEST or RING_BLOCK
+ */
+FrameRing::FrameRing(dehazing& engine, int nSlots, int nPolicy)
+{
+	int nK;
+
+	m_nSlots = __max(nSlots, 3);
+	m_nPolicy = nPolicy;
+	m_pimSlot = new cv::Mat[m_nSlots];
+	m_pdTimestamp = new double[m_nSlots];
+	m_pnQueue = new std::atomic<int>[m_nSlots];
+	m_pnFree = new std::atomic<int>[m_nSlots];
+	for (nK = 0; nK < m_nSlots; nK++)
+	{
+		m_pimSlot[nK].create(engine.GetHeight(), engine.GetWidth(), CV_8UC3);
+		m_pdTimestamp[nK] = 0.0;
+		m_pnQueue[nK].store(0, std::memory_order_relaxed);
+		m_pnFree[nK].store(nK, std::memory_order_relaxed);
+	}
+
+	// all the frames are free
+	m_nHead.store(0);
+	m_nTail.store(0);
+	m_nFreeHead.store(m_nSlots);
+	m_nFreeTail.store(0);
+	m_nProducerSlot = -1;
+	m_nConsumerSlot = -1;
+	m_nTaken = 0;
+	m_nDropped.store(0);
+	m_bClosed.store(false);
+}
+
+FrameRing::~FrameRing(void)
+{
+	delete[] m_pimSlot;
+	delete[] m_pdTimestamp;
+	delete[] m_pnQueue;
+	delete[] m_pnFree;
+}
+
+/*
+	Function: AcquireSlot
+	Description: (producer) lend a free frame to be filled. The frame keeps its
+		size and type, so the capture which reads into it does not allocate
+		(e.g. cv::VideoCapture::read). The same frame is returned until PublishSlot.
+	Return:
+		frame (NULL: the ring is closed)
+ */
+cv::Mat* FrameRing::AcquireSlot()
+{
+	int nCount = 0;
+
+	if (m_nProducerSlot >= 0)
+		return &m_pimSlot[m_nProducerSlot];
+
+	for (;;)
+	{
+		if (m_bClosed.load(std::memory_order_acquire) == true)
+			return NULL;
+
+		// (1) a released frame
+		long long nFreeTail = m_nFreeTail.load(std::memory_order_relaxed);
+		if (nFreeTail < m_nFreeHead.load(std::memory_order_acquire))
+		{
+			m_nProducerSlot = m_pnFree[nFreeTail % m_nSlots].load(std::memory_order_relaxed);
+			m_nFreeTail.store(nFreeTail + 1, std::memory_order_release);
+			break;
+		}
+
+		// (2) the oldest queued frame, unless the consumer takes it first
+		if (m_nPolicy == RING_DROP_OLDEST)
+		{
+			long long nTail = m_nTail.load(std::memory_order_acquire);
+			if (nTail < m_nHead.load(std::memory_order_relaxed))
+			{
+				int nSlot = m_pnQueue[nTail % m_nSlots].load(std::memory_order_relaxed);
+				if (m_nTail.compare_exchange_strong(nTail, nTail + 1, std::memory_order_acq_rel))
+				{
+					m_nProducerSlot = nSlot;
+					m_nDropped.fetch_add(1, std::memory_order_relaxed);
+					break;
+				}
+				continue;
+			}
+		}
+
+		RingWait(nCount++);
+	}
+
+	return &m_pimSlot[m_nProducerSlot];
+}
+
+/*
+	Function: PublishSlot
+	Description: (producer) queue the filled frame.
+	Parameters:
+		dTimestamp - timestamp of the frame
+ */
+void FrameRing::PublishSlot(double dTimestamp)
+{
+	if (m_nProducerSlot < 0)
+		return;
+
+	m_pdTimestamp[m_nProducerSlot] = dTimestamp;
+
+	long long nHead = m_nHead.load(std::memory_order_relaxed);
+	m_pnQueue[nHead % m_nSlots].store(m_nProducerSlot, std::memory_order_relaxed);
+	m_nHead.store(nHead + 1, std::memory_order_release);
+	m_nProducerSlot = -1;
+}
+
+/*
+	Function: TakeFrame
+	Description: (consumer) lend the oldest queued frame. The previous frame is
+		released first (ReleaseFrame).
+	Parameters:
+		bWait - wait for a frame until the ring is closed
+	Return:
+		frame (NULL: no frame)
+		pdTimestamp - timestamp of the frame (PublishSlot)
+		pnFrame - frame number for HazeRemoval, counted from 0 in the order of the
+			taken frames (the dropped frames are not counted)
+ */
+cv::Mat* FrameRing::TakeFrame(double* pdTimestamp, int* pnFrame, bool bWait)
+{
+	int nCount = 0;
+
+	ReleaseFrame();
+
+	for (;;)
+	{
+		long long nTail = m_nTail.load(std::memory_order_acquire);
+		if (nTail == m_nHead.load(std::memory_order_acquire))
+		{
+			if (bWait == false || m_bClosed.load(std::memory_order_acquire) == true)
+				return NULL;
+			RingWait(nCount++);
+			continue;
+		}
+
+		// the position is taken again if the producer drops the frame meanwhile
+		int nSlot = m_pnQueue[nTail % m_nSlots].load(std::memory_order_relaxed);
+		if (m_nTail.compare_exchange_strong(nTail, nTail + 1, std::memory_order_acq_rel))
+		{
+			m_nConsumerSlot = nSlot;
+			break;
+		}
+	}
+
+	if (pdTimestamp != NULL)
+		*pdTimestamp = m_pdTimestamp[m_nConsumerSlot];
+	if (pnFrame != NULL)
+		*pnFrame = m_nTaken;
+	m_nTaken++;
+	return &m_pimSlot[m_nConsumerSlot];
+}
+
+/*
+	Function: ReleaseFrame
+	Description: (consumer) return the taken frame to the producer.
+ */
+void FrameRing::ReleaseFrame()
+{
+	if (m_nConsumerSlot < 0)
+		return;
+
+	long long nFreeHead = m_nFreeHead.load(std::memory_order_relaxed);
+	m_pnFree[nFreeHead % m_nSlots].store(m_nConsumerSlot, std::memory_order_relaxed);
+	m_nFreeHead.store(nFreeHead + 1, std::memory_order_release);
+	m_nConsumerSlot = -1;
+}
+
+/*
+	Function: Close
+	Description: stop the exchange. AcquireSlot returns NULL, and TakeFrame
+		returns the queued frames, then NULL.
+ */
+void FrameRing::Close()
+{
+	m_bClosed.store(true, std::memory_order_release);
+}
+
+/*
+	Function:GetDropped
+	Return: number of the frames dropped by RING_DROP_OLDEST
+ */
+long long FrameRing::GetDropped()
+{
+	return m_nDropped.load(std::memory_order_relaxed);
+}
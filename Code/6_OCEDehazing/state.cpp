@@ -0,0 +1,367 @@
+/*
+	This source file contains the persisted temporal state of the video dehazing.
+
+	A fixed camera sees the same scene after a restart, hence the temporal
+	information of the last frame (m_pnSmallYImgP, m_pfSmallTransP) and the
+	atmospheric light are kept in a memory-mapped file per camera
+	(PersistState). The state is written every nPeriod estimated frames
+	(about 230 KB per write), and when the file is closed (CloseState, the
+	destructor) or the engine is reconfigured.
+	At the next start, the stored state is loaded: the first frame is estimated
+	with the temporal information of the stored frame, and the estimation of
+	the atmospheric light is skipped.
+
+	Layout of the file (2 slots of STATE_SLOT_SIZE bytes):
+		StateHeader
+		transmission	320*240 unsigned short, Q12 (the same as fixedpoint.cpp)
+		Y image			320*240 unsigned char
+	The writes alternate between the slots, and each slot is written back to
+	the disk (msync, FlushViewOfFile and FlushFileBuffers) before the other
+	one is overwritten, hence one slot always holds a complete state. A slot
+	is loaded only if the CRC-32 of its data matches, and of two valid slots
+	the one with the newer sequence number is loaded. A slot which was not
+	completely written (e.g. power loss) fails the CRC, whatever the order
+	in which its pages reached the disk.
+
+	The color transmission (TransColorMode) does not use the stored state,
+	since the R, G, B images are not stored, but the atmospheric light is.
+ */
+
+#include "dehazing.h"
+#include <stddef.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define STATE_MAGIC "DHZSTAT2"
+
+struct StateHeader
+{
+	char	acMagic[8];			// STATE_MAGIC
+	unsigned int nSequence;		// incremented by each write
+	unsigned int nCRC;			// CRC-32 of the slot from nWid to the end of the Y image
+	int		nWid;				// frame size of the stored state
+	int		nHei;
+	int		anAirlight[3];		// atmospheric light (B, G, R)
+	char	acCameraID[64];		// camera ID (truncated)
+};
+
+#define STATE_CRC_OFFSET offsetof(StateHeader, nWid)
+#define STATE_TRANS_OFFSET sizeof(StateHeader)
+#define STATE_Y_OFFSET (STATE_TRANS_OFFSET + 320 * 240 * sizeof(unsigned short))
+#define STATE_DATA_SIZE (STATE_Y_OFFSET + 320 * 240)
+// the slots are aligned to 64 KB, which is a multiple of the page size (msync)
+#define STATE_SLOT_SIZE ((STATE_DATA_SIZE + 65535) / 65536 * 65536)
+#define STATE_FILE_SIZE (STATE_SLOT_SIZE * 2)
+
+/*
+	Function: StateCRC
+	Description: CRC-32 (reflected polynomial 0xEDB88320) of a slot.
+	Parameters:
+		pucData - data
+		nSize - size of the data
+	Return:
+		CRC
+ */
+static unsigned int StateCRC(const uchar* pucData, size_t nSize)
+{
+	// the table is made at the first call
+	static const struct CRCTable
+	{
+		unsigned int anCRC[256];
+		CRCTable()
+		{
+			for (unsigned int nI = 0; nI < 256; nI++)
+			{
+				unsigned int nCRC = nI;
+				for (int nBit = 0; nBit < 8; nBit++)
+					nCRC = (nCRC & 1) ? (nCRC >> 1) ^ 0xEDB88320u : nCRC >> 1;
+				anCRC[nI] = nCRC;
+			}
+		}
+	} stTable;
+
+	unsigned int nCRC = 0xFFFFFFFFu;
+	for (size_t nK = 0; nK < nSize; nK++)
+		nCRC = stTable.anCRC[(nCRC ^ pucData[nK]) & 0xFF] ^ (nCRC >> 8);
+	return nCRC ^ 0xFFFFFFFFu;
+}
+
+/*
+	Function: MapStateFile
+	Description: open (or create) the file and map STATE_FILE_SIZE bytes of it.
+		The mapping and (on Windows) the file handle are kept until UnmapStateFile.
+	Parameters:
+		strPath - path of the file
+	Return:
+		mapped file (NULL: failed)
+		phFile - handle of the file (Windows, NULL otherwise)
+ */
+static uchar* MapStateFile(const std::string& strPath, void** phFile)
+{
+	uchar* pucMap = NULL;
+	*phFile = NULL;
+#ifdef _WIN32
+	HANDLE hFile = CreateFileA(strPath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return NULL;
+	// the mapping extends the file to the size
+	HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READWRITE, 0, (DWORD)STATE_FILE_SIZE, NULL);
+	if (hMapping != NULL)
+	{
+		pucMap = (uchar*)MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, STATE_FILE_SIZE);
+		CloseHandle(hMapping);
+	}
+	if (pucMap == NULL)
+		CloseHandle(hFile);
+	else
+		*phFile = hFile;
+#else
+	int nFile = open(strPath.c_str(), O_RDWR | O_CREAT, 0644);
+	if (nFile < 0)
+		return NULL;
+	if (ftruncate(nFile, STATE_FILE_SIZE) == 0)
+	{
+		void* pMap = mmap(NULL, STATE_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, nFile, 0);
+		if (pMap != MAP_FAILED)
+			pucMap = (uchar*)pMap;
+	}
+	close(nFile);
+#endif
+	return pucMap;
+}
+
+/*
+	Function: SyncStateSlot
+	Description: write a slot back to the disk, and wait for it.
+	Parameters:
+		pucSlot - slot in the mapped file
+		hFile - handle of the file (Windows)
+ */
+static void SyncStateSlot(uchar* pucSlot, void* hFile)
+{
+#ifdef _WIN32
+	FlushViewOfFile(pucSlot, STATE_SLOT_SIZE);
+	FlushFileBuffers((HANDLE)hFile);
+#else
+	(void)hFile;
+	msync(pucSlot, STATE_SLOT_SIZE, MS_SYNC);
+#endif
+}
+
+/*
+	Function: UnmapStateFile
+	Description: unmap the file (MapStateFile), the slots are already written back.
+	Parameters:
+		pucMap - mapped file
+		hFile - handle of the file (Windows)
+ */
+static void UnmapStateFile(uchar* pucMap, void* hFile)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(pucMap);
+	CloseHandle((HANDLE)hFile);
+#else
+	(void)hFile;
+	munmap(pucMap, STATE_FILE_SIZE);
+#endif
+}
+
+/*
+	Function: PersistState
+	Description: keep the temporal state of the video dehazing in the file of the
+		camera, "<directory>/dehazing_<camera ID>.state". The characters of the
+		ID other than letters, digits, '-' and '_' are replaced by '_' in the name.
+		A valid state of the same camera and frame size is loaded, and used by the
+		next frame 0 (call it before the first frame). The state is written every
+		nPeriod estimated frames afterwards, and when the file is closed.
+	Parameters:
+		pszCameraID - ID of the camera (NULL: close the file)
+		pszDirectory - directory of the file (NULL: ".")
+		nPeriod - estimated frames between the writes (1 ~)
+	Return:
+		true if the stored state is loaded
+ */
+bool dehazing::PersistState(const char* pszCameraID, const char* pszDirectory, int nPeriod)
+{
+	int nK, nSlot;
+
+	CloseState();
+	m_bStateWarm = false;
+	if (pszCameraID == NULL)
+		return false;
+	if (pszDirectory == NULL)
+		pszDirectory = ".";
+
+	std::string strName = pszCameraID;
+	for (nK = 0; nK < (int)strName.size(); nK++)
+	{
+		char c = strName[nK];
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_'))
+			strName[nK] = '_';
+	}
+	std::string strPath = std::string(pszDirectory) + "/dehazing_" + strName + ".state";
+
+	m_pucState = MapStateFile(strPath, &m_hStateFile);
+	if (m_pucState == NULL)
+		return false;
+
+	m_strStateCamera = pszCameraID;
+	m_nStatePeriod = __max(nPeriod, 1);
+	m_nStateFrames = 0;
+
+	// the newest valid slot of the camera and frame size. A new file is filled
+	// with 0, hence it is not valid. The state of another camera or frame size
+	// is overwritten by the next writes
+	int nLoad = -1;
+	for (nSlot = 0; nSlot < 2; nSlot++)
+	{
+		uchar* pucSlot = m_pucState + nSlot * STATE_SLOT_SIZE;
+		StateHeader* pstHeader = (StateHeader*)pucSlot;
+		if (memcmp(pstHeader->acMagic, STATE_MAGIC, 8) != 0
+			|| pstHeader->nWid != m_nWid || pstHeader->nHei != m_nHei
+			|| strncmp(pstHeader->acCameraID, pszCameraID, sizeof(pstHeader->acCameraID) - 1) != 0
+			|| pstHeader->nCRC != StateCRC(pucSlot + STATE_CRC_OFFSET, STATE_DATA_SIZE - STATE_CRC_OFFSET))
+			continue;
+
+		// the sequence number wraps around
+		if (nLoad < 0 || (int)(pstHeader->nSequence - m_nStateSequence) > 0)
+		{
+			nLoad = nSlot;
+			m_nStateSequence = pstHeader->nSequence;
+		}
+	}
+
+	if (nLoad < 0)
+	{
+		m_nStateSequence = 0;
+		m_nStateSlot = 0;
+		return false;
+	}
+	m_nStateSlot = 1 - nLoad;
+
+	uchar* pucSlot = m_pucState + nLoad * STATE_SLOT_SIZE;
+	StateHeader* pstHeader = (StateHeader*)pucSlot;
+	unsigned short* pusTrans = (unsigned short*)(pucSlot + STATE_TRANS_OFFSET);
+	uchar* pucY = pucSlot + STATE_Y_OFFSET;
+	for (nK = 0; nK < 320 * 240; nK++)
+	{
+		m_pfSmallTransP[nK] = (float)pusTrans[nK] / (float)TRS_ONE;
+		m_pnSmallYImgP[nK] = pucY[nK];
+	}
+	m_anAirlight[0] = pstHeader->anAirlight[0];
+	m_anAirlight[1] = pstHeader->anAirlight[1];
+	m_anAirlight[2] = pstHeader->anAirlight[2];
+
+	// the blocks are estimated (with the stored state) at the first frame
+	if (m_pucBlockAge != NULL)
+		memset(m_pucBlockAge, 255, 320 * 240);
+
+	m_bStateWarm = true;
+	return true;
+}
+
+/*
+	Function: StoreState
+	Description: count an estimated frame, and write its temporal state to the
+		file every m_nStatePeriod frames. The transmission is given as float or
+		as Q12 (fixedpoint.cpp).
+	Parameters:
+		pnSmallYImg - down-sampled Y image
+		pfSmallTrans - transmission (NULL: pnSmallTransQ)
+		pnSmallTransQ - Q12 transmission
+ */
+void dehazing::StoreState(int* pnSmallYImg, float* pfSmallTrans, int* pnSmallTransQ)
+{
+	m_bStateFixed = pfSmallTrans == NULL;
+	if (++m_nStateFrames < m_nStatePeriod)
+		return;
+
+	WriteState(pnSmallYImg, pfSmallTrans, pnSmallTransQ);
+}
+
+/*
+	Function: WriteState
+	Description: write a temporal state to the older slot, and write the slot
+		back to the disk. The next write uses the other slot.
+	Parameters:
+		pnSmallYImg - down-sampled Y image
+		pfSmallTrans - transmission (NULL: pnSmallTransQ)
+		pnSmallTransQ - Q12 transmission
+ */
+void dehazing::WriteState(int* pnSmallYImg, float* pfSmallTrans, int* pnSmallTransQ)
+{
+	int nK;
+	uchar* pucSlot = m_pucState + m_nStateSlot * STATE_SLOT_SIZE;
+	StateHeader* pstHeader = (StateHeader*)pucSlot;
+	unsigned short* pusTrans = (unsigned short*)(pucSlot + STATE_TRANS_OFFSET);
+	uchar* pucY = pucSlot + STATE_Y_OFFSET;
+
+	if (pfSmallTrans != NULL)
+	{
+		for (nK = 0; nK < 320 * 240; nK++)
+			pusTrans[nK] = (unsigned short)(pfSmallTrans[nK] * (float)TRS_ONE + 0.5f);
+	}
+	else
+	{
+		for (nK = 0; nK < 320 * 240; nK++)
+			pusTrans[nK] = (unsigned short)pnSmallTransQ[nK];
+	}
+	for (nK = 0; nK < 320 * 240; nK++)
+		pucY[nK] = (uchar)pnSmallYImg[nK];
+
+	memset(pstHeader, 0, sizeof(StateHeader));
+	memcpy(pstHeader->acMagic, STATE_MAGIC, 8);
+	pstHeader->nWid = m_nWid;
+	pstHeader->nHei = m_nHei;
+	pstHeader->anAirlight[0] = m_anAirlight[0];
+	pstHeader->anAirlight[1] = m_anAirlight[1];
+	pstHeader->anAirlight[2] = m_anAirlight[2];
+	strncpy(pstHeader->acCameraID, m_strStateCamera.c_str(), sizeof(pstHeader->acCameraID) - 1);
+	pstHeader->nSequence = ++m_nStateSequence;
+	pstHeader->nCRC = StateCRC(pucSlot + STATE_CRC_OFFSET, STATE_DATA_SIZE - STATE_CRC_OFFSET);
+
+	SyncStateSlot(pucSlot, m_hStateFile);
+
+	m_nStateSlot = 1 - m_nStateSlot;
+	m_nStateFrames = 0;
+}
+
+/*
+	Function: FlushState
+	Description: write the state of the last estimated frame (the temporal
+		information of the next frame) if it is not written yet.
+ */
+void dehazing::FlushState()
+{
+	if (m_pucState == NULL || m_nStateFrames == 0)
+		return;
+
+	if (m_bStateFixed == true)
+		WriteState(m_pnSmallYImgP, NULL, m_pnSmallTransQP);
+	else
+		WriteState(m_pnSmallYImgP, m_pfSmallTransP, NULL);
+}
+
+/*
+	Function: CloseState
+	Description: write the last state and unmap the file of PersistState
+		(the state is kept in the file).
+ */
+void dehazing::CloseState()
+{
+	if (m_pucState == NULL)
+		return;
+
+	FlushState();
+	UnmapStateFile(m_pucState, m_hStateFile);
+	m_pucState = NULL;
+	m_hStateFile = NULL;
+	m_strStateCamera.clear();
+}
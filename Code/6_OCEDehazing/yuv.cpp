@@ -0,0 +1,321 @@
+/*
+	This source file contains the YUV 4:2:0 front end of the video dehazing.
+
+	The frames of the video decoders (I420, NV12) are dehazed without the
+	conversion to BGR. The layout follows OpenCV, a CV_8UC1 image of
+	width * (height * 3 / 2):
+		YUV_I420	Y plane (height rows of step bytes),
+					U plane and V plane (height / 2 rows of step / 2 bytes each)
+		YUV_NV12	Y plane (height rows of step bytes),
+					UV plane (height / 2 rows of step bytes, U and V interleaved)
+	The samples are BT.601 limited range, the same as the Y of the atmospheric
+	light (m_nAirlight).
+
+	The transmission is estimated on the luma plane (IplImageToIntYUV), and the
+	restoration is applied in YUV (RestoreImageYUV). The luma and the chroma are
+	restored with the atmospheric light in YUV, which is the same as the
+	restoration in RGB since YUV is an affine transform of RGB. The chroma uses
+	the mean transmission of the 2*2 luma pixels, and the output tone
+	(OutputTone) is applied to the luma.
+	Only the search range of the atmospheric light is converted to BGR, at the
+	first frame.
+
+	The limitations of the YUV frames (refinement, post processing,
+	FixedPointMode, SubmitFrame) are listed in RestorationStage (dehazing.cpp).
+ */
+
+#include "dehazing.h"
+
+/*
+	Function: HazeRemovalYUV
+	Description: haze removal process of a YUV 4:2:0 frame (video dehazing).
+		imOutput may be imInput (in-place). An empty output is allocated.
+
+	Parameter:
+		imInput - input image (CV_8UC1, width * (height * 3 / 2))
+		nFormat - YUV_I420 or YUV_NV12 (the same for the output)
+		nFrame - frame number
+	Return:
+		imOutput - output image
+ */
+void dehazing::HazeRemovalYUV(cv::Mat& imInput, cv::Mat& imOutput, int nFormat, int nFrame)
+{
+	if (CheckFrameYUV(imInput, imOutput, nFormat) == false)
+		return;
+
+	m_nYUVFormat = nFormat;
+	int nEstFrame = PrepareFrame(imInput, nFrame);
+
+	double dStart = omp_get_wtime();
+
+	float fStrength = EstimationStage(imInput, nEstFrame, m_pnYImg, m_pnSmallYImg, m_pfSmallTrans);
+	RestorationStage(imInput, imOutput, fStrength);
+
+	// the settings of the next frame (the bypassed frames are not measured)
+	if (m_bGovernor == true && fStrength > 0)
+		GovernorUpdate((float)((omp_get_wtime() - dStart) * 1000.0));
+}
+
+/*
+	Function: HazeRemovalYUV
+	Description: haze removal process of the external buffers (YUV 4:2:0).
+		The buffers are wrapped without copy, and pucOutput may be pucInput (in-place).
+
+	Parameter:
+		pucInput - input image
+		nInputStep - bytes per row of the input Y plane
+		nOutputStep - bytes per row of the output Y plane
+		nFormat - YUV_I420 or YUV_NV12
+		nFrame - frame number
+	Return:
+		pucOutput - output image
+ */
+void dehazing::HazeRemovalYUV(uchar* pucInput, int nInputStep, uchar* pucOutput, int nOutputStep, int nFormat, int nFrame)
+{
+	cv::Mat imInput(m_nHei * 3 / 2, m_nWid, CV_8UC1, pucInput, nInputStep);
+	cv::Mat imOutput(m_nHei * 3 / 2, m_nWid, CV_8UC1, pucOutput, nOutputStep);
+
+	HazeRemovalYUV(imInput, imOutput, nFormat, nFrame);
+}
+
+/*
+	Function: CheckFrameYUV
+	Description: check the size and the layout of the YUV input and output images.
+	Parameter:
+		imInput - input image
+		imOutput - output image
+		nFormat - YUV_I420 or YUV_NV12
+	Return:
+		true if the images can be processed
+ */
+bool dehazing::CheckFrameYUV(cv::Mat& imInput, cv::Mat& imOutput, int nFormat)
+{
+	if (nFormat != YUV_I420 && nFormat != YUV_NV12)
+	{
+		printf("Unknown YUV format %d\n", nFormat);
+		return false;
+	}
+
+	if (m_bFixedPoint == true)
+	{
+		printf("The integer only path does not support the YUV input.\n");
+		return false;
+	}
+
+	if ((m_nWid & 1) != 0 || (m_nHei & 1) != 0)
+	{
+		printf("The YUV 4:2:0 frame must have an even width and height.\n");
+		return false;
+	}
+
+	if (imInput.cols != m_nWid || imInput.rows != m_nHei * 3 / 2 || imInput.type() != CV_8UC1
+		|| (nFormat == YUV_I420 && (imInput.step & 1) != 0))
+	{
+		printf("The input image must be %dx%d CV_8UC1.\n", m_nWid, m_nHei * 3 / 2);
+		return false;
+	}
+
+	if (imOutput.empty())
+		imOutput.create(m_nHei * 3 / 2, m_nWid, CV_8UC1);
+	else if (imOutput.cols != m_nWid || imOutput.rows != m_nHei * 3 / 2 || imOutput.type() != CV_8UC1
+		|| (nFormat == YUV_I420 && (imOutput.step & 1) != 0))
+	{
+		printf("The output image must be %dx%d CV_8UC1.\n", m_nWid, m_nHei * 3 / 2);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+	Function: YUVPixelToBGR
+	Description: convert a pixel of the YUV frame to BGR (BT.601 limited range).
+	Parameter:
+		imInput - YUV image (m_nYUVFormat)
+		nX, nY - position of the pixel
+	Return:
+		pucBGR - B, G, R of the pixel
+ */
+void dehazing::YUVPixelToBGR(cv::Mat& imInput, int nX, int nY, uchar* pucBGR)
+{
+	const size_t nStepC = m_nYUVFormat == YUV_NV12 ? imInput.step : imInput.step / 2;
+	const int nPitch = m_nYUVFormat == YUV_NV12 ? 2 : 1;
+	uchar* pucU = imInput.data + m_nHei * imInput.step + (nY >> 1) * nStepC + (nX >> 1) * nPitch;
+	uchar* pucV = m_nYUVFormat == YUV_NV12 ? pucU + 1 : pucU + (m_nHei / 2) * nStepC;
+
+	int nC = 298 * (imInput.ptr<uchar>(nY)[nX] - 16);
+	int nD = *pucU - 128;
+	int nE = *pucV - 128;
+
+	pucBGR[0] = (uchar)CLIP((nC + 516 * nD + 128) >> 8);
+	pucBGR[1] = (uchar)CLIP((nC - 100 * nD - 208 * nE + 128) >> 8);
+	pucBGR[2] = (uchar)CLIP((nC + 409 * nE + 128) >> 8);
+}
+
+/*
+	Function: YUVRegionToBGR
+	Description: convert a region of the YUV frame to BGR (BT.601 limited range),
+		for the estimation of the atmospheric light.
+	Parameter:
+		imInput - YUV image (m_nYUVFormat)
+		rectRegion - region of the frame
+	Return:
+		imBGR - BGR image of the region
+ */
+void dehazing::YUVRegionToBGR(cv::Mat& imInput, cv::Rect rectRegion, cv::Mat& imBGR)
+{
+	int nX, nY;
+
+	imBGR.create(rectRegion.height, rectRegion.width, CV_8UC3);
+
+	for (nY = 0; nY < rectRegion.height; nY++)
+	{
+		uchar* outptr = imBGR.ptr<uchar>(nY);
+		for (nX = 0; nX < rectRegion.width; nX++)
+			YUVPixelToBGR(imInput, rectRegion.x + nX, rectRegion.y + nY, outptr + nX * 3);
+	}
+}
+
+/*
+	Function: RestoreImageYUV
+	Description: Dehazed the YUV frame using estimated transmission and atmospheric light.
+		Two luma rows and the chroma row between them are restored together.
+		With a region of interest, the luma pixels out of the ROI and the
+		chroma samples of which the top left luma pixel is out of the ROI are
+		copied from the input.
+	Parameter:
+		imInput - Input hazy image.
+	Return:
+		imOutput - Dehazed image.
+ */
+void dehazing::RestoreImageYUV(cv::Mat& imInput, cv::Mat& imOutput)
+{
+	int nX, nY;
+	bool bDeferred = m_bTransDeferred == true && m_bTransValid == false;
+	const float fStrength = m_fRestoreStrength;
+	const bool bBlend = fStrength < 1.0f;
+	uchar aucTone[256];
+	const uchar* pucTone = m_pucGammaLUT;
+
+	if (bBlend == true)
+	{
+		for (nX = 0; nX < 256; nX++)
+			aucTone[nX] = (uchar)((float)nX + fStrength * (float)(m_pucGammaLUT[nX] - nX) + 0.5f);
+		pucTone = aucTone;
+	}
+
+	// atmospheric light in YUV (BT.601 limited range, the same as m_nAirlight)
+	const int nA_B = m_anAirlight[0], nA_G = m_anAirlight[1], nA_R = m_anAirlight[2];
+	const float fA_Y = (float)m_nAirlight;
+	const float fA_U = (float)(((-38 * nA_R - 74 * nA_G + 112 * nA_B + 128) >> 8) + 128);
+	const float fA_V = (float)(((112 * nA_R - 94 * nA_G - 18 * nA_B + 128) >> 8) + 128);
+
+	// chroma planes
+	const bool bNV12 = m_nYUVFormat == YUV_NV12;
+	const int nPitch = bNV12 ? 2 : 1;
+	const size_t nInStepC = bNV12 ? imInput.step : imInput.step / 2;
+	const size_t nOutStepC = bNV12 ? imOutput.step : imOutput.step / 2;
+	uchar* pucInU = imInput.data + m_nHei * imInput.step;
+	uchar* pucInV = bNV12 ? pucInU + 1 : pucInU + (m_nHei / 2) * nInStepC;
+	uchar* pucOutU = imOutput.data + m_nHei * imOutput.step;
+	uchar* pucOutV = bNV12 ? pucOutU + 1 : pucOutU + (m_nHei / 2) * nOutStepC;
+
+#pragma omp parallel private(nX) num_threads(__min(omp_get_max_threads(), m_nTransRowThreads))
+	{
+		// refined transmission of two rows
+		float* pfTransRow = bDeferred == true ? m_pfTransRows + omp_get_thread_num() * m_nCapLine * 2 : NULL;
+
+#pragma omp for
+		for (nY = 0; nY < m_nHei / 2; nY++)
+		{
+			float* apfTrans[2];
+			uchar* apucMask[2] = { NULL, NULL };
+			int anStartX[2] = { 0, 0 };
+			int anEndX[2] = { m_nWid, m_nWid };
+			int nI;
+
+			// (1) transmission of the two rows (the union of the ROI spans)
+			for (nI = 0; nI < 2; nI++)
+			{
+				int nRow = 2 * nY + nI;
+				if (m_bROIFlag == true)
+				{
+					anStartX[nI] = m_pnROISpan[nRow * 2];
+					anEndX[nI] = __max(m_pnROISpan[nRow * 2 + 1], anStartX[nI]);
+					if (m_pucROIMask != NULL)
+						apucMask[nI] = m_pucROIMask + nRow * m_nWid;
+				}
+			}
+			int nStartU = __min(anStartX[0], anStartX[1]);
+			int nEndU = __max(anEndX[0], anEndX[1]);
+
+			for (nI = 0; nI < 2; nI++)
+			{
+				apfTrans[nI] = m_pfTransmissionR + (2 * nY + nI) * m_nWid;
+				if (bDeferred == true)
+				{
+					apfTrans[nI] = pfTransRow + nI * m_nWid;
+					if (nEndU > nStartU)
+						TransmissionRow(2 * nY + nI, nStartU, nEndU, apfTrans[nI]);
+				}
+			}
+
+			// (2) luma
+			for (nI = 0; nI < 2; nI++)
+			{
+				uchar* inptr = imInput.ptr<uchar>(2 * nY + nI);
+				uchar* outptr = imOutput.ptr<uchar>(2 * nY + nI);
+				float* pfTransR = apfTrans[nI];
+
+				// copy through the outside of the ROI
+				if (inptr != outptr)
+				{
+					memcpy(outptr, inptr, anStartX[nI]);
+					memcpy(outptr + anEndX[nI], inptr + anEndX[nI], m_nWid - anEndX[nI]);
+				}
+
+				for (nX = anStartX[nI]; nX < anEndX[nI]; nX++)
+				{
+					if (apucMask[nI] != NULL && apucMask[nI][nX] == 0)
+					{
+						outptr[nX] = inptr[nX];
+						continue;
+					}
+
+					float fTrans = CLIP_Z(pfTransR[nX]);
+					if (bBlend == true)
+						fTrans = fTrans / (fTrans + fStrength * (1.0f - fTrans));
+
+					outptr[nX] = pucTone[(uchar)CLIP((((float)inptr[nX] - fA_Y) / fTrans + fA_Y))];
+				}
+			}
+
+			// (3) chroma, the mean transmission of the 2*2 luma pixels
+			uchar* pucU = pucInU + nY * nInStepC;
+			uchar* pucV = pucInV + nY * nInStepC;
+			uchar* pucOU = pucOutU + nY * nOutStepC;
+			uchar* pucOV = pucOutV + nY * nOutStepC;
+
+			for (nX = 0; nX < m_nWid / 2; nX++)
+			{
+				int nXL = 2 * nX;
+				int nC = nX * nPitch;
+
+				if (nXL < anStartX[0] || nXL >= anEndX[0] || (apucMask[0] != NULL && apucMask[0][nXL] == 0))
+				{
+					pucOU[nC] = pucU[nC];
+					pucOV[nC] = pucV[nC];
+					continue;
+				}
+
+				int nXR = __min(nXL + 1, nEndU - 1);
+				float fTrans = 0.25f * (CLIP_Z(apfTrans[0][nXL]) + CLIP_Z(apfTrans[0][nXR]) + CLIP_Z(apfTrans[1][nXL]) + CLIP_Z(apfTrans[1][nXR]));
+				if (bBlend == true)
+					fTrans = fTrans / (fTrans + fStrength * (1.0f - fTrans));
+
+				pucOU[nC] = (uchar)CLIP((((float)pucU[nC] - fA_U) / fTrans + fA_U));
+				pucOV[nC] = (uchar)CLIP((((float)pucV[nC] - fA_V) / fTrans + fA_V));
+			}
+		}
+	}
+}